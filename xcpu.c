@@ -4,9 +4,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include "xis.h"
 #include "xcpu.h"
 #include "xdb.h"
+#include "xout.h"
+#include "xspin.h"
 
 
 /**************************************************************************
@@ -18,6 +21,20 @@ void fatal(char *errmsg){
   // some memory-freeing should happen here too...
 }
 
+/**************************************************************************
+   Allocate a zeroed array of n objects, aligned to cache lines.
+***************************************************************************/
+void * xcpu_calloc(size_t n, size_t size){
+  void *p;
+  size = (size + X_CACHE_LINE - 1) / X_CACHE_LINE * X_CACHE_LINE;
+  if (n == 0 || (p = aligned_alloc(X_CACHE_LINE, n * size)) == NULL){
+    fprintf(stderr, "FAILURE IN <xcpu_calloc>: OUT OF MEMORY\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(p, 0, n * size);
+  return p;
+}
+
 /* **************************************************************************
    CREATE A JUMP TABLE TO THE INSTRUCTION FUNCTIONS
    =-=-=-=-=-=-=-=-=-=-=-==-=-=-=-=-=-=-=-=-=-=-=-=
@@ -53,7 +70,7 @@ void* build_jump_table(void){
   table[I_TRAP] = trap;    table[I_LIT]   = lit;
   // Instructions for handling threading (added in Assignment 3)
   table[I_CPUID] = cpuid;  table[I_CPUNUM]= cpunum;  table[I_LOADA] = loada;
-  table[I_TNSET] = tnset;  table[I_STORA] = stora;
+  table[I_TNSET] = tnset;  table[I_STORA] = stora;  table[I_IPI]   = ipi;
   return table;
 }
 /*************************************************
@@ -78,22 +95,23 @@ void xcpu_print( xcpu *c ) {
     abort();
   }
 
-  fprintf( stdout, "%2.2d> PC: %4.4x, State: %4.4x\n" , c->id, c->pc, c->state );
-  fprintf( stdout, "%2.2d> Registers: ", c->id );
+  xout_printf( c->console, c->id, "%2.2d> PC: %4.4x, State: %4.4x\n" ,
+               c->id, c->pc, c->state );
+  xout_printf( c->console, c->id, "%2.2d> Registers: ", c->id );
   for( i = 0; i < X_MAX_REGS; i++ ) {
     if( !( i % 8 ) ) {
-      fprintf( stdout, "\n%2.2d>     ", c->id );
+      xout_printf( c->console, c->id, "\n%2.2d>     ", c->id );
     }
-    fprintf( stdout, " r%2.2d:%4.4x", i, c->regs[i] );
+    xout_printf( c->console, c->id, " r%2.2d:%4.4x", i, c->regs[i] );
   }
-  fprintf( stdout, "\n" );
+  xout_printf( c->console, c->id, "\n" );
 
   op1 = c->memory[c->pc];
   op2 = c->memory[c->pc + 1];
   for( i = 0; i < I_NUM; i++ ) {
     if( x_instructions[i].code == c->memory[c->pc] ) {
-      fprintf( stdout, "%2.2d> Instruction: %s ", c->id,
-               x_instructions[i].inst );
+      xout_printf( c->console, c->id, "%2.2d> Instruction: %s ", c->id,
+                   x_instructions[i].inst );
       break;
     }
   }
@@ -101,22 +119,24 @@ void xcpu_print( xcpu *c ) {
   switch( XIS_NUM_OPS( op1 ) ) {
   case 1:
     if( op1 & XIS_1_IMED ) {
-      fprintf( stdout, "%d", op2 );
+      xout_printf( c->console, c->id, "%d", op2 );
     } else {
-      fprintf( stdout, "r%d", XIS_REG1( op2 ) );
+      xout_printf( c->console, c->id, "r%d", XIS_REG1( op2 ) );
     }
     break;
   case 2:
-    fprintf( stdout, "r%d, r%d", XIS_REG1( op2 ), XIS_REG2( op2 ) );
+    xout_printf( c->console, c->id, "r%d, r%d",
+                 XIS_REG1( op2 ), XIS_REG2( op2 ) );
     break;
   case XIS_EXTENDED:
-    fprintf( stdout, "%u", (c->memory[c->pc + 2] << 8) | c->memory[c->pc + 3] );
+    xout_printf( c->console, c->id, "%u",
+                 (c->memory[c->pc + 2] << 8) | c->memory[c->pc + 3] );
     if( op1 & XIS_X_REG ) {
-      fprintf( stdout, ", r%d", XIS_REG1( op2 ) );
+      xout_printf( c->console, c->id, ", r%d", XIS_REG1( op2 ) );
     }
     break;
   }
-  fprintf( stdout, "\n" );
+  xout_printf( c->console, c->id, "\n" );
 
   if( pthread_mutex_unlock( &lk ) ) {
     printf( "Failure to release lock!" );
@@ -133,12 +153,13 @@ void xcpu_print( xcpu *c ) {
 int xcpu_execute(xcpu *c, IHandler *table) {
 
   unsigned char opcode; //[c->num];
-  unsigned short int instruction; //[c->num];
-  
-  instruction = FETCH_WORD(c->pc);
-  opcode = (unsigned char)( (instruction >> 8) & 0x00FF); 
+  xdecoded scratch, *d;
+
+  // decoding is done once per address, and kept in the shared cache
+  d = xdcache_fetch(c, table, &scratch);
+  opcode = d->opcode; // d may be stale once the instruction has run
   c->pc += WORD_SIZE;  // extended instructions will increment pc a 2nd time
-  (table[opcode])(c, instruction);
+  (d->handler)(c, d->instruction);
   if (c->state & 0x2) // check
     xcpu_print(c);
   //////////////////////
@@ -183,8 +204,9 @@ int xcpu_exception( xcpu *c, unsigned int ex ) {
 
 INSTRUCTION(bad){
   if ((unsigned char)( (instruction >> 8) & 0x00FF) != 0x00){ 
-    printf("\n***** BAD INSTRUCTION ON CPU %d: 0x%4.4x at PC 0x%4.4x *****\n",
-           c->id, instruction, (c->pc)-WORD_SIZE);
+    xout_printf(c->console, c->id,
+                "\n***** BAD INSTRUCTION ON CPU %d: 0x%4.4x at PC 0x%4.4x *****\n",
+                c->id, instruction & 0xFFFF, (c->pc)-WORD_SIZE);
   }
 }
 INSTRUCTION(ret){
@@ -218,7 +240,7 @@ INSTRUCTION(callr){
   c->pc = c->regs[XIS_REG1(instruction)];
 }
 INSTRUCTION(out){
-  fprintf(stdout, "%c", (char)(c->regs[XIS_REG1(instruction)] & 0xFF));
+  xout_putc(c->console, c->id, c->regs[XIS_REG1(instruction)] & 0xFF);
 }
 INSTRUCTION(inc){
   c->regs[XIS_REG1(instruction)]++;
@@ -294,33 +316,33 @@ INSTRUCTION(load){
     FETCH_WORD(c->regs[XIS_REG1(instruction)]);
 }
 INSTRUCTION(stor){
-  c->memory[c->regs[XIS_REG2(instruction)] % MEMSIZE] =
-    (unsigned char) ((c->regs[XIS_REG1(instruction)] >> 8));
-  c->memory[(c->regs[XIS_REG2(instruction)]+1) % MEMSIZE] =
-    (unsigned char) ((c->regs[XIS_REG1(instruction)]) & 0xFF);
+  STORE_WORD(c->regs[XIS_REG2(instruction)], c->regs[XIS_REG1(instruction)]);
+  XDC_WROTE(c->regs[XIS_REG2(instruction)], WORD_SIZE);
 }
 INSTRUCTION(loadb){
   c->regs[XIS_REG2(instruction)] =
-    c->memory[c->regs[XIS_REG1(instruction)] % MEMSIZE];
+    c->memory[c->regs[XIS_REG1(instruction)]];
 }
 INSTRUCTION(storb){
-  c->memory[c->regs[XIS_REG2(instruction)] % MEMSIZE] =
-    c->regs[XIS_REG1(instruction)] & 0x00FF; // low byte mask
+  STORE_BYTE(c->regs[XIS_REG2(instruction)],
+             c->regs[XIS_REG1(instruction)] & 0x00FF); // low byte mask
+  XDC_WROTE(c->regs[XIS_REG2(instruction)], 1);
 }
 /*************************
  * extended instructions *
  *************************/
+// (the extension word arrives in the high half of the instruction argument)
 INSTRUCTION(jmp){
-  c->pc = FETCH_WORD(c->pc);
+  c->pc = instruction >> 16;
 }
 INSTRUCTION(call){
-  unsigned short int label = FETCH_WORD(c->pc);
+  unsigned short int label = instruction >> 16;
   c->pc += WORD_SIZE;
   PUSHER(c->pc);
   c->pc = label; 
 }
 INSTRUCTION(loadi){
-  unsigned short int value = FETCH_WORD(c->pc);
+  unsigned short int value = instruction >> 16;
   c->pc += WORD_SIZE;
   c->regs[XIS_REG1(instruction) ] = value;
 }
@@ -350,25 +372,90 @@ INSTRUCTION(cpuid){
 INSTRUCTION(cpunum){
   c->regs[XIS_REG1(instruction)] = c->num;
 }
+/**
+ * The atomic instructions work on whole 16-bit words of guest memory with
+ * C11 atomics, so CPUs spinning on a lock no longer queue up behind a mutex:
+ * tnset is an atomic exchange, and loada and stora are an acquire load and a
+ * release store. Guest words are big-endian, so they are byte-swapped on the
+ * way in and out on a little-endian host. A word at an odd address cannot be
+ * reached by a single atomic access, so those (and the odd tnset whose two
+ * registers are the same) still go through elk, which only keeps them atomic
+ * with respect to each other. Plain load and stor are left alone. (An
+ * atomic store to address 0 is copied to the mirror after, so a CPU may
+ * briefly see the old byte there in the word at 0xFFFF.)
+ **/
+#define ATOMIC_WORD(addr) ((_Atomic unsigned short *) (c->memory + (addr)))
+
+// the "execution lock", for the accesses that cannot be atomic; it is only
+// ever held for the one access, so every machine may as well share it
+static pthread_mutex_t elk = PTHREAD_MUTEX_INITIALIZER;
+
 INSTRUCTION(loada){
-  LOCK(elk);  
-  c->regs[XIS_REG2(instruction)] = FETCH_WORD(c->regs[XIS_REG1(instruction)]);
-  UNLOCK(elk);
+  unsigned short addr = c->regs[XIS_REG1(instruction)];
+  if (addr & 1){
+    LOCK(elk);
+    c->regs[XIS_REG2(instruction)] = FETCH_WORD(addr);
+    UNLOCK(elk);
+  } else {
+    c->regs[XIS_REG2(instruction)] =
+      SWAP_WORD(atomic_load_explicit(ATOMIC_WORD(addr), memory_order_acquire));
+  }
+  if (c->spin)    // a loada is how many a spin loop waits (see xspin.h)
+    xspin_note(c, addr, c->regs[XIS_REG2(instruction)]);
 }
 INSTRUCTION(stora){
-  LOCK(elk);
-  c->memory[c->regs[XIS_REG2(instruction)] % MEMSIZE] =
-    (unsigned char) ((c->regs[XIS_REG1(instruction)] >> 8));
-  c->memory[(c->regs[XIS_REG2(instruction)]+1) % MEMSIZE] =
-    (unsigned char) ((c->regs[XIS_REG1(instruction)]) & 0xFF);  
-  UNLOCK(elk);
+  unsigned short addr = c->regs[XIS_REG2(instruction)];
+  unsigned short word = c->regs[XIS_REG1(instruction)];
+  if (addr & 1){
+    LOCK(elk);
+    STORE_WORD(addr, word);
+    UNLOCK(elk);
+  } else {
+    atomic_store_explicit(ATOMIC_WORD(addr), SWAP_WORD(word),
+                          memory_order_release);
+    xcpu_mirror(c->memory, addr, WORD_SIZE);
+    xcpu_dirty(c, addr, WORD_SIZE);
+  }
+  XDC_WROTE(addr, WORD_SIZE);
 }
 INSTRUCTION(tnset){
-  LOCK(elk);
-  c->regs[XIS_REG2(instruction)] = FETCH_WORD(c->regs[XIS_REG1(instruction)]);
-  c->memory[c->regs[XIS_REG1(instruction)] % MEMSIZE] = 0;
-  c->memory[(c->regs[XIS_REG1(instruction)]+1) % MEMSIZE] = 1;
-  UNLOCK(elk);
+  unsigned short addr = c->regs[XIS_REG1(instruction)];
+  unsigned short old;
+  if ((addr & 1) || XIS_REG1(instruction) == XIS_REG2(instruction)){
+    // the lock is set at wherever REG1 points *after* the fetch
+    LOCK(elk);
+    c->regs[XIS_REG2(instruction)] = old = FETCH_WORD(addr);
+    addr = c->regs[XIS_REG1(instruction)];
+    STORE_WORD(addr, 1);
+    UNLOCK(elk);
+  } else {
+    c->regs[XIS_REG2(instruction)] = old =
+      SWAP_WORD(atomic_exchange_explicit(ATOMIC_WORD(addr), SWAP_WORD(1),
+                                         memory_order_acq_rel));
+    xcpu_mirror(c->memory, addr, WORD_SIZE);
+    xcpu_dirty(c, addr, WORD_SIZE);
+  }
+  XDC_WROTE(addr, WORD_SIZE);
+  if (c->spin)    // ...and a tnset is how the rest do
+    xspin_note(c, addr, old);
+}
+/**
+ * An ipi (inter-processor interrupt) raises X_E_IPI on the CPU whose id is
+ * in the register, by way of its ipi flag: the CPU takes it between bursts,
+ * once it has an interrupt table and is not already handling an exception,
+ * and is woken for it if it is asleep in a wait (see xspin.h). Several ipis
+ * sent before it gets round to taking one come to a single interrupt, and
+ * an ipi to a CPU that does not exist is lost.
+ **/
+INSTRUCTION(ipi){
+  unsigned short to = c->regs[XIS_REG1(instruction)];
+  xcpu *peer;
+  if (c->peers == NULL || to >= c->num)
+    return;
+  peer = &c->peers[to];
+  __atomic_store_n(&peer->ipi, 1, __ATOMIC_SEQ_CST);
+  if (peer->spin)
+    xspin_wake(peer);
 }
 
 /** That's all, folks! **/
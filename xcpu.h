@@ -13,22 +13,145 @@
 
 #define X_STACK_REG           15     /* stack register */
 
+/**
+ * Each CPU notes which pages of memory it writes to, a byte per page
+ * (XCPU_DIRTY, once written), for the machine to gather up: so that it can
+ * put a machine back as it was (see xmachine_reset), or save it (see
+ * xmachine_save_delta), by copying just the pages written since. A byte
+ * each, not a bit, so that a store marks its page with a plain store; a
+ * map each, not one per machine, so that CPUs on different host cores do
+ * not fight over it.
+ **/
+#define X_PAGE_BITS           8      /* pages are 256 bytes */
+#define X_PAGES               256    /* MEMSIZE >> X_PAGE_BITS */
+#define XCPU_DIRTY            0xFF
+
+/**
+ * The covered build of the threaded engine (xcpu_run_covered) counts the
+ * edges of the guest's control flow as it goes, AFL-style: each jump, call,
+ * return or taken branch, and each trap, from wherever the last one went
+ * (halved, so that there and back are different edges) to its target, is
+ * counted in c->edges, a byte per edge, wrapping round, at the two XORed.
+ **/
+#define XCPU_EDGES            0x10000 /* bytes in a map of edges */
+
+/**
+ * Each CPU's context (and anything else that only it writes to, cycle after
+ * cycle) is given cache lines of its own, so that CPUs running side by side
+ * on different host cores do not keep stealing the lines from one another.
+ * Arrays of such things must be allocated with xcpu_calloc.
+ **/
+#define X_CACHE_LINE          64
+#define X_ALIGNED             __attribute__((aligned(X_CACHE_LINE)))
+
+struct xdcache;
+struct xout;
+struct xspin;
+
 typedef struct xcpu_context {        
   unsigned char *memory;              /* pointer to shared memory segment */
+  struct xdcache *decoded;            /* predecoded instructions, or NULL */
+  struct xout *console;               /* where out writes, or NULL for stdout */
+  struct xspin *spin;                 /* spin-wait detector, or NULL */
+  struct xcpu_context *peers;         /* every CPU, by id (for ipi), or NULL */
+  int ipi;                            /* another CPU has sent this one an ipi */
   unsigned short regs[X_MAX_REGS];    /* general register file */
   unsigned short state;               /* state register */
   unsigned short itr;                 /* interrupt table register */
   unsigned short id;                  /* cpu identifier */
   unsigned short num;                 /* number of cpus */
   unsigned short pc;                  /* program counter */
-  /** moved pc to bottom of struct, to guard against buffer overflow vulns **/
-} xcpu;
+  unsigned char *edges;               /* edges taken, counted by the covered
+                                         build of xcpu_run (XCPU_EDGES), or
+                                         NULL */
+  unsigned short from;                /* where the last one went, halved */
+  unsigned char dirty[X_PAGES];       /* pages written to (XCPU_DIRTY); kept
+                                         last, so the rest stay near the top */
+} X_ALIGNED xcpu;
 
 
 /**
- * Pointer to jump table of instruction-handling functions. 
+ * Pointer to jump table of instruction-handling functions. The low 16 bits
+ * of the instruction argument hold the instruction word itself; extended
+ * instructions (jmp, call, loadi) find their extension word in the high 16
+ * bits, so that they need not fetch it from memory a second time.
  **/
-typedef void (*IHandler)(xcpu*, unsigned short int);
+typedef void (*IHandler)(xcpu*, unsigned int);
+
+/**
+ * A predecoded instruction. Decoding an instruction -- fetching it, finding
+ * its handler, and picking out its operands and extension word -- is done
+ * once per address, rather than once per cycle, and the result is cached in
+ * an xdcache, which is shared by every CPU that shares the memory. Since the
+ * register files are private to each CPU, the register operands are kept as
+ * indices into c->regs, rather than as pointers.
+ **/
+typedef struct xdecoded {
+  IHandler handler;                   /* NULL if not (or no longer) decoded */
+  unsigned int instruction;           /* instruction, extension word above */
+  unsigned int partner;               /* the second of a fused pair */
+  unsigned short op;                  /* opcode, or XF_OP of a fused pair */
+  unsigned char opcode;
+  unsigned char reg1;                 /* XIS_REG1 of the instruction */
+  unsigned char reg2;                 /* XIS_REG2 of the instruction */
+  unsigned char size;                 /* bytes: 2, or 4 if extended */
+  unsigned char fused;                /* XF_NONE, or the pair it begins */
+  unsigned char span;                 /* bytes covered, partner included */
+} xdecoded;
+
+/**
+ * Some pairs of instructions turn up together all the time (a compare and
+ * the branch on its result; a loadi of a constant and the add that uses it;
+ * runs of pushes and pops), so they are fused when they are decoded, and the
+ * threaded engine runs each pair for the price of a single dispatch. The
+ * entry for the first instruction says which pair it begins, and holds the
+ * second as its partner; span covers both, so that a store to either one
+ * drops the fused entry. Other engines simply ignore the fusion.
+ **/
+enum {
+  XF_NONE,
+  XF_TEST_BR,    /* test rX, rY; br L */
+  XF_CMP_BR,     /* cmp rX, rY; br L */
+  XF_EQU_BR,     /* equ rX, rY; br L */
+  XF_LOADI_ADD,  /* loadi N, rX; add rY, rZ */
+  XF_PUSH_PUSH,  /* push rX; push rY */
+  XF_POP_POP,    /* pop rX; pop rY */
+  XF_LAST
+};
+#define XF_OP(fused)   (0x100 + (fused))
+#define XDC_MAX_SPAN   (3*WORD_SIZE)  /* loadi and add */
+
+/**
+ * When the cache is asked to (idle is set), a branch back to the top of a
+ * loop that can do nothing but wait for an interrupt -- one that writes no
+ * register and touches no memory, such as a jr to itself -- is decoded with
+ * the op XDC_IDLE, rather than its opcode, and no pair is fused across it.
+ * The engines stop (with X_STOP_IDLE) when such a branch is taken, so that
+ * xmpsim can skip the loop's cycles up to the next interrupt.
+ **/
+#define XDC_IDLE       XF_OP(XF_LAST)
+#define XDC_IDLE_SPAN  (8*WORD_SIZE)  /* longest idle loop, in bytes */
+
+/**
+ * The cache covers the loaded image (addresses below limit), which is where
+ * all of the code lives; anything executed beyond it is decoded afresh each
+ * time. Every store that might overlap a cached instruction (any store below
+ * reach) must be reported with XDC_WROTE, so that the stale entries can be
+ * dropped and self-modifying code keeps working.
+ **/
+typedef struct xdcache {
+  IHandler *table;                    /* jump table the handlers come from */
+  unsigned int limit;                 /* addresses below limit are cached */
+  unsigned int reach;                 /* stores below reach may hit code */
+  int shared;                         /* true if several CPUs use the cache */
+  unsigned int generation;            /* bumped whenever code is overwritten */
+  int idle;                           /* mark the branches of idle loops */
+  pthread_mutex_t lock;               /* serialises the filling of entries */
+  xdecoded *entry;                    /* one entry per address below limit */
+  struct xspin *spin;                 /* the CPUs' spin detectors (xspin.h) */
+  int nspin;
+  unsigned int parked;                /* CPUs asleep, waiting for a store */
+} xdcache;
 
 /* title: execute next instruction
  * param: pointer to CPU context
@@ -37,18 +160,57 @@ typedef void (*IHandler)(xcpu*, unsigned short int);
  */
 extern int xcpu_execute( xcpu *c, IHandler *table );
 
+/* why a burst of instructions came to an end */
+enum {
+  X_STOP_BUDGET,     /* ran as many instructions as it was allowed */
+  X_STOP_HALT,       /* met a halting (bad) instruction */
+  X_STOP_EXCEPTION,  /* took a trap */
+  X_STOP_DEBUG,      /* the debug bit is set, and this build cannot trace */
+  X_STOP_SPIN,       /* looks to be spinning on an atomic read (xspin.h) */
+  X_STOP_IDLE        /* took the branch of an idle loop (XDC_IDLE) */
+};
+
+typedef struct xstop {
+  int reason;                         /* one of X_STOP_* */
+  unsigned short pc;                  /* last instruction fetched */
+} xstop;
+
+/* title: run a burst of instructions through the threaded-dispatch engine
+ * param: pointer to CPU context, jump table, the maximum number of
+ *        instructions to run, and where to say why the run stopped
+ * function: performs up to max_cycles instructions, starting at c->pc;
+ *           xcpu_run has tracing compiled out, and stops as soon as the
+ *           debug bit is set, while xcpu_run_traced prints the legacy
+ *           trace, and xcpu_run_covered does as well, counting the edges
+ *           taken into c->edges besides (see XCPU_EDGES)
+ * returns: the number of instructions completed (xcpuj.c)
+ */
+extern int xcpu_run( xcpu *c, IHandler *table, int max_cycles, xstop *stop );
+extern int xcpu_run_traced( xcpu *c, IHandler *table, int max_cycles,
+                            xstop *stop );
+extern int xcpu_run_covered( xcpu *c, IHandler *table, int max_cycles,
+                             xstop *stop );
+
+/* title: report how often each fused pair ran in the threaded engine
+ * param: where to print the report
+ * function: only counts if xcpuj_fusion_stats was set before the run
+ */
+extern void xcpuj_fusion_report( FILE *f );
+extern int xcpuj_fusion_stats;
+
 
 // i should be 0 if regular interrupt, 2 if trap, 4 if fault, so enum*2?
 enum {
   X_E_INTR,    /* Interrupt has occurred */ // 0 
   X_E_TRAP,    /* Trap has occurred */      // 1
   X_E_FAULT,   /* Fault has occurred */     // 2
-  X_E_LAST                                  // 3  
+  X_E_IPI,     /* Another CPU sent an ipi */ // 3
+  X_E_LAST                                  // 4  
 };
 
-/* title: generate an exception (interrupt, trap, or fault)
+/* title: generate an exception (interrupt, trap, fault, or ipi)
  * param: pointer to CPU context, type of exception
- *        (X_E_INTR, X_E_TRAP, X_E_FAULT)
+ *        (X_E_INTR, X_E_TRAP, X_E_FAULT, X_E_IPI)
  * function: generates the exception, pushes current state register and
              pc on stack, jumps to handler, sets the X_STATE_IN_EXCEPTION
  *           bit in state register
@@ -56,6 +218,28 @@ enum {
  */
 extern int xcpu_exception( xcpu *c, unsigned int ex );
 
+/* title: create/destroy a predecoded instruction cache
+ * param: the jump table, the length of the loaded image, and whether the
+ *        cache will be shared by several CPUs
+ * returns: the new cache (exits on failure)
+ */
+extern xdcache * xdcache_create( IHandler *table, unsigned int limit,
+                                 int shared );
+extern void xdcache_destroy( xdcache *dc );
+
+/* title: look up the decoded instruction at c->pc
+ * param: pointer to CPU context, jump table, and room for the decoding
+ *        (copied there, so that another CPU's stores cannot change it)
+ * returns: scratch
+ */
+extern xdecoded * xdcache_fetch( xcpu *c, IHandler *table, xdecoded *scratch );
+extern xdecoded * xdcache_lookup( xcpu *c, IHandler *table,
+                                  unsigned short int pc, xdecoded *scratch );
+
+/* title: drop the cached instructions overlapping n bytes at addr
+ */
+extern void xdcache_invalidate( xdcache *dc, unsigned int addr, int n );
+
 /** ADDED BY OLF **/
 //#define X_INSTRUCTIONS_NOT_NEEDED
 
@@ -64,29 +248,97 @@ extern int xcpu_exception( xcpu *c, unsigned int ex );
 #define MEMSIZE 0x10000//0x10000
 #define LOG stderr
 
+// report a store of n bytes at addr to the predecoded instruction cache
+#define XDC_WROTE(addr, n)                                              \
+  do {                                                                  \
+    if (c->decoded && (((addr) + (n) - 1) % MEMSIZE < c->decoded->reach \
+                       || (addr) % MEMSIZE < c->decoded->reach))        \
+      xdcache_invalidate(c->decoded, (addr), (n));                      \
+  } while (0)
+
+/******************************************************************
+   Memory is MEMSIZE bytes, followed by MIRROR_SIZE more: a copy of
+   the byte at address 0, which is where the word at the very top
+   (0xFFFF) finds its second byte. So a word at any address is read
+   with a single unaligned 16-bit load (and a byte swap, on a
+   little-endian host), with nothing to wrap round; a store to
+   either end of memory copies the byte across (xcpu_mirror), as
+   STORE_WORD and STORE_BYTE do. Anything that allocates memory for
+   a CPU must allocate MEMSIZE + MIRROR_SIZE bytes, and anything that
+   writes to it other than through these must mirror byte 0 itself.
+******************************************************************/
+#define MIRROR_SIZE 1
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SWAP_WORD(w)     __builtin_bswap16(w)
+#else
+#define SWAP_WORD(w)     (w)
+#endif
+
+_Static_assert(X_PAGES << X_PAGE_BITS == MEMSIZE, "X_PAGES is MEMSIZE's");
+
+// after a store of n bytes at addr: bring the copy of byte 0 up to date
+static inline void xcpu_mirror( unsigned char *memory, unsigned short addr,
+                                int n ){
+  if (addr == 0)
+    memory[MEMSIZE] = memory[0];
+  else if (addr > MEMSIZE - n)
+    memory[0] = memory[MEMSIZE];
+}
+
+// and mark the page (or pages: a word may span two) that it landed on
+static inline void xcpu_dirty( xcpu *c, unsigned short addr, int n ){
+  c->dirty[addr >> X_PAGE_BITS] = XCPU_DIRTY;
+  c->dirty[(unsigned short) (addr + n - 1) >> X_PAGE_BITS] = XCPU_DIRTY;
+}
+
+static inline unsigned short xcpu_fetch_word( const unsigned char *memory,
+                                              unsigned short addr ){
+  unsigned short word;
+  __builtin_memcpy(&word, memory + addr, WORD_SIZE);
+  return SWAP_WORD(word);
+}
+
+static inline void xcpu_store_word( xcpu *c, unsigned short addr,
+                                    unsigned short word ){
+  word = SWAP_WORD(word);
+  __builtin_memcpy(c->memory + addr, &word, WORD_SIZE);
+  xcpu_mirror(c->memory, addr, WORD_SIZE);
+  xcpu_dirty(c, addr, WORD_SIZE);
+}
+
+static inline void xcpu_store_byte( xcpu *c, unsigned short addr,
+                                    unsigned char byte ){
+  c->memory[addr] = byte;
+  xcpu_mirror(c->memory, addr, 1);
+  xcpu_dirty(c, addr, 1);
+}
+
 /******************************************************************
    Constructs a word out of two contiguous bytes in a byte array,
    and returns it. Can be used to fetch instructions, labels, and
-   immediate values.
+   immediate values. The address is taken modulo MEMSIZE (as an
+   unsigned short).
 ******************************************************************/
-#define FETCH_WORD(ptr)                                                 \
-  (((unsigned short int) (c->memory[(ptr) % MEMSIZE] << 8)) & 0xFF00)   \
-  |(((unsigned short int) (c->memory[((ptr)+1) % MEMSIZE])) & 0x00FF)
+#define FETCH_WORD(ptr)         xcpu_fetch_word(c->memory, (ptr))
+
+// and store a word, or a byte, at an address (again modulo MEMSIZE)
+#define STORE_WORD(ptr, word)   xcpu_store_word(c, (ptr), (word))
+#define STORE_BYTE(ptr, byte)   xcpu_store_byte(c, (ptr), (byte))
 
 // a helper macro for the various push-style instructions
 #define PUSHER(word)                                                    \
-  c->regs[15] -= 2;                                                     \
-  c->memory[c->regs[15] % MEMSIZE] = (unsigned char) (word >> 8);       \
-  c->memory[(c->regs[15] + 1) % MEMSIZE] = (unsigned char) (word & 0xFF)
+  do {                                                                  \
+    c->regs[15] -= 2;                                                   \
+    STORE_WORD(c->regs[15], word);                                      \
+    XDC_WROTE(c->regs[15], WORD_SIZE);                                  \
+  } while (0)
 
 // helper macro for pop-style instructions
 #define POPPER(dest)                            \
   dest = FETCH_WORD(c->regs[15]);               \
   c->regs[15] += 2;
 
-// Global xmpsim lock variable, "execution lock". 
-static pthread_mutex_t elk = PTHREAD_MUTEX_INITIALIZER; 
-
 #define LOCK(lockname) \
   if (pthread_mutex_lock(&(lockname))){ \
     fprintf(LOG, "-=-= FAILURE TO ACQUIRE LOCK! =-=-\n"); \
@@ -109,6 +361,12 @@ extern void xcpu_print(xcpu *c);
 extern void * build_jump_table(void);
 extern void destroy_jump_table(void * addr);
 extern void fatal(char* errmsg);
+/* title: allocate n zeroed objects, each starting on a cache line of its own
+ * param: their number and size (a multiple of X_CACHE_LINE, as it is for a
+ *        type declared X_ALIGNED); free them with free
+ * returns: the array (exits on failure)
+ */
+extern void * xcpu_calloc(size_t n, size_t size);
 
 /**
  * The instruction functions are all constrained to have identical signatures,
@@ -117,7 +375,7 @@ extern void fatal(char* errmsg);
  * use a single macro to define their prototypes. The same macro can be used
  * for calling the functions. 
  **/
-#define INSTRUCTION(x)  void x(xcpu *c, unsigned short int instruction)
+#define INSTRUCTION(x)  void x(xcpu *c, unsigned int instruction)
 // instructions added in Assignment 1 (base set)
 INSTRUCTION(bad);      INSTRUCTION(ret);      INSTRUCTION(cld);
 INSTRUCTION(std);      INSTRUCTION(neg);      INSTRUCTION(not);
@@ -136,7 +394,7 @@ INSTRUCTION(cli);      INSTRUCTION(sti);      INSTRUCTION(iret);
 INSTRUCTION(trap);     INSTRUCTION(lit);
 // instructions added in Assignment 3 (threading)
 INSTRUCTION(cpuid);    INSTRUCTION(cpunum);   INSTRUCTION(loada);
-INSTRUCTION(stora);    INSTRUCTION(tnset);
+INSTRUCTION(stora);    INSTRUCTION(tnset);    INSTRUCTION(ipi);
 
 
 
@@ -4,443 +4,566 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
-
-
-
+#define X_INSTRUCTIONS_NOT_NEEDED
 #include "xis.h"
 #include "xcpu.h"
+#include "xout.h"
+#include "xspin.h"
 
+/**
+ * The threaded-dispatch engine, behind xcpu_run. Rather than making an
+ * indirect call through the IHandler table for every guest instruction (as
+ * xcpu_execute does), the instruction set is laid out as a series of labels
+ * inside a single run loop, and each instruction jumps straight to the label
+ * of its successor, through a static table of label addresses (a GCC
+ * extension). This spares us the call/return overhead, and gives the branch
+ * predictor one indirect jump per instruction body, rather than a single,
+ * shared, unpredictable one.
+ *
+ * For the length of a run, the pc and the register file live in locals, so
+ * that the compiler is free to keep them in host registers (c->regs can be
+ * reached through c->memory as far as it knows, so it would otherwise have to
+ * reload them after every store). They are written back to c before anything
+ * that looks at c: the xcpu.c helpers, exceptions, traces, and the return.
+ *
+ * Instructions are taken from the shared predecoded instruction cache (see
+ * xdcache.c), so the register operands and extension words come ready-made.
+ * Where the cache has fused a pair of instructions, both are run under one
+ * dispatch; a fused pair counts as two cycles, so it is only taken if the
+ * budget has room for both, and otherwise the first runs on its own.
+ *
+ * This file is compiled twice. Built plainly, it gives xcpu_run, which has
+ * no tracing at all: if std or iret switch the debug bit on, it prints the
+ * trace of that one instruction and stops, leaving the rest to the other
+ * build. Built with XCPU_TRACED defined, it gives xcpu_run_traced, which
+ * prints the legacy trace after every instruction run with the debug bit set.
+ * Built with XCPU_COVERED defined as well, it gives xcpu_run_covered, which
+ * also counts the edges taken (see XCPU_EDGES), for fuzzing (see xfuzz.c).
+ * The instruction bodies are kept as close as possible to their counterparts
+ * in xcpu.c, since the output of every engine must be bit-identical.
+ **/
 
-//#define X_INSTRUCTIONS_NOT_NEEDED
+#ifdef XCPU_COVERED
+#define XCPU_RUN    xcpu_run_covered
+#define TRACING     (c->state & X_STATE_DEBUG_ON)
+#elif defined(XCPU_TRACED)
+#define XCPU_RUN    xcpu_run_traced
+#define TRACING     (c->state & X_STATE_DEBUG_ON)
+#else
+#define XCPU_RUN    xcpu_run
+#define TRACING     0
+#endif
 
-#define WORD_SIZE 2    // word size in bytes
-#define BYTE 8         // byte size in bits
-#define MEMSIZE 0x10000
-#define LOG stderr
+// The instruction bodies are labels here, rather than functions.
+#undef INSTRUCTION
+#define INSTRUCTION(x)  x:
 
-// a handy macro for fetching word-sized chunks of data from memory
-#define FETCH_WORD(ptr)                                                 \
-  (((unsigned short int) (c->memory[(ptr) % MEMSIZE] << 8)) & 0xFF00)   \
-  |(((unsigned short int) (c->memory[((ptr)+1) % MEMSIZE])) & 0x00FF)
-// to replace deprecated fetch_word function, and save a bit of runtime.
+// the operands of the current instruction
+#define R1          regs[d->reg1]
+#define R2          regs[d->reg2]
+#define IMMEDIATE   (d->instruction >> 16)
+// the operands of the second instruction of a fused pair
+#define P1          regs[XIS_REG1(d->partner)]
+#define P2          regs[XIS_REG2(d->partner)]
 
-// a helper macro for the various push-style instructions
+// as in xcpu.h, but on the local register file
+#undef PUSHER
 #define PUSHER(word)                                                    \
-  c->regs[15] -= 2;                                                     \
-  c->memory[c->regs[15] % MEMSIZE] = (unsigned char) (word >> 8);       \
-  c->memory[(c->regs[15] + 1) % MEMSIZE] = (unsigned char) (word & 0xFF)
-
+  do {                                                                  \
+    regs[15] -= 2;                                                      \
+    STORE_WORD(regs[15], word);                                         \
+    XDC_WROTE(regs[15], WORD_SIZE);                                     \
+  } while (0)
+#undef POPPER
 #define POPPER(dest)                            \
-  dest = FETCH_WORD(c->regs[15]);               \
-  c->regs[15] += 2;
+  dest = FETCH_WORD(regs[15]);                  \
+  regs[15] += 2;
 
+// write the locals back to the cpu context, and read them in again
+#define SAVE        memcpy(c->regs, regs, sizeof(regs)); c->pc = pc
+#define RESTORE     memcpy(regs, c->regs, sizeof(regs)); pc = c->pc
 
-/** halt flag **/
-// int _halt = 1; // set to 0 when BAD instruction encountered.
-// not sure if this global approach to the halt flag is threadsafe!
+// fetch the decoded instruction at pc, and jump to it
+#define DISPATCH                                                        \
+  last = pc;                                                            \
+  if (pc >= limit                                                       \
+      || !__atomic_load_n(&(d = &entry[pc])->handler, __ATOMIC_ACQUIRE)) \
+    d = xdcache_lookup(c, table, pc, &scratch);                         \
+  pc += WORD_SIZE;                                                      \
+  goto *dispatch[d->op]
 
-extern void xcpu_pretty_print(xcpu *c);
-void xcpu_print(xcpu *c);
-int xcpu_execute( xcpu *c, IHandler *table);
-int xcpu_exception( xcpu *c, unsigned int ex );
-unsigned short int fetch_word(unsigned char *mem, unsigned short int ptr);
+// trace the instruction just run, if need be
+#ifdef XCPU_TRACED
+#define TRACE                                   \
+  if (c->state & X_STATE_DEBUG_ON){             \
+    SAVE;                                       \
+    xcpu_print(c);                              \
+  }
+#else
+#define TRACE
+#endif
 
-void * build_jump_table(void);
-void destroy_jump_table(void * addr);
-void fatal(char* errmsg);
+// count an edge of the control flow, to wherever pc now is
+#ifdef XCPU_COVERED
+#define EDGE                                                    \
+  c->edges[(unsigned short) (pc ^ c->from)]++;                  \
+  c->from = pc >> 1
+#else
+#define EDGE
+#endif
 
-/**
- * The instruction functions are all constrained to have identical signatures,
- * since pointers to these functions need to be allocated in a jump table on
- * the heap. This lets us avoid a fair bit of code repetition, since we can
- * use a single macro to define their prototypes. The same macro can be used
- * for calling the functions. 
- **/
-// #define INSTRUCTION(x) void x(xcpu *c, unsigned short int instruction)
-#define INSTRUCTION(x) \
-  x:
+// count the instruction just run, and go on to the next, budget allowing
+#define NEXT                                    \
+  TRACE;                                        \
+  if (++done == budget) goto finish;            \
+  DISPATCH
 
-/*
-// instructions added in Assignment 1 (base set)
-INSTRUCTION(bad);      INSTRUCTION(ret);      INSTRUCTION(cld);
-INSTRUCTION(std);      INSTRUCTION(neg);      INSTRUCTION(not);
-INSTRUCTION(push);     INSTRUCTION(pop);      INSTRUCTION(jmpr);
-INSTRUCTION(callr);    INSTRUCTION(out);      INSTRUCTION(inc);
-INSTRUCTION(dec);      INSTRUCTION(br);       INSTRUCTION(jr);
-INSTRUCTION(add);      INSTRUCTION(sub);      INSTRUCTION(mul);
-INSTRUCTION(divide);   INSTRUCTION(and);      INSTRUCTION(or);
-INSTRUCTION(xor);      INSTRUCTION(shr);      INSTRUCTION(shl);
-INSTRUCTION(test);     INSTRUCTION(cmp);      INSTRUCTION(equ);
-INSTRUCTION(mov);      INSTRUCTION(load);     INSTRUCTION(stor);
-INSTRUCTION(loadb);    INSTRUCTION(storb);    INSTRUCTION(jmp);
-INSTRUCTION(call);     INSTRUCTION(loadi);
-// instructions added in Assignment 2 (interrupt handling)
-INSTRUCTION(cli);      INSTRUCTION(sti);      INSTRUCTION(iret);
-INSTRUCTION(trap);     INSTRUCTION(lit);
-// instructions added in Assignment 3 (threading)
-INSTRUCTION(cpuid);    INSTRUCTION(cpunum);   INSTRUCTION(loada);
-INSTRUCTION(stora);    INSTRUCTION(tnset);
-*/
-/**************************************************************************
-   Gracefully terminate the programme on unrecoverable error.
-***************************************************************************/
-void fatal(char *errmsg){
-  fprintf(stderr, "%s\n", errmsg);
-  exit(EXIT_FAILURE);  
-  // some memory-freeing should happen here too...
-}
-/***************************************************************************
-   CREATE A JUMP TABLE TO THE INSTRUCTION FUNCTIONS
-   =-=-=-=-=-=-=-=-=-=-=-==-=-=-=-=-=-=-=-=-=-=-=-=
-   To be called only *once* per process. This should save time, as compared
-   to letting the compiler construct a jump table (as its interpretation of
-   a switch/case sequence) each time xcpu_execute is called.
-   (Called from xsim.c, just prior to the first execution loop.)
-**************************************************************************/
-void* build_jump_table(void){
-  IHandler *table = malloc(0x100 * sizeof(IHandler)); 
-  if (table == NULL){
-    fprintf(stderr, "FAILURE IN <build_jump_table>: OUT OF MEMORY\n");
-    exit(EXIT_FAILURE);
-  }
-  int p;
-  for (p = 0; p < 0x100; p++){
-    table[p] = &&bad;
-  }
-  table[I_BAD]  = &&bad;     table[I_RET]   = &&ret;     table[I_STD]   = &&std;
-  table[I_NEG]  = &&neg;     table[I_NOT]   = &&not;     table[I_PUSH]  = &&push;
-  table[I_POP]  = &&pop;     table[I_JMPR]  = &&jmpr;    table[I_CALLR] = &&callr;
-  table[I_OUT]  = &&out;     table[I_INC]   = &&inc;     table[I_DEC]   = &&dec;
-  table[I_BR]   = &&br;      table[I_JR]    = &&jr;      table[I_ADD]   = &&add;
-  table[I_SUB]  = &&sub;     table[I_MUL]   = &&mul;     table[I_DIV]   = &&divide;
-  table[I_AND]  = &&and;     table[I_OR]    = &&or;      table[I_XOR]   = &&xor;
-  table[I_SHR]  = &&shr;     table[I_SHL]   = &&shl;     table[I_TEST]  = &&test;
-  table[I_CMP]  = &&cmp;     table[I_EQU]   = &&equ;     table[I_MOV]   = &&mov;
-  table[I_LOAD] = &&load;    table[I_STOR]  = &&stor;    table[I_LOADB] = &&loadb;
-  table[I_STORB]= &&storb;   table[I_JMP]   = &&jmp;     table[I_CALL]  = &&call;
-  table[I_LOADI]= &&loadi;   table[I_CLD]   = &&cld;
-  // Instructions for handling interrupts (added in Assignment 2)
-  table[I_CLI]  = &&cli;     table[I_STI]   = &&sti;     table[I_IRET]  = &&iret;
-  table[I_TRAP] = &&trap;    table[I_LIT]   = &&lit;
-  // Instructions for handling threading (added in Assignment 3)
-  table[I_CPUID] = &&cpuid;  table[I_CPUNUM]= &&cpunum;  table[I_LOADA] = &&loada;
-  table[I_TNSET] = &&tnset;
-  return table;
-}
-/*************************************************
- * Free the memory allocated to the jump table.  *
- * To be called once, at the end of the process. *
- *************************************************/
-void destroy_jump_table(void* table){
-  free(table);
-}
-/******************************************
- Display information about the xcpu context
- (Legacy debugger.)
-*******************************************/
-void xcpu_print( xcpu *c ) {
-  int i;
-  unsigned int op1;
-  int op2;
+// count the instruction just run, and stop
+#define STOP(why)                               \
+  TRACE;                                        \
+  done++;                                       \
+  stop->reason = (why);                         \
+  goto finish
 
-  static pthread_mutex_t lk = PTHREAD_MUTEX_INITIALIZER;
-  if (pthread_mutex_lock(&lk)){
-    printf("Failure to acquire lock!");
-    abort();
-  }
+// as NEXT, but stop if the debug bit has just been switched on, unless
+// this build can trace it; the fast build traces this one instruction
+#ifdef XCPU_TRACED
+#define NEXT_CHECK_DEBUG  NEXT
+#else
+#define NEXT_CHECK_DEBUG                        \
+  if (c->state & X_STATE_DEBUG_ON){             \
+    SAVE;                                       \
+    xcpu_print(c);                              \
+    STOP(X_STOP_DEBUG);                         \
+  }                                             \
+  NEXT
+#endif
 
-  fprintf( stdout, "%2.2d> PC: %4.4x, State: %4.4x\n" , c->id, c->pc, c->state );
-  fprintf( stdout, "%2.2d> Registers: ", c->id );
-  for( i = 0; i < X_MAX_REGS; i++ ) {
-    if( !( i % 8 ) ) {
-      fprintf( stdout, "\n%2.2d>     ", c->id );
-    }
-    fprintf( stdout, " r%2.2d:%4.4x", i, c->regs[i] );
-  }
-  fprintf( stdout, "\n" );
-
-  op1 = c->memory[c->pc];
-  op2 = c->memory[c->pc + 1];
-  for( i = 0; i < I_NUM; i++ ) {
-    if( x_instructions[i].code == c->memory[c->pc] ) {
-      fprintf( stdout, "%2.2d> Instruction: %s ", c->id,
-               x_instructions[i].inst );
-      break;
-    }
-  }
-
-  switch( XIS_NUM_OPS( op1 ) ) {
-  case 1:
-    if( op1 & XIS_1_IMED ) {
-      fprintf( stdout, "%d", op2 );
-    } else {
-      fprintf( stdout, "r%d", XIS_REG1( op2 ) );
-    }
-    break;
-  case 2:
-    fprintf( stdout, "r%d, r%d", XIS_REG1( op2 ), XIS_REG2( op2 ) );
-    break;
-  case XIS_EXTENDED:
-    fprintf( stdout, "%u", (c->memory[c->pc + 2] << 8) | c->memory[c->pc + 3] );
-    if( op1 & XIS_X_REG ) {
-      fprintf( stdout, ", r%d", XIS_REG1( op2 ) );
-    }
-    break;
+// stop if an atomic read has just found a spin loop (see xspin.h)
+#define CHECK_SPIN                              \
+  if (c->spin && c->spin->ready){               \
+    STOP(X_STOP_SPIN);                          \
   }
-  fprintf( stdout, "\n" );
 
-  if( pthread_mutex_unlock( &lk ) ) {
-    printf( "Failure to release lock!" );
-    abort();
-  }
-}
+// a fused pair: give up on fusing if the budget cannot take both halves (or
+// each half must be traced), and otherwise count the first half as done,
+// and step on to the second
+#define FUSED(x, pair, first)                   \
+  x:                                            \
+  if (budget - done < 2 || TRACING) goto first; \
+  fired[pair]++;
+#define SECOND_HALF                             \
+  done++;                                       \
+  last = pc;                                    \
+  pc += WORD_SIZE
 
-
-int xcpu_exception( xcpu *c, unsigned int ex ) {
-  if (c->state & X_STATE_IN_EXCEPTION) {
-    return 1; // return, doing nothing, but report success
-  } else if (c->itr && (ex < X_E_LAST)) { // if itr loaded, and ex valid
-    int i = ex * WORD_SIZE; // is this right?
-    /* "i should be 0 if the exception is a regular interrupt; i should be
-       2 if the exception is a trap; and i should be 4 if the exception is a
-       fault." ex takes a value from the X_E_* enum defined in xcpu.h
-       remember that WORD_SIZE = 2.
-    */
-    PUSHER(c->state);
-    PUSHER(c->pc);
-    c->state |= 0x0004;
-    c->pc = FETCH_WORD(c->itr+i); // re: i, see comment above
-    
-    return 1; // but returns 0 when not successful. How is this gauged?
-  }
-  return 0;
-}
-/******************************************************************
-   Constructs a word out of two contiguous bytes in a byte array,
-   and returns it. Can be used to fetch instructions, labels, and
-   immediate values.
-******************************************************************/
-unsigned short int fetch_word(unsigned char *mem, unsigned short int ptr){
-  unsigned short int word =
-    (((unsigned short int) (mem[ptr % MEMSIZE] << 8)) & 0xFF00)
-    |(((unsigned short int) (mem[(ptr+1) % MEMSIZE]))   & 0x00FF);
-  return word;
-}
+#ifndef XCPU_TRACED
+// how often each pair has been run, across all CPUs
+int xcpuj_fusion_stats = 0;
+unsigned long xcpuj_fused_runs[XF_LAST];
+#else
+extern unsigned long xcpuj_fused_runs[XF_LAST];
+#endif
 
 /************************************************************
- Read the opcode, and use it as an index into the jump table. 
- Continue returning 1 until the programme halts (and the global
- _halt variable is set to 0), and which point return 0. The
- actual 'halting' is handled by xsim.c.
+ Run up to budget instructions on c, beginning at c->pc.
+ Returns the number of instructions completed, and fills in
+ *stop with the reason for stopping, and the address of the
+ last instruction fetched. A halting (bad) instruction is not
+ counted, just as in execution_loop.
 *************************************************************/
-int xcpu_execute(xcpu *c, IHandler *table) {
-  printf("you're really here!");
-  unsigned char opcode;
-  unsigned short int instruction = FETCH_WORD(c->pc);
-  //fetch_word(c->memory, c->pc); 
-  opcode = (unsigned char)( (instruction >> 8) & 0x00FF); 
-  c->pc += WORD_SIZE;  // extended instructions will increment pc a 2nd time
-  printf("op %2.2x --> %p", opcode, table[opcode]); 
-  goto (table[opcode]);//(c, instruction);
-  if (c->state & 0x2) // check
-    xcpu_print(c);
- done:
-  return (opcode != I_BAD); //_halt;
-
+int XCPU_RUN(xcpu *c, IHandler *table, int budget, xstop *stop){
+  static void *dispatch[XDC_IDLE+1] = {
+    [0 ... XDC_IDLE] = &&bad,
+    [I_BAD]  = &&bad,     [I_RET]   = &&ret,     [I_STD]   = &&std,
+    [I_NEG]  = &&neg,     [I_NOT]   = &&not,     [I_PUSH]  = &&push,
+    [I_POP]  = &&pop,     [I_JMPR]  = &&jmpr,    [I_CALLR] = &&callr,
+    [I_OUT]  = &&out,     [I_INC]   = &&inc,     [I_DEC]   = &&dec,
+    [I_BR]   = &&br,      [I_JR]    = &&jr,      [I_ADD]   = &&add,
+    [I_SUB]  = &&sub,     [I_MUL]   = &&mul,     [I_DIV]   = &&divide,
+    [I_AND]  = &&and,     [I_OR]    = &&or,      [I_XOR]   = &&xor,
+    [I_SHR]  = &&shr,     [I_SHL]   = &&shl,     [I_TEST]  = &&test,
+    [I_CMP]  = &&cmp,     [I_EQU]   = &&equ,     [I_MOV]   = &&mov,
+    [I_LOAD] = &&load,    [I_STOR]  = &&stor,    [I_LOADB] = &&loadb,
+    [I_STORB]= &&storb,   [I_JMP]   = &&jmp,     [I_CALL]  = &&call,
+    [I_LOADI]= &&loadi,   [I_CLD]   = &&cld,
+    // Instructions for handling interrupts (added in Assignment 2)
+    [I_CLI]  = &&cli,     [I_STI]   = &&sti,     [I_IRET]  = &&iret,
+    [I_TRAP] = &&trap,    [I_LIT]   = &&lit,
+    // Instructions for handling threading (added in Assignment 3)
+    [I_CPUID] = &&cpuid,  [I_CPUNUM]= &&cpunum,  [I_LOADA] = &&loada,
+    [I_TNSET] = &&tnset,  [I_STORA] = &&stora,  [I_IPI]   = &&ipi,
+    // fused pairs
+    [XF_OP(XF_TEST_BR)]    = &&test_br,    [XF_OP(XF_CMP_BR)]   = &&cmp_br,
+    [XF_OP(XF_EQU_BR)]     = &&equ_br,     [XF_OP(XF_LOADI_ADD)] = &&loadi_add,
+    [XF_OP(XF_PUSH_PUSH)]  = &&push_push,  [XF_OP(XF_POP_POP)]  = &&pop_pop,
+    // the branch that closes an idle loop
+    [XDC_IDLE] = &&idle,
+  };
+  xdecoded *entry = (c->decoded)? c->decoded->entry : NULL;
+  unsigned int limit = (c->decoded)? c->decoded->limit : 0;
+  xdecoded scratch, *d;
+  unsigned short int regs[X_MAX_REGS], pc, last = c->pc;
+  unsigned short int addr, value;
+  unsigned long fired[XF_LAST] = {0};
+  int done = 0, k;
 
+  RESTORE;
+  stop->reason = X_STOP_BUDGET;
+  if (budget <= 0)
+    goto finish;
+  if (c->state & X_STATE_DEBUG_ON && !TRACING){
+    stop->reason = X_STOP_DEBUG;
+    goto finish;
+  }
+  DISPATCH;
 
+ finish:
+  SAVE;
+  stop->pc = last;
+  if (xcpuj_fusion_stats)
+    for (k = XF_NONE+1; k < XF_LAST; k++)
+      if (fired[k])
+        __atomic_add_fetch(&xcpuj_fused_runs[k], fired[k], __ATOMIC_RELAXED);
+  return done;
 
   /*********************************
    * THE INSTRUCTION SET FUNCTIONS *
    *********************************/
 
   INSTRUCTION(bad){
-    // do nothing! 
-  goto done; }
+    SAVE;
+    bad(c, d->instruction);   // let xcpu.c report the bad instruction
+    if (d->opcode == I_BAD){  // only a zero opcode halts, as in xcpu_execute
+      TRACE;                  // (and is traced, but not counted)
+      stop->reason = X_STOP_HALT;
+      goto finish;
+    }
+    NEXT;
+  }
   INSTRUCTION(ret){
-    POPPER(c->pc);
-  goto done; }
+    POPPER(pc);
+    EDGE;
+    NEXT;
+  }
   INSTRUCTION(cld){
     c->state &= 0xfffd;
-    // clear the debug bit
-  goto done; }
+    NEXT;
+  }
   INSTRUCTION(std){
     c->state |= 0x0002;
-  goto done; }
+    NEXT_CHECK_DEBUG;
+  }
   INSTRUCTION(neg){
-    c->regs[XIS_REG1(instruction)] = ~c->regs[XIS_REG1(instruction)]+1;
-    // assuming 2'sC
-  goto done; }
+    R1 = ~R1+1;
+    NEXT;
+  }
   INSTRUCTION(not){
-    c->regs[XIS_REG1(instruction)] = !c->regs[XIS_REG1(instruction)];
-  goto done; }
+    R1 = !R1;
+    NEXT;
+  }
   INSTRUCTION(push){
-    PUSHER(c->regs[XIS_REG1(instruction)]);
-  goto done; }
+    PUSHER(R1);
+    NEXT;
+  }
   INSTRUCTION(pop){
-    POPPER(c->regs[XIS_REG1(instruction)]);
-  goto done; }
+    POPPER(R1);
+    NEXT;
+  }
   INSTRUCTION(jmpr){
-    c->pc = c->regs[XIS_REG1(instruction)];
-  goto done; }
+    pc = R1;
+    EDGE;
+    NEXT;
+  }
   INSTRUCTION(callr){
-    PUSHER(c->pc);
-    c->pc = c->regs[XIS_REG1(instruction)];
-  goto done; }
+    PUSHER(pc);
+    pc = R1;
+    EDGE;
+    NEXT;
+  }
   INSTRUCTION(out){
-    fprintf(stdout, "%c", (char)(c->regs[XIS_REG1(instruction)] & 0xFF));
-  goto done; }
+    xout_putc(c->console, c->id, R1 & 0xFF);
+    NEXT;
+  }
   INSTRUCTION(inc){
-    c->regs[XIS_REG1(instruction)]++;
-  goto done; }
+    R1++;
+    NEXT;
+  }
   INSTRUCTION(dec){
-    c->regs[XIS_REG1(instruction)]--;
-  goto done; }
+    R1--;
+    NEXT;
+  }
   INSTRUCTION(br){
-    signed char leap = instruction & 0x00FF;
-    if (c->state & 0x0001) // if condition bit of state == 1
-      c->pc = (c->pc-WORD_SIZE)+leap;
-  goto done; }
+    signed char leap = d->instruction & 0x00FF;
+    if (c->state & 0x0001){
+      pc = (pc-WORD_SIZE)+leap;
+      EDGE;
+    }
+    NEXT;
+  }
   INSTRUCTION(jr){
-    signed char leap = instruction & 0x00FF;
-    c->pc = (c->pc-WORD_SIZE)+leap; // second byte of instruction = Label
-  goto done; }
+    signed char leap = d->instruction & 0x00FF;
+    pc = (pc-WORD_SIZE)+leap;
+    EDGE;
+    NEXT;
+  }
   INSTRUCTION(add){
-    c->regs[XIS_REG2(instruction)] =
-      c->regs[XIS_REG1(instruction)] + c->regs[XIS_REG2(instruction)];
-  goto done; }
+    R2 = (R1 + R2) % 0x10000;
+    NEXT;
+  }
   INSTRUCTION(sub){
-    c->regs[XIS_REG2(instruction)] =
-      c->regs[XIS_REG2(instruction)] - c->regs[XIS_REG1(instruction)];
-  goto done; }
+    R2 = (unsigned short) R2 + ~R1;
+    NEXT;
+  }
   INSTRUCTION(mul){
-    c->regs[XIS_REG2(instruction)] =
-      c->regs[XIS_REG2(instruction)] * c->regs[XIS_REG1(instruction)];
-  goto done; }
-  INSTRUCTION(divide){  
-    c->regs[XIS_REG2(instruction)] =
-      c->regs[XIS_REG2(instruction)] / c->regs[XIS_REG1(instruction)];
-  goto done; }
+    R2 = (R2 * R1) % 0x10000;
+    NEXT;
+  }
+  INSTRUCTION(divide){
+    R2 = R2 / R1;
+    NEXT;
+  }
   INSTRUCTION(and){
-    c->regs[XIS_REG2(instruction)] =
-      c->regs[XIS_REG1(instruction)] & c->regs[XIS_REG2(instruction)];
-  goto done; }
+    R2 = R1 & R2;
+    NEXT;
+  }
   INSTRUCTION(or){
-    c->regs[XIS_REG2(instruction)] =
-      c->regs[XIS_REG2(instruction)] | c->regs[XIS_REG1(instruction)];
-  goto done; }
+    R2 = R2 | R1;
+    NEXT;
+  }
   INSTRUCTION(xor){
-    c->regs[XIS_REG2(instruction)] =
-      c->regs[XIS_REG2(instruction)] ^ c->regs[XIS_REG1(instruction)];
-  goto done; }
+    R2 = R2 ^ R1;
+    NEXT;
+  }
   INSTRUCTION(shr){
-    c->regs[XIS_REG2(instruction)] = c->regs[XIS_REG2(instruction)] >>
-      c->regs[XIS_REG1(instruction)];
-  goto done; }
+    R2 = (unsigned short) R2 >> R1;
+    NEXT;
+  }
   INSTRUCTION(shl){
-    c->regs[XIS_REG2(instruction)] = c->regs[XIS_REG2(instruction)] <<
-      c->regs[XIS_REG1(instruction)];
-  goto done; }
+    R2 = (unsigned short) R2 << R1;
+    NEXT;
+  }
   INSTRUCTION(test){
-    c->state = (c->regs[XIS_REG1(instruction)] & c->regs[XIS_REG2(instruction)])?
-      (c->state | 0x0001) : (c->state & 0xFFFE);
-  goto done; }
+    c->state = (R1 & R2)? (c->state | 0x0001) : (c->state & 0xFFFE);
+    NEXT;
+  }
   INSTRUCTION(cmp){
-    c->state = (c->regs[XIS_REG1(instruction)] < c->regs[XIS_REG2(instruction)])?
-      (c->state | 0x0001) : (c->state & 0xFFFE);
-    /** NB: cmp is only defined for unsigned integer values **/
-  goto done; }
+    c->state = (R1 < R2)? (c->state | 0x0001) : (c->state & 0xFFFE);
+    NEXT;
+  }
   INSTRUCTION(equ){
-    c->state =
-      (c->regs[XIS_REG1(instruction)]==c->regs[XIS_REG2(instruction)])?
-      (c->state | 0x0001) :
-      (c->state & 0xFFFE);
-  goto done; }
+    c->state = (R1 == R2)? (c->state | 0x0001) : (c->state & 0xFFFE);
+    NEXT;
+  }
   INSTRUCTION(mov){
-    c->regs[XIS_REG2(instruction)] = c->regs[XIS_REG1(instruction)];
-  goto done; }
+    R2 = R1;
+    NEXT;
+  }
   INSTRUCTION(load){
-    c->regs[XIS_REG2(instruction)] =
-      FETCH_WORD(c->regs[XIS_REG1(instruction)]);
-  goto done; }
+    R2 = FETCH_WORD(R1);
+    NEXT;
+  }
   INSTRUCTION(stor){
-    c->memory[c->regs[XIS_REG2(instruction)] % MEMSIZE] =
-      (unsigned char) ((c->regs[XIS_REG1(instruction)] >> 8));
-    c->memory[(c->regs[XIS_REG2(instruction)]+1) % MEMSIZE] =
-      (unsigned char) ((c->regs[XIS_REG1(instruction)]) & 0xFF);
-  goto done; }
+    addr = R2;
+    value = R1;
+    STORE_WORD(addr, value);
+    XDC_WROTE(addr, WORD_SIZE);
+    NEXT;
+  }
   INSTRUCTION(loadb){
-    c->regs[XIS_REG2(instruction)] =
-      c->memory[c->regs[XIS_REG1(instruction)] % MEMSIZE];
-  goto done; }
+    R2 = c->memory[R1];
+    NEXT;
+  }
   INSTRUCTION(storb){
-    c->memory[c->regs[XIS_REG2(instruction)] % MEMSIZE] =
-      c->regs[XIS_REG1(instruction)] & 0x00FF; // low byte mask
-  goto done; }
+    addr = R2;
+    STORE_BYTE(addr, R1 & 0x00FF);
+    XDC_WROTE(addr, 1);
+    NEXT;
+  }
   /*************************
    * extended instructions *
    *************************/
   INSTRUCTION(jmp){
-    c->pc = FETCH_WORD(c->pc);
-  goto done; }
+    pc = IMMEDIATE;
+    EDGE;
+    NEXT;
+  }
   INSTRUCTION(call){
-    unsigned short int label = FETCH_WORD(c->pc);
-    c->pc += WORD_SIZE;
-    PUSHER(c->pc);
-    c->pc = label; 
-  goto done; }
+    value = IMMEDIATE;
+    pc += WORD_SIZE;
+    PUSHER(pc);
+    pc = value;
+    EDGE;
+    NEXT;
+  }
   INSTRUCTION(loadi){
-    unsigned short int value = FETCH_WORD(c->pc);
-    c->pc += WORD_SIZE;
-    c->regs[XIS_REG1(instruction) ] = value;
-  goto done; }
+    value = IMMEDIATE;
+    pc += WORD_SIZE;
+    R1 = value;
+    NEXT;
+  }
   /*** INTERRUPT-HANDLING INSTRUCTIONS ***/
   INSTRUCTION(cli){
-    c->state &= 0xFFFB; // 0xFFFB == ~0x0004
-  goto done; }
+    c->state &= 0xFFFB;
+    NEXT;
+  }
   INSTRUCTION(sti){
     c->state |= 0x0004;
-  goto done; }
+    NEXT;
+  }
   INSTRUCTION(iret){
-    POPPER(c->pc);
+    POPPER(pc);
     POPPER(c->state);
-  goto done; }
+    EDGE;
+    NEXT_CHECK_DEBUG;   // the restored state may have the debug bit set
+  }
   INSTRUCTION(trap){
     if (!(c->state & 0x0004)){
-      xcpu_exception(c, X_E_TRAP); 
-    goto done; }
-  goto done; }
+      SAVE;
+      xcpu_exception(c, X_E_TRAP);
+      RESTORE;
+      EDGE;
+      STOP(X_STOP_EXCEPTION);
+    }
+    NEXT;
+  }
   INSTRUCTION(lit){
-    c->itr = c->regs[XIS_REG1(instruction)];
-  goto done; }
+    c->itr = R1;
+    NEXT;
+  }
   /*** THREADING INSTRUCTIONS ***/
   INSTRUCTION(cpuid){
-    c->regs[XIS_REG1(instruction)] = c->id;
-  goto done; }
+    R1 = c->id;
+    NEXT;
+  }
   INSTRUCTION(cpunum){
-    c->regs[XIS_REG1(instruction)] = c->num;
-  goto done; }
+    R1 = c->num;
+    NEXT;
+  }
+  /**
+   * The atomic instructions are left to xcpu.c, which does them with C11
+   * atomics, falling back on a lock for odd addresses (elk, a static of
+   * xcpu.c's, shared by every CPU of every machine in the process). Stora
+   * only needs to see its own operands; loada and tnset also look out for
+   * spin loops, for which they need the whole of the CPU, and which stop
+   * the run when they find one (see xspin.h).
+   **/
   INSTRUCTION(loada){
-    LOCK(lk);
-    c->regs[XIS_REG2(instruction)] = FETCH_WORD(c->regs[XIS_REG1(instruction)]);
-    UNLOCK(lk);
-  goto done; }
+    SAVE;
+    loada(c, d->instruction);
+    R2 = c->regs[d->reg2];
+    CHECK_SPIN;
+    NEXT;
+  }
   INSTRUCTION(stora){
-    LOCK(lk);
-    c->memory[c->regs[XIS_REG2(instruction)] % MEMSIZE] =
-      (unsigned char) ((c->regs[XIS_REG1(instruction)] >> 8));
-    c->memory[(c->regs[XIS_REG2(instruction)]+1) % MEMSIZE] =
-      (unsigned char) ((c->regs[XIS_REG1(instruction)]) & 0xFF);  
-    UNLOCK(lk);
-  goto done; }
+    c->regs[d->reg1] = R1;
+    c->regs[d->reg2] = R2;
+    stora(c, d->instruction);
+    NEXT;
+  }
   INSTRUCTION(tnset){
-    LOCK(lk);
-    c->regs[XIS_REG2(instruction)] = FETCH_WORD(c->regs[XIS_REG1(instruction)]);
-    c->memory[c->regs[XIS_REG2(instruction)] % MEMSIZE] = 0;
-    c->memory[(c->regs[XIS_REG2(instruction)]+1) % MEMSIZE] = 1;
-    UNLOCK(lk);
-  goto done; }
+    SAVE;
+    tnset(c, d->instruction);
+    R2 = c->regs[d->reg2];
+    CHECK_SPIN;
+    NEXT;
+  }
+  INSTRUCTION(ipi){
+    c->regs[d->reg1] = R1;
+    ipi(c, d->instruction);
+    NEXT;
+  }
+
+  /**
+   * A branch back to the top of an idle loop (see XDC_IDLE in xcpu.h): if it
+   * is taken, stop, and let xmpsim skip ahead to the next interrupt.
+   **/
+  INSTRUCTION(idle){
+    addr = pc - WORD_SIZE;
+    if (d->opcode == I_JMP){
+      pc = IMMEDIATE;
+      EDGE;
+    } else if (d->opcode == I_JR || c->state & 0x0001){
+      pc = addr + (signed char) (d->instruction & 0x00FF);
+      EDGE;
+    }
+    if (pc <= addr){
+      STOP(X_STOP_IDLE);
+    }
+    NEXT;
+  }
+
+  /**********************
+   * fused instructions *
+   **********************/
+  FUSED(test_br, XF_TEST_BR, test){
+    c->state = (R1 & R2)? (c->state | 0x0001) : (c->state & 0xFFFE);
+    SECOND_HALF;
+    if (c->state & 0x0001){
+      pc = (pc-WORD_SIZE) + (signed char) (d->partner & 0x00FF);
+      EDGE;
+    }
+    NEXT;
+  }
+  FUSED(cmp_br, XF_CMP_BR, cmp){
+    c->state = (R1 < R2)? (c->state | 0x0001) : (c->state & 0xFFFE);
+    SECOND_HALF;
+    if (c->state & 0x0001){
+      pc = (pc-WORD_SIZE) + (signed char) (d->partner & 0x00FF);
+      EDGE;
+    }
+    NEXT;
+  }
+  FUSED(equ_br, XF_EQU_BR, equ){
+    c->state = (R1 == R2)? (c->state | 0x0001) : (c->state & 0xFFFE);
+    SECOND_HALF;
+    if (c->state & 0x0001){
+      pc = (pc-WORD_SIZE) + (signed char) (d->partner & 0x00FF);
+      EDGE;
+    }
+    NEXT;
+  }
+  FUSED(loadi_add, XF_LOADI_ADD, loadi){
+    value = IMMEDIATE;
+    pc += WORD_SIZE;
+    R1 = value;
+    SECOND_HALF;
+    P2 = (P1 + P2) % 0x10000;
+    NEXT;
+  }
+  FUSED(push_push, XF_PUSH_PUSH, push){
+    PUSHER(R1);
+    // if the first push wrote over the second, run what is there now
+    if ((unsigned short) (regs[15] - pc + 1) <= 2){
+      NEXT;
+    }
+    SECOND_HALF;
+    PUSHER(P1);
+    NEXT;
+  }
+  FUSED(pop_pop, XF_POP_POP, pop){
+    POPPER(R1);
+    SECOND_HALF;
+    POPPER(P1);
+    NEXT;
+  }
+}
+
+#ifndef XCPU_TRACED
+/************************************************************
+ Print how often each fused pair was run.
+*************************************************************/
+void xcpuj_fusion_report(FILE *f){
+  static char *names[XF_LAST] = {
+    [XF_TEST_BR] = "test; br",    [XF_CMP_BR] = "cmp; br",
+    [XF_EQU_BR] = "equ; br",      [XF_LOADI_ADD] = "loadi; add",
+    [XF_PUSH_PUSH] = "push; push", [XF_POP_POP] = "pop; pop",
+  };
+  int k;
 
+  fprintf(f, "\n<fused pairs run>\n");
+  for (k = XF_NONE+1; k < XF_LAST; k++)
+    fprintf(f, "  %-12s %lu\n", names[k], xcpuj_fused_runs[k]);
 }
+#endif
 /** That's all, folks! **/
-char *sign="\xde\xba\x5e\x12";
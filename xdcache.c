@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#define X_INSTRUCTIONS_NOT_NEEDED
+#include "xis.h"
+#include "xcpu.h"
+#include "xspin.h"
+
+/**
+ * The predecoded instruction cache, shared by all of the CPUs that share a
+ * memory segment. Entries are filled lazily, the first time an address is
+ * executed, and dropped whenever a store lands on any of their bytes (or on
+ * those of the instruction fused to them).
+ *
+ * Since the cache is shared, a little care is needed when one CPU writes
+ * over code that another CPU is in the middle of decoding. Fillers take the
+ * cache lock, publish the new entry, and then re-read the instruction from
+ * memory; writers store to memory, and then clear any entries they overlap.
+ * With a full fence on each side, at least one of the two is guaranteed to
+ * notice the other, so a stale decoding can never outlive the store that
+ * made it stale. (When the cache is private to a single CPU, the fences
+ * are skipped.)
+ **/
+
+/******************************************************************
+   Which pair (if any) the opcodes first and second make up.
+******************************************************************/
+static unsigned char fuse(unsigned char first, unsigned char second){
+  switch (first){
+  case I_TEST:
+    return (second == I_BR)? XF_TEST_BR : XF_NONE;
+  case I_CMP:
+    return (second == I_BR)? XF_CMP_BR : XF_NONE;
+  case I_EQU:
+    return (second == I_BR)? XF_EQU_BR : XF_NONE;
+  case I_LOADI:
+    return (second == I_ADD)? XF_LOADI_ADD : XF_NONE;
+  case I_PUSH:
+    return (second == I_PUSH)? XF_PUSH_PUSH : XF_NONE;
+  case I_POP:
+    return (second == I_POP)? XF_POP_POP : XF_NONE;
+  }
+  return XF_NONE;
+}
+
+/******************************************************************
+   Is the instruction at pc a branch back to the top of a loop that
+   can only wait? The loop must be short, and straight-line; and
+   nothing in it may write a register or touch memory, so that the
+   compares in it can only ever come out the same way. (This is
+   only a hint: xmpsim steps round the loop to make sure.)
+******************************************************************/
+static int idle_loop(xcpu *c, unsigned short int pc, unsigned int instruction){
+  unsigned short int target, distance, k;
+
+  switch ((instruction >> 8) & 0x00FF){
+  case I_BR:
+  case I_JR:
+    target = pc + (signed char) (instruction & 0x00FF);
+    break;
+  case I_JMP:
+    target = instruction >> 16;
+    break;
+  default:
+    return 0;
+  }
+  distance = pc - target;
+  if (distance > XDC_IDLE_SPAN)
+    return 0;
+  for (k = 0; k < distance; ){
+    switch (c->memory[(target + k) % MEMSIZE]){
+    case I_TEST: case I_CMP: case I_EQU: case I_BR: case I_JR:
+      k += WORD_SIZE;
+      break;
+    case I_JMP:
+      k += 2*WORD_SIZE;
+      break;
+    default:
+      return 0;
+    }
+  }
+  return k == distance;
+}
+
+/******************************************************************
+   Decode the instruction at pc into d, without touching the cache.
+******************************************************************/
+static void decode(xcpu *c, IHandler *table, unsigned short int pc,
+                   xdecoded *d){
+  unsigned int instruction = FETCH_WORD(pc);
+  unsigned int partner;
+
+  d->opcode = (unsigned char)((instruction >> 8) & 0x00FF);
+  d->size = WORD_SIZE;
+  if (XIS_IS_EXT_OP(d->opcode)){
+    instruction |= ((unsigned int) (FETCH_WORD(pc + WORD_SIZE))) << 16;
+    d->size += WORD_SIZE;
+  }
+  d->instruction = instruction;
+  d->reg1 = XIS_REG1(instruction);
+  d->reg2 = XIS_REG2(instruction);
+  d->handler = table[d->opcode];
+
+  // none of the partners is extended, so one more word will do
+  partner = FETCH_WORD(pc + d->size);
+  d->fused = fuse(d->opcode, (partner >> 8) & 0x00FF);
+  if (d->fused && c->decoded && c->decoded->idle
+      && idle_loop(c, pc + d->size, partner))
+    d->fused = XF_NONE;               // the branch must stand on its own
+  d->partner = (d->fused)? partner : 0;
+  d->span = (d->fused)? d->size + WORD_SIZE : d->size;
+  d->op = (d->fused)? XF_OP(d->fused) : d->opcode;
+  if (c->decoded && c->decoded->idle && idle_loop(c, pc, instruction))
+    d->op = XDC_IDLE;
+}
+
+xdcache * xdcache_create(IHandler *table, unsigned int limit, int shared){
+  xdcache *dc = malloc(sizeof(xdcache));
+  if (limit > MEMSIZE)
+    limit = MEMSIZE;
+  if (dc == NULL || (dc->entry = calloc(limit + 1, sizeof(xdecoded))) == NULL){
+    fprintf(stderr, "FAILURE IN <xdcache_create>: OUT OF MEMORY\n");
+    exit(EXIT_FAILURE);
+  }
+  dc->table = table;
+  dc->limit = limit;
+  // a fused pair at limit-1 reaches XDC_MAX_SPAN-1 bytes past the limit
+  dc->reach = (limit + XDC_MAX_SPAN-1 < MEMSIZE)? limit + XDC_MAX_SPAN-1 : MEMSIZE;
+  dc->shared = shared;
+  dc->generation = 0;
+  dc->idle = 0;
+  dc->spin = NULL;
+  dc->nspin = 0;
+  dc->parked = 0;
+  pthread_mutex_init(&dc->lock, NULL);
+  return dc;
+}
+
+void xdcache_destroy(xdcache *dc){
+  pthread_mutex_destroy(&dc->lock);
+  free(dc->entry);
+  free(dc);
+}
+
+/******************************************************************
+   Return the decoded instruction at c->pc, decoding (and caching)
+   it first if need be. The decoding is always copied to scratch:
+   another CPU may drop the entry (and decode it again) while this
+   one runs it, so it is copied only while the generation stays put,
+   and is otherwise taken under the lock.
+******************************************************************/
+xdecoded * xdcache_fetch(xcpu *c, IHandler *table, xdecoded *scratch){
+  xdcache *dc = c->decoded;
+  xdecoded *d;
+  unsigned int generation;
+
+  if (dc == NULL || c->pc >= dc->limit)
+    return xdcache_lookup(c, table, c->pc, scratch);
+  d = &dc->entry[c->pc];
+  do {
+    generation = __atomic_load_n(&dc->generation, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&d->handler, __ATOMIC_ACQUIRE)){
+      *scratch = *d;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (scratch->handler != NULL
+          && __atomic_load_n(&dc->generation, __ATOMIC_ACQUIRE) == generation)
+        return scratch;
+    }
+  } while (xdcache_lookup(c, table, c->pc, scratch) != scratch);
+  return scratch;
+}
+
+/******************************************************************
+   As xdcache_fetch, but for the instruction at an arbitrary pc.
+   The result is only in the cache if it is not scratch.
+******************************************************************/
+xdecoded * xdcache_lookup(xcpu *c, IHandler *table, unsigned short int pc,
+                          xdecoded *scratch){
+  xdcache *dc = c->decoded;
+  xdecoded *d;
+
+  if (dc == NULL || pc >= dc->limit){
+    decode(c, table, pc, scratch);
+    return scratch;
+  }
+  d = &dc->entry[pc];
+  if (__atomic_load_n(&d->handler, __ATOMIC_ACQUIRE))
+    return d;
+
+  LOCK(dc->lock);
+  if (d->handler == NULL){
+    decode(c, dc->table, pc, scratch);
+    d->instruction = scratch->instruction;
+    d->partner = scratch->partner;
+    d->op = scratch->op;
+    d->opcode = scratch->opcode;
+    d->reg1 = scratch->reg1;
+    d->reg2 = scratch->reg2;
+    d->size = scratch->size;
+    d->fused = scratch->fused;
+    d->span = scratch->span;
+    __atomic_store_n(&d->handler, scratch->handler, __ATOMIC_RELEASE);
+    if (dc->shared){
+      // make sure nobody wrote over the instruction while we decoded it
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      decode(c, dc->table, pc, scratch);
+      if (scratch->instruction != d->instruction
+          || scratch->partner != d->partner){
+        __atomic_add_fetch(&dc->generation, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&d->handler, NULL, __ATOMIC_RELEASE);
+      }
+    }
+  } else {
+    *scratch = *d;
+  }
+  UNLOCK(dc->lock);
+  return scratch;
+}
+
+/******************************************************************
+   Drop every cached instruction that overlaps the n bytes at addr.
+   An entry spans at most XDC_MAX_SPAN bytes, so only the entries
+   from addr-XDC_MAX_SPAN+1 to addr+n-1 need to be looked at. Any
+   CPU asleep in a spin loop that reads the bytes is woken.
+******************************************************************/
+void xdcache_invalidate(xdcache *dc, unsigned int addr, int n){
+  xdecoded *d;
+  unsigned int a;
+  int k;
+
+  if (dc->shared)
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (k = 1 - XDC_MAX_SPAN; k < n; k++){
+    a = (addr + MEMSIZE + k) % MEMSIZE;
+    if (a >= dc->limit)
+      continue;
+    d = &dc->entry[a];
+    if (__atomic_load_n(&d->handler, __ATOMIC_ACQUIRE) && (k >= 0 || d->span > -k)){
+      // bumped first, so that a copy taken in xdcache_fetch sees it
+      __atomic_add_fetch(&dc->generation, 1, __ATOMIC_SEQ_CST);
+      __atomic_store_n(&d->handler, NULL, __ATOMIC_RELEASE);
+    }
+  }
+  // wake anybody waiting for a store here (after the fence above)
+  if (__atomic_load_n(&dc->parked, __ATOMIC_SEQ_CST))
+    xspin_ring(dc, addr, n);
+}
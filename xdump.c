@@ -36,11 +36,7 @@ int main(int argc, char **argv){
   }
   FILE *fd = load_file(argv[1]);
 
-  xcpu *c = malloc(sizeof(xcpu));
-  if (c == NULL){
-    fprintf(stderr, "Out of memory.\n");
-    exit(EXIT_FAILURE);
-  }
+  xcpu *c = xcpu_calloc(1, sizeof(xcpu));
 
   init_cpu(c);
   int plen, counter;
@@ -74,6 +70,7 @@ int load_programme(xcpu *c, FILE *fd){
    fprintf(stderr, "%s\n",msg);
     exit(EXIT_FAILURE);
   }
+  c->memory[MEMSIZE] = c->memory[0];  // (see MIRROR_SIZE)
   return addr;
 }
 
@@ -92,7 +89,10 @@ FILE* load_file(char* filename){
 }
 
 void init_cpu(xcpu *c){
-  c->memory = calloc(MEMSIZE, sizeof(unsigned char));
+  c->memory = calloc(MEMSIZE + MIRROR_SIZE, sizeof(unsigned char));
+  c->decoded = NULL;
+  c->console = NULL;
+  c->spin = NULL;
   unsigned char i;
   for(i=0; i<=15; c->regs[i++]=0) // registers will need to be on the stack
     ;                             // so that each thread can maintain its own
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "xevent.h"
+
+/**
+ * A binary min-heap of pending events, ordered by deadline, and then by the
+ * order in which they were scheduled, so that two events falling due on the
+ * same cycle are delivered in a predictable order. There are never more
+ * than a handful of events per CPU, so the heap lives in a fixed array.
+ **/
+
+// does a come before b?
+#define EARLIER(a, b)                                                   \
+  ((a).due < (b).due || ((a).due == (b).due && (a).seq < (b).seq))
+
+/******************************************************************
+   Move the event at k up the heap until its parent is earlier.
+******************************************************************/
+static void sift_up(xevq *q, int k){
+  xevent e = q->heap[k];
+  while (k > 0 && EARLIER(e, q->heap[(k-1)/2])){
+    q->heap[k] = q->heap[(k-1)/2];
+    k = (k-1)/2;
+  }
+  q->heap[k] = e;
+}
+
+/******************************************************************
+   Move the event at k down the heap until its children are later.
+******************************************************************/
+static void sift_down(xevq *q, int k){
+  xevent e = q->heap[k];
+  int child;
+  while ((child = 2*k + 1) < q->n){
+    if (child+1 < q->n && EARLIER(q->heap[child+1], q->heap[child]))
+      child++;
+    if (!EARLIER(q->heap[child], e))
+      break;
+    q->heap[k] = q->heap[child];
+    k = child;
+  }
+  q->heap[k] = e;
+}
+
+void xevq_init(xevq *q){
+  q->n = 0;
+  q->seq = 0;
+}
+
+int xevq_schedule(xevq *q, long due, long period,
+                  unsigned char source, unsigned char ex){
+  xevent *e;
+  if (q->n == XEV_MAX)
+    return 0;
+  e = &q->heap[q->n];
+  e->due = due;
+  e->period = period;
+  e->seq = q->seq++;
+  e->source = source;
+  e->ex = ex;
+  sift_up(q, q->n++);
+  return 1;
+}
+
+int xevq_pop(xevq *q, long now, xevent *e){
+  if (q->n == 0 || q->heap[0].due > now)
+    return 0;
+  *e = q->heap[0];
+  if (e->period > 0){
+    // re-arm in place; it can only have moved later
+    q->heap[0].due += e->period;
+    q->heap[0].seq = q->seq++;
+  } else {
+    q->heap[0] = q->heap[--q->n];
+  }
+  sift_down(q, 0);
+  return 1;
+}
+
+int xevq_cancel(xevq *q, unsigned char source){
+  int k = 0, cancelled = 0;
+  while (k < q->n){
+    if (q->heap[k].source == source){
+      q->heap[k] = q->heap[--q->n];
+      cancelled++;
+    } else {
+      k++;
+    }
+  }
+  // removals can leave the heap in any order, so rebuild it
+  for (k = q->n/2 - 1; k >= 0; k--)
+    sift_down(q, k);
+  return cancelled;
+}
@@ -0,0 +1,66 @@
+#ifndef XEVENT_H
+#define XEVENT_H
+
+/**
+ * The event queue (xevent.c): each CPU keeps the things that are due to
+ * happen to it in the future -- the periodic timer interrupt, a device
+ * finishing its work, another CPU poking it -- in a small min-heap, keyed
+ * by the cycle at which each one falls due. The run loop then need only
+ * compare its cycle count against the earliest deadline, rather than
+ * working out, every cycle, whether each source has anything to say.
+ **/
+
+#define XEV_MAX 16                    /* events pending on any one CPU */
+#define XEV_NEVER 0x7fffffffL         /* the deadline of an empty queue */
+
+/* where an event comes from (the exception it raises is kept separately) */
+enum {
+  XEV_TIMER,     /* the periodic interrupt */
+  XEV_DEVICE,    /* a device has finished with a request */
+  XEV_IPI,       /* another CPU wants our attention */
+  XEV_LAST
+};
+
+typedef struct xevent {
+  long due;                           /* cycle at which it is delivered */
+  long period;                        /* cycles until it recurs, 0 if never */
+  unsigned long seq;                  /* breaks ties, first come first served */
+  unsigned char source;               /* one of XEV_* */
+  unsigned char ex;                   /* exception to raise (X_E_*) */
+} xevent;
+
+typedef struct xevq {
+  int n;                              /* events in the heap */
+  unsigned long seq;                  /* events ever scheduled */
+  xevent heap[XEV_MAX];               /* heap[0] is the earliest */
+} xevq;
+
+/* title: empty an event queue
+ */
+extern void xevq_init( xevq *q );
+
+/* title: schedule an event
+ * param: the queue, the cycle at which it first falls due, the number of
+ *        cycles between recurrences (0 for a one-off event), where it comes
+ *        from, and the exception it should raise
+ * returns: 1 if successful, 0 if the queue is full
+ */
+extern int xevq_schedule( xevq *q, long due, long period,
+                          unsigned char source, unsigned char ex );
+
+/* title: take the earliest event, if it has fallen due
+ * param: the queue, the current cycle, and where to copy the event
+ * function: periodic events are put back, due again a period later
+ * returns: 1 if an event was due (and copied to *e), 0 if not
+ */
+extern int xevq_pop( xevq *q, long now, xevent *e );
+
+/* title: cancel every event from a source
+ * returns: the number of events cancelled
+ */
+extern int xevq_cancel( xevq *q, unsigned char source );
+
+// the cycle at which the next event falls due (XEV_NEVER if none)
+#define XEVQ_NEXT(q)  ((q)->n? (q)->heap[0].due : XEV_NEVER)
+
+#endif
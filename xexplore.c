@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "xcpu.h"
+#include "xout.h"
+#include "xmachine.h"
+
+/**
+ * xexplore runs a machine up to a cycle, and then branches it into many
+ * children, each of which runs on from there on a schedule of its own, to
+ * see which schedules change what the machine does -- a race in a kernel
+ * (an interrupt landing between saving a PCB and locking it, say) shows
+ * up only under some of them. It takes the same arguments as xmpsim:
+ *
+ *   xexplore -a cycle [options] <cycles> <image> <interrupt frequency>
+ *            <number of CPUs>
+ *
+ * The machine runs up to the cycle (-a) once, and is saved to a snapshot
+ * there (see xmachine_save); each child is restored from it, so that its
+ * memory is mapped from the one file, copy on write, and the run up to the
+ * branch is paid for once. Child 0 just goes on as the machine would have
+ * (as xmpsim -R would, from the snapshot); each other child has the phase
+ * of each CPU's timer put off (see xmachine_delay_timer) by some part of
+ * a period, picked at random, and its CPUs' turns varied (as with xmpsim
+ * -r), from a seed of its own. -x phase, or -x turns, varies just the one.
+ * Children whose schedules come out the same as an earlier child's are
+ * not run. The rest run on up to <cycles> (over all), several at once
+ * (-j), each taking turns on a thread of its own, as xfarm's jobs do.
+ *
+ * Each child that ran is then hashed (see xmachine_hash): children that
+ * ended up the same share a state, numbered from child 0's. Each child's
+ * schedule and state are listed, with where its output (from the branch
+ * on) first differs from child 0's, if it does. With -d, the snapshot is
+ * kept in the directory (fork.snap), with what the machine wrote up to
+ * the branch (fork.out), and what each child wrote from it (child.N.out).
+ **/
+
+#define EXPLORE_CHILDREN 16           /* children, unless -c says */
+#define EXPLORE_QUANTUM 1000          /* cycles a turn, unless -q says */
+#define EXPLORE_NAME 512
+
+enum { VARY_PHASE = 1, VARY_TURNS = 2 };
+
+// a growing buffer of bytes
+typedef struct explore_text {
+  char *data;
+  int length, size;
+} explore_text;
+
+// a child, and what came of it
+typedef struct explore_child {
+  int *delay;                         /* each CPU's timer is put off by */
+  unsigned long seed;                 /* its turns vary from, or 0 */
+  int same_as;                        /* an earlier child with the same
+                                         schedule (not run), or -1 */
+  explore_text out;                   /* what it wrote, from the branch */
+  unsigned long hash;                 /* of its state, once run */
+  int state;                          /* the first child that ended so */
+} explore_child;
+
+static void usage(char *name);
+static void branch(char *image, int at);
+static int load_image(char *name, unsigned char *image);
+static void schedule(int k);
+static void * worker(void *arg);
+static void run_child(int k);
+static void report(void);
+static void take_output(void *arg, int id, unsigned char ch);
+static void append(explore_text *t, const char *bytes, int n);
+static void save(char *name, explore_text *t);
+
+/** GLOBAL VARIABLES (NECESSARY EVILS) **/
+
+xmachine_config config;  // how the machine, and every child, runs
+int ncpu;
+int cycles;              // run every child up to this many, over all
+int at = 0;              // branch once the machine has run this many (-a)
+int vary = VARY_PHASE | VARY_TURNS;   // what the children vary (-x)
+explore_child *children;
+int nchildren = EXPLORE_CHILDREN;     // (-c)
+int next_child = 0;      // the next child for a worker to take
+char *dir = NULL;        // keep the snapshot, and the output, here (-d)
+char snapshot[EXPLORE_NAME];          // the machine, at the branch
+explore_text forked;     // what it wrote up to the branch
+
+/***************************************************************************/
+
+int main(int argc, char *argv[]){
+  int opt, nworkers = 1, k;
+  struct timespec from, to;
+  double secs;
+
+  xmachine_defaults(&config);
+  config.quantum = EXPLORE_QUANTUM;
+  config.console = XOUT_DIRECT;       // the output is taken as it comes
+  while ((opt = getopt(argc, argv, "a:c:d:e:j:q:x:")) != -1){
+    switch (opt){
+    case 'a':   // the cycle to branch at
+      if ((at = atoi(optarg)) < 0)
+        usage(argv[0]);
+      break;
+    case 'c':   // how many children
+      if ((nchildren = atoi(optarg)) <= 0)
+        usage(argv[0]);
+      break;
+    case 'd':   // a directory for the snapshot and the output
+      dir = optarg;
+      break;
+    case 'e':   // the engine, as for xmpsim
+      if (!strcmp(optarg, "table"))
+        config.engine = XMACHINE_TABLE;
+      else if (!strcmp(optarg, "threaded"))
+        config.engine = XMACHINE_THREADED;
+      else if (!strcmp(optarg, "jit"))
+        config.engine = XMACHINE_JIT;
+      else
+        usage(argv[0]);
+      break;
+    case 'j':   // how many children to run at once (0: one per host core)
+      if ((nworkers = atoi(optarg)) < 0)
+        usage(argv[0]);
+      if (nworkers == 0 && (nworkers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        nworkers = 1;
+      break;
+    case 'q':   // the cycles each CPU runs, per turn
+      if ((config.quantum = atoi(optarg)) <= 0)
+        usage(argv[0]);
+      break;
+    case 'x':   // vary just the timer's phase, or just the turns
+      if (!strcmp(optarg, "phase"))
+        vary = VARY_PHASE;
+      else if (!strcmp(optarg, "turns"))
+        vary = VARY_TURNS;
+      else
+        usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc-4)
+    usage(argv[0]);
+  cycles = atoi(argv[optind]);
+  config.interrupt_freq = atoi(argv[optind+2]);
+  ncpu = atoi(argv[optind+3]);
+  if (cycles < 0 || (cycles && cycles <= at) || config.interrupt_freq < 0
+      || ncpu <= 0)
+    usage(argv[0]);
+  if ((children = calloc(nchildren, sizeof(explore_child))) == NULL){
+    fprintf(stderr, "FAILURE IN <main>: OUT OF MEMORY\n");
+    exit(EXIT_FAILURE);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &from);
+  branch(argv[optind+1], at);
+  for (k = 0; k < nchildren; k++)
+    schedule(k);
+  pthread_t threads[nworkers];
+  for (k = 0; k < nworkers; k++)
+    if (pthread_create(&threads[k], NULL, worker, NULL)){
+      fprintf(stderr, "FAILURE IN <main>: NO WORKER THREAD\n");
+      exit(EXIT_FAILURE);
+    }
+  for (k = 0; k < nworkers; k++)
+    pthread_join(threads[k], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &to);
+
+  report();
+  secs = (to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) / 1e9;
+  fprintf(LOG, "<%d children in %.3f seconds>\n", nchildren, secs);
+  if (dir == NULL)
+    remove(snapshot);
+  for (k = 0; k < nchildren; k++){
+    free(children[k].delay);
+    free(children[k].out.data);
+  }
+  free(children);
+  free(forked.data);
+  return 0;
+}
+
+static void usage(char *name){
+  fprintf(LOG, "Usage: %s -a cycle [-c children] [-d directory]"
+          " [-e table|threaded|jit] [-j workers] [-q quantum]"
+          " [-x phase|turns] <cycles> <filename> <interrupt frequency>"
+          " <number of CPUs>\n", name);
+  exit(EXIT_FAILURE);
+}
+
+/**************************************************************
+ * Run the machine from the image (or the snapshot) up to the
+ * branch, and save it there, for the children to start from.
+ **************************************************************/
+static void branch(char *image, int at){
+  unsigned char bytes[MEMSIZE];
+  xmachine *m;
+  int fd, len, snap;
+
+  m = xmachine_create(0, ncpu);
+  xmachine_configure(m, &config);
+  xmachine_output(m, take_output, &forked);
+  if ((snap = xmachine_snapshot(image))? snap != ncpu
+      || xmachine_restore(m, image)
+      : (len = load_image(image, bytes)) < 0 || xmachine_load(m, bytes, len)){
+    char msg[80] = "error: could not load image ";
+    strncat(msg, image, 40);
+    fatal(msg);
+  }
+  if (at && xmachine_run(m, at) == 0)
+    fatal("error: every CPU had stopped before the branch");
+  if (dir)
+    snprintf(snapshot, sizeof(snapshot), "%s/fork.snap", dir);
+  else {
+    strcpy(snapshot, "/tmp/xexplore.XXXXXX");
+    if ((fd = mkstemp(snapshot)) < 0)
+      fatal("error: could not make a file for the snapshot");
+    close(fd);
+  }
+  if (xmachine_save(m, snapshot)){
+    char msg[80] = "error: could not write to ";
+    strncat(msg, snapshot, 50);
+    fatal(msg);
+  }
+  xmachine_destroy(m);
+}
+
+/**************************************************************
+ * Load an image just as xmpsim does (end-of-file byte and all).
+ * Returns the number of bytes loaded, or -1 if the image is
+ * missing, or too big.
+ **************************************************************/
+static int load_image(char *name, unsigned char *image){
+  FILE *fd;
+  int len;
+
+  if ((fd = fopen(name, "rb")) == NULL)
+    return -1;
+  len = fread(image, 1, MEMSIZE, fd);
+  fclose(fd);
+  if (len >= MEMSIZE - 1)
+    return -1;
+  image[len++] = (unsigned char) EOF;
+  return len;
+}
+
+/**************************************************************
+ * Pick child k's schedule: none for child 0; otherwise, from a
+ * seed of its own, how far each CPU's timer is put off, and the
+ * seed of its turns (which only vary with more than one CPU).
+ * A child whose schedule is an earlier one's is not run.
+ **************************************************************/
+static void schedule(int k){
+  explore_child *ch = &children[k];
+  unsigned long seed = (k + 1) * 0x9E3779B97F4A7C15UL;
+  int u, j;
+
+  if ((ch->delay = calloc(ncpu, sizeof(int))) == NULL){
+    fprintf(stderr, "FAILURE IN <schedule>: OUT OF MEMORY\n");
+    exit(EXIT_FAILURE);
+  }
+  ch->same_as = -1;
+  if (k == 0)
+    return;
+  if (vary & VARY_TURNS && ncpu > 1)
+    ch->seed = seed;
+  for (u = 0; u < ncpu && vary & VARY_PHASE && config.interrupt_freq; u++){
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    ch->delay[u] = seed % config.interrupt_freq;
+  }
+  for (j = 0; j < k && ch->same_as < 0; j++)
+    if (children[j].same_as < 0 && children[j].seed == ch->seed
+        && !memcmp(children[j].delay, ch->delay, ncpu * sizeof(int)))
+      ch->same_as = j;
+}
+
+/**************************************************************
+ * A worker: take the next child, run it, and so on until there
+ * are none left.
+ **************************************************************/
+static void * worker(void *arg){
+  int k;
+  while ((k = __atomic_fetch_add(&next_child, 1, __ATOMIC_RELAXED))
+         < nchildren)
+    if (children[k].same_as < 0)
+      run_child(k);
+  return NULL;
+}
+
+// restore the child from the snapshot, on its schedule, and run it out
+static void run_child(int k){
+  explore_child *ch = &children[k];
+  xmachine_config c = config;
+  xmachine *m;
+  int u;
+
+  c.seed = ch->seed;
+  m = xmachine_create(0, ncpu);
+  xmachine_configure(m, &c);
+  xmachine_output(m, take_output, &ch->out);
+  if (xmachine_restore(m, snapshot)){
+    char msg[80] = "error: could not restore ";
+    strncat(msg, snapshot, 50);
+    fatal(msg);
+  }
+  for (u = 0; u < ncpu; u++)
+    if (ch->delay[u])
+      xmachine_delay_timer(m, u, ch->delay[u]);
+  xmachine_run(m, (cycles)? cycles - at : 0);
+  ch->hash = xmachine_hash(m);
+  xmachine_destroy(m);
+}
+
+/**************************************************************
+ * Say what came of each child: its schedule, its state, and
+ * where its output parts from child 0's, if it does; and keep
+ * the output, with -d.
+ **************************************************************/
+static void report(void){
+  explore_child *ch, *first = &children[0];
+  char name[EXPLORE_NAME];
+  int k, j, u, n, timed, ran = 0, states = 0, differ = 0;
+
+  if (dir){
+    snprintf(name, sizeof(name), "%s/fork.out", dir);
+    save(name, &forked);
+  }
+  for (k = 0; k < nchildren; k++){
+    ch = &children[k];
+    printf("child %d (", k);
+    for (u = 0; u < ncpu && ch->delay[u] == 0; u++)
+      ;
+    if ((timed = (u < ncpu)))
+      for (u = 0; u < ncpu; u++)
+        printf("%s%d", (u)? ",+" : "timer +", ch->delay[u]);
+    if (ch->seed)
+      printf("%sturns from %lu", (timed)? "; " : "", ch->seed);
+    else if (!timed)
+      printf("as it was");
+    if (ch->same_as >= 0){
+      printf("): the same as child %d\n", ch->same_as);
+      continue;
+    }
+    ran++;
+    for (j = 0; children[j].same_as >= 0 || children[j].hash != ch->hash;
+         j++)
+      ;
+    ch->state = (j < k)? children[j].state : states++;
+    printf("): state %d", ch->state);
+    for (n = 0; n < ch->out.length && n < first->out.length
+           && ch->out.data[n] == first->out.data[n]; n++)
+      ;
+    if (n < ch->out.length || n < first->out.length){
+      printf(", output differs from byte %d", n);
+      differ++;
+    }
+    printf("\n");
+    if (dir){
+      snprintf(name, sizeof(name), "%s/child.%d.out", dir, k);
+      save(name, &ch->out);
+    }
+  }
+  printf("<%d children from cycle %d: %d run, %d states, %d with output"
+         " unlike child 0's>\n", nchildren, at, ran, states, differ);
+}
+
+// each child's CPUs all run on its worker's thread, so no lock is needed
+static void take_output(void *arg, int id, unsigned char ch){
+  append((explore_text *) arg, (char *) &ch, 1);
+}
+
+static void append(explore_text *t, const char *bytes, int n){
+  if (t->length + n > t->size){
+    t->size = (t->size)? 2*t->size : 256;
+    if (t->size < t->length + n)
+      t->size = t->length + n;
+    if ((t->data = realloc(t->data, t->size)) == NULL){
+      fprintf(stderr, "FAILURE IN <append>: OUT OF MEMORY\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memcpy(t->data + t->length, bytes, n);
+  t->length += n;
+}
+
+static void save(char *name, explore_text *t){
+  FILE *fd;
+  if ((fd = fopen(name, "w")) == NULL){
+    char msg[EXPLORE_NAME + 40] = "error: could not write to ";
+    strncat(msg, name, EXPLORE_NAME);
+    fatal(msg);
+  }
+  fwrite(t->data, 1, t->length, fd);
+  fclose(fd);
+}
@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "xcpu.h"
+#include "xout.h"
+#include "xmachine.h"
+
+/**
+ * xfarm runs a whole batch of small images in one process, rather than one
+ * xmpsim at a time: each job is a machine (see xmachine.h), and a few
+ * worker threads take the jobs in turn until they are all done. A job's
+ * CPUs take turns on its worker's thread (as with xmpsim -q), so a worker
+ * never needs more than the one thread, and each job comes out the same
+ * from one run of the batch to the next.
+ *
+ * The jobs are listed in a manifest, one to a line, each with the same
+ * arguments that xmpsim takes, in the same order:
+ *
+ *   <image> <cycles> <interrupt frequency> <number of CPUs>
+ *
+ * Blank lines, and anything after a #, are ignored. Each job's output, and
+ * why each of its CPUs stopped (just as xmpsim says it), go either to files
+ * of their own in a directory (-d: job.N.out and job.N.err, counting the
+ * jobs from 0), or else into one results file (-r, or stdout), in the order
+ * of the manifest, each headed by its number and its line of the manifest.
+ *
+ * Each image is read just once, before any job runs, and its jobs' machines
+ * share it (see xmachine_share): a machine only gets a page of its own once
+ * it writes to it, so that many jobs at once on the same image cost little
+ * more memory than one. Only so many images are shared (FARM_IMAGES); the
+ * jobs of any beyond those have their images read for them alone.
+ *
+ * An image may also be a snapshot (see xmpsim -S), of a machine of as many
+ * CPUs as the job: the job then goes on from it (see xmachine_restore),
+ * rather than starting afresh, so that a kernel is booted just once for
+ * the whole farm, and every job maps its memory from the one file.
+ *
+ * With -v, the jobs of one CPU on the same shared image are taken by a
+ * worker XMACHINE_LANES at a time, in the order of the manifest, and run
+ * in lockstep (see xmachine_run_lockstep): a sweep of one image over many
+ * settings then decodes its code once per batch, and does the arithmetic
+ * of the jobs that agree on where they are all at once. Each job's output
+ * is just as it would be without.
+ **/
+
+#define FARM_LINE 512                 /* the longest line of a manifest */
+#define FARM_QUANTUM 1000             /* cycles a turn, unless -q says */
+#define FARM_IMAGES 256               /* images shared among their jobs */
+
+// a growing buffer of bytes
+typedef struct farm_text {
+  char *data;
+  int length, size;
+} farm_text;
+
+// a job, and what came of it
+typedef struct farm_job {
+  char image[FARM_LINE];
+  int cycles, interrupt_freq, ncpu;
+  int line;                           /* of the manifest */
+  int shared;                         /* its image in images[], or -1 */
+  farm_text out;                      /* what its CPUs wrote */
+  farm_text err;                      /* and why they stopped */
+  int done;
+} farm_job;
+
+// jobs that a worker takes together (-v), or else a job alone
+typedef struct farm_batch {
+  int job[XMACHINE_LANES];
+  int n;
+} farm_batch;
+
+// an image, read once for all of its jobs
+typedef struct farm_image {
+  char *name;
+  xmachine_image *image;              /* NULL if it could not be read */
+  int snapshot;                       /* or the CPUs of the machine, if it is
+                                         a snapshot (and not read), or 0 */
+} farm_image;
+
+static void usage(char *name);
+static farm_job * read_manifest(char *name, int *njobs);
+static void make_batches(void);
+static void * worker(void *arg);
+static void run_batch(farm_batch *b);
+static xmachine * make_machine(farm_job *job);
+static xmachine * no_image(farm_job *job);
+static void finish_job(farm_job *job, xmachine *m);
+static int find_image(char *name);
+static void share_images(void);
+static int load_image(char *name, unsigned char *image);
+static void take_output(void *arg, int id, unsigned char ch);
+static void take_stop(void *arg, const xmachine_stop *stop);
+static void append(farm_text *t, const char *bytes, int n);
+static void write_job(int k);
+static void save(char *name, farm_text *t);
+
+/** GLOBAL VARIABLES (NECESSARY EVILS) **/
+
+xmachine_config config;  // how every job's machine runs
+farm_job *jobs;          // the manifest
+int njobs;
+farm_batch *batches;     // the jobs, as the workers take them
+int nbatches;
+int lockstep = 0;        // batch the jobs of one CPU by image (-v)
+int next_batch = 0;      // the next batch for a worker to take
+int next_out = 0;        // the next job to write out (-r)
+pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+farm_image images[FARM_IMAGES];  // the images shared by their jobs
+int nimages = 0;
+char *dir = NULL;        // write each job to files of its own here (-d)
+FILE *results;           // or all of them here
+
+/***************************************************************************/
+
+int main(int argc, char *argv[]){
+  int opt, nworkers = 1, k;
+  struct timespec from, to;
+  double secs;
+
+  xmachine_defaults(&config);
+  config.quantum = FARM_QUANTUM;
+  config.console = XOUT_DIRECT;       // the output is taken as it comes
+  results = stdout;
+  while ((opt = getopt(argc, argv, "d:e:fj:lq:r:v")) != -1){
+    switch (opt){
+    case 'd':   // a directory for the jobs' files
+      dir = optarg;
+      break;
+    case 'e':   // the engine, as for xmpsim
+      if (!strcmp(optarg, "table"))
+        config.engine = XMACHINE_TABLE;
+      else if (!strcmp(optarg, "threaded"))
+        config.engine = XMACHINE_THREADED;
+      else if (!strcmp(optarg, "jit"))
+        config.engine = XMACHINE_JIT;
+      else
+        usage(argv[0]);
+      break;
+    case 'f':   // fast-forward through idle loops
+      config.idle_skip = 1;
+      break;
+    case 'j':   // how many jobs to run at once (0: one per host core)
+      if ((nworkers = atoi(optarg)) < 0)
+        usage(argv[0]);
+      if (nworkers == 0 && (nworkers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        nworkers = 1;
+      break;
+    case 'l':   // stop a job early, once none of its CPUs can get further
+      config.livelock = 1;
+      break;
+    case 'q':   // the cycles each CPU of a job runs, per turn
+      if ((config.quantum = atoi(optarg)) <= 0)
+        usage(argv[0]);
+      break;
+    case 'r':   // one file for all of the results
+      if ((results = fopen(optarg, "w")) == NULL){
+        char msg[80] = "error: could not write to ";
+        strncat(msg, optarg, 50);
+        fatal(msg);
+      }
+      break;
+    case 'v':   // run the jobs of one CPU on the same image in lockstep
+      lockstep = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc-1)
+    usage(argv[0]);
+  jobs = read_manifest(argv[optind], &njobs);
+  share_images();
+  make_batches();
+
+  pthread_t threads[nworkers];
+  clock_gettime(CLOCK_MONOTONIC, &from);
+  for (k = 0; k < nworkers; k++)
+    if (pthread_create(&threads[k], NULL, worker, NULL)){
+      fprintf(stderr, "FAILURE IN <main>: NO WORKER THREAD\n");
+      exit(EXIT_FAILURE);
+    }
+  for (k = 0; k < nworkers; k++)
+    pthread_join(threads[k], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &to);
+
+  secs = (to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) / 1e9;
+  fprintf(LOG, "<%d jobs in %.3f seconds: %.1f jobs per second>\n",
+          njobs, secs, (secs > 0)? njobs / secs : 0.0);
+  if (results != stdout)
+    fclose(results);
+  for (k = 0; k < nimages; k++){
+    if (images[k].image)
+      xmachine_image_destroy(images[k].image);
+    free(images[k].name);
+  }
+  free(batches);
+  free(jobs);
+  return 0;
+}
+
+static void usage(char *name){
+  fprintf(LOG, "Usage: %s [-d directory | -r results] [-e table|threaded|jit]"
+          " [-f] [-j workers] [-l] [-q quantum] [-v] <manifest>\n", name);
+  exit(EXIT_FAILURE);
+}
+
+/**************************************************************
+ * Read the jobs from the manifest (see above).
+ **************************************************************/
+static farm_job * read_manifest(char *name, int *njobs){
+  char line[FARM_LINE], *hash;
+  farm_job *jobs = NULL, *job;
+  int n = 0, size = 0, number = 0, fields;
+  FILE *fd;
+
+  if ((fd = fopen(name, "r")) == NULL){
+    char msg[80] = "error: could not open manifest ";
+    strncat(msg, name, 40);
+    fatal(msg);
+  }
+  while (fgets(line, sizeof(line), fd)){
+    number++;
+    if ((hash = strchr(line, '#')) != NULL)
+      *hash = '\0';
+    if (n == size){
+      size = (size)? 2*size : 64;
+      if ((jobs = realloc(jobs, size * sizeof(farm_job))) == NULL){
+        fprintf(stderr, "FAILURE IN <read_manifest>: OUT OF MEMORY\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    job = &jobs[n];
+    fields = sscanf(line, "%511s %d %d %d", job->image, &job->cycles,
+                    &job->interrupt_freq, &job->ncpu);
+    if (fields <= 0)
+      continue;
+    if (fields != 4 || job->ncpu < 1){
+      fprintf(LOG, "error: %s, line %d: expected <image> <cycles>"
+              " <interrupt frequency> <number of CPUs>\n", name, number);
+      exit(EXIT_FAILURE);
+    }
+    job->line = number;
+    job->shared = find_image(job->image);
+    memset(&job->out, 0, sizeof(farm_text));
+    memset(&job->err, 0, sizeof(farm_text));
+    job->done = 0;
+    n++;
+  }
+  fclose(fd);
+  *njobs = n;
+  return jobs;
+}
+
+/**************************************************************
+ * Put the jobs into batches, for the workers to take in turn:
+ * each job alone, or with -v, the jobs of one CPU on a shared
+ * image with the next ones on it, up to XMACHINE_LANES of them.
+ * The batches come in the order of their first jobs.
+ **************************************************************/
+static void make_batches(void){
+  int filling[FARM_IMAGES];           // each image's latest batch, or -1
+  int k, b;
+
+  if ((batches = calloc(njobs + 1, sizeof(farm_batch))) == NULL){
+    fprintf(stderr, "FAILURE IN <make_batches>: OUT OF MEMORY\n");
+    exit(EXIT_FAILURE);
+  }
+  for (k = 0; k < nimages; k++)
+    filling[k] = -1;
+  nbatches = 0;
+  for (k = 0; k < njobs; k++){
+    if (lockstep && jobs[k].shared >= 0 && jobs[k].ncpu == 1){
+      b = filling[jobs[k].shared];
+      if (b < 0 || batches[b].n == XMACHINE_LANES)
+        b = filling[jobs[k].shared] = nbatches++;
+    } else {
+      b = nbatches++;
+    }
+    batches[b].job[batches[b].n++] = k;
+  }
+}
+
+/**************************************************************
+ * A worker: take the next batch, run it, write its jobs out,
+ * and so on until there are none left.
+ **************************************************************/
+static void * worker(void *arg){
+  int k, j;
+  while ((k = __atomic_fetch_add(&next_batch, 1, __ATOMIC_RELAXED))
+         < nbatches){
+    run_batch(&batches[k]);
+    for (j = 0; j < batches[k].n; j++)
+      write_job(batches[k].job[j]);
+  }
+  return NULL;
+}
+
+/**************************************************************
+ * Run the jobs of a batch, each on a machine of its own, keeping
+ * what they write: a job alone just runs, and those together run
+ * in lockstep.
+ **************************************************************/
+static void run_batch(farm_batch *b){
+  xmachine *m[XMACHINE_LANES];
+  farm_job *job[XMACHINE_LANES];
+  int budget[XMACHINE_LANES];
+  int k, n = 0;
+
+  for (k = 0; k < b->n; k++){
+    job[n] = &jobs[b->job[k]];
+    if ((m[n] = make_machine(job[n])) == NULL)
+      continue;
+    budget[n] = job[n]->cycles;
+    n++;
+  }
+  if (n == 1)
+    xmachine_run(m[0], budget[0]);
+  else if (n > 1)
+    xmachine_run_lockstep(m, n, budget);
+  for (k = 0; k < n; k++)
+    finish_job(job[k], m[k]);
+}
+
+// a job's machine, ready to run, or NULL if its image could not be read
+static xmachine * make_machine(farm_job *job){
+  unsigned char image[MEMSIZE];
+  xmachine_config c = config;
+  xmachine *m;
+  int len, snapshot;
+
+  snapshot = (job->shared >= 0)? images[job->shared].snapshot
+                               : xmachine_snapshot(job->image);
+  if ((snapshot)? snapshot != job->ncpu
+      : (job->shared >= 0)? images[job->shared].image == NULL
+      : (len = load_image(job->image, image)) < 0)
+    return no_image(job);
+  c.interrupt_freq = job->interrupt_freq;
+  m = xmachine_create(0, job->ncpu);
+  xmachine_configure(m, &c);
+  xmachine_output(m, take_output, job);
+  xmachine_reporter(m, take_stop, job);
+  if (snapshot){
+    if (xmachine_restore(m, job->image)){
+      xmachine_destroy(m);
+      return no_image(job);
+    }
+  } else if (job->shared >= 0)
+    xmachine_share(m, images[job->shared].image);
+  else
+    xmachine_load(m, image, len);
+  return m;
+}
+
+// say that the job's image could not be loaded (a snapshot of a machine of
+// another number of CPUs cannot)
+static xmachine * no_image(farm_job *job){
+  char msg[FARM_LINE + 40];
+  append(&job->err, msg, sprintf(msg, "error: could not load image %s\n",
+                                 job->image));
+  return NULL;
+}
+
+// once it has run
+static void finish_job(farm_job *job, xmachine *m){
+  if (xmachine_stuck(m)){
+    const char *msg = "\n<stopped early: every CPU had halted, or was"
+      " spinning on memory that no longer changed>\n";
+    append(&job->err, msg, strlen(msg));
+  }
+  xmachine_destroy(m);
+}
+
+// the image's place in images[], or -1 if there is no room for it there
+static int find_image(char *name){
+  int k;
+  for (k = 0; k < nimages; k++)
+    if (!strcmp(images[k].name, name))
+      return k;
+  if (nimages == FARM_IMAGES)
+    return -1;
+  if ((images[k].name = strdup(name)) == NULL){
+    fprintf(stderr, "FAILURE IN <find_image>: OUT OF MEMORY\n");
+    exit(EXIT_FAILURE);
+  }
+  images[k].image = NULL;
+  images[k].snapshot = 0;
+  return nimages++;
+}
+
+// read each of the shared images, for their jobs to share
+static void share_images(void){
+  unsigned char image[MEMSIZE];
+  int k, len;
+  for (k = 0; k < nimages; k++)
+    if (!(images[k].snapshot = xmachine_snapshot(images[k].name))
+        && (len = load_image(images[k].name, image)) >= 0)
+      images[k].image = xmachine_image_create(image, len);
+}
+
+/**************************************************************
+ * Load an image just as xmpsim does (end-of-file byte and all,
+ * so that a job sees just the same memory). Returns the number
+ * of bytes loaded, or -1 if the image is missing, or too big.
+ **************************************************************/
+static int load_image(char *name, unsigned char *image){
+  FILE *fd;
+  int len;
+
+  if ((fd = fopen(name, "rb")) == NULL)
+    return -1;
+  len = fread(image, 1, MEMSIZE, fd);
+  fclose(fd);
+  if (len >= MEMSIZE - 1)
+    return -1;
+  image[len++] = (unsigned char) EOF;
+  return len;
+}
+
+// the CPUs of a job all run on its worker's thread, so no lock is needed
+static void take_output(void *arg, int id, unsigned char ch){
+  farm_job *job = (farm_job *) arg;
+  append(&job->out, (char *) &ch, 1);
+}
+
+// say why a CPU stopped, just as xmpsim would
+static void take_stop(void *arg, const xmachine_stop *stop){
+  farm_job *job = (farm_job *) arg;
+  char msg[120];
+  const char *why = (stop->why == XMACHINE_HALTED)? "CPU %d has halted"
+    : (stop->why == XMACHINE_SPINNING)? "CPU %d was left spinning"
+    : "CPU ran %d out of time";
+  int n;
+
+  if (stop->why == XMACHINE_FAULT){
+    append(&job->err, msg, sprintf(msg, "Exception error at 0x%4.4x."
+                                   " CPU has halted.\n", stop->pc));
+    return;
+  }
+  n = sprintf(msg, "\n<");
+  n += sprintf(msg+n, why, stop->id);
+  n += sprintf(msg+n, " after %d cycles at PC = %4.4x : %4.4x>\n",
+               stop->cycles, stop->pc, stop->instruction);
+  if (config.idle_skip)
+    n += sprintf(msg+n, "<CPU %d skipped %d idle cycles>\n", stop->id,
+                 stop->skipped);
+  append(&job->err, msg, n);
+}
+
+static void append(farm_text *t, const char *bytes, int n){
+  if (t->length + n > t->size){
+    t->size = (t->size)? 2*t->size : 256;
+    if (t->size < t->length + n)
+      t->size = t->length + n;
+    if ((t->data = realloc(t->data, t->size)) == NULL){
+      fprintf(stderr, "FAILURE IN <append>: OUT OF MEMORY\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memcpy(t->data + t->length, bytes, n);
+  t->length += n;
+}
+
+/**************************************************************
+ * Write out job k: to its own files, at once, or else to the
+ * results, once every job before it has been written.
+ **************************************************************/
+static void write_job(int k){
+  char name[FARM_LINE];
+  farm_job *job;
+
+  if (dir){
+    snprintf(name, sizeof(name), "%s/job.%d.out", dir, k);
+    save(name, &jobs[k].out);
+    snprintf(name, sizeof(name), "%s/job.%d.err", dir, k);
+    save(name, &jobs[k].err);
+    free(jobs[k].out.data);
+    free(jobs[k].err.data);
+    return;
+  }
+  pthread_mutex_lock(&out_lock);
+  jobs[k].done = 1;
+  for (; next_out < njobs && jobs[next_out].done; next_out++){
+    job = &jobs[next_out];
+    fprintf(results, "=== job %d (line %d): %s %d %d %d: %d bytes out\n",
+            next_out, job->line, job->image, job->cycles,
+            job->interrupt_freq, job->ncpu, job->out.length);
+    fwrite(job->out.data, 1, job->out.length, results);
+    fprintf(results, "\n--- job %d stopped:\n", next_out);
+    fwrite(job->err.data, 1, job->err.length, results);
+    free(job->out.data);
+    free(job->err.data);
+  }
+  pthread_mutex_unlock(&out_lock);
+}
+
+static void save(char *name, farm_text *t){
+  FILE *fd;
+  if ((fd = fopen(name, "w")) == NULL){
+    char msg[FARM_LINE + 40] = "error: could not write to ";
+    strncat(msg, name, FARM_LINE);
+    fatal(msg);
+  }
+  fwrite(t->data, 1, t->length, fd);
+  fclose(fd);
+}
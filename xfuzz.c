@@ -0,0 +1,542 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/shm.h>
+#include "xcpu.h"
+#include "xout.h"
+#include "xmachine.h"
+
+/**
+ * xfuzz fuzzes a guest programme in-process, guided by the edges of its
+ * control flow that each input makes it take (see XCPU_EDGES):
+ *
+ *   xfuzz -b address:size [options] <image> [input ...]
+ *
+ * Each input is put into a buffer in the guest's memory -- its length, as
+ * a word, at the address, and then its bytes, up to size of them -- and
+ * the machine run until every CPU halts, or has run the budget of cycles
+ * (-c). A CPU that takes an exception it has no table for (XMACHINE_FAULT)
+ * is a crash. The machine is made just once: loaded from the image (or
+ * restored from a snapshot, with -R: see xmpsim -S), run for a while first
+ * if asked (-w, to boot a kernel, say), and checkpointed there; between
+ * inputs it is only reset (see xmachine_reset), which copies back just the
+ * pages that the last input's run wrote to.
+ *
+ * The CPUs run in the covered build of the threaded engine, taking turns
+ * on the one thread (as with xmpsim -q), and count the edges into a map of
+ * AFL's size and shape. Under AFL (with __AFL_SHM_ID set), that map is
+ * AFL's own shared memory, so that xfuzz, given an input, serves as a
+ * target that AFL runs without a fork server (AFL_NO_FORKSRV). Built with
+ * XFUZZ_LIBFUZZER (make xfuzz_libfuzzer), it is a libFuzzer target instead:
+ * the options and image are taken from XFUZZ_ARGS, the map is one of
+ * libFuzzer's extra counters, and a crash aborts.
+ *
+ * Otherwise, given inputs, xfuzz runs each once and says how it went (with
+ * the guest's output, with -o), aborting at the end if any crashed. Given
+ * none, it fuzzes on its own: from the corpus in a directory (-d), or else
+ * from an empty input, it mutates inputs picked at random, and keeps those
+ * that take an edge it has not seen taken as often (in AFL's buckets of
+ * counts) in the corpus, and the directory; a crash that does so is saved
+ * too (crash.N, in the directory or here).
+ **/
+
+#define FUZZ_CYCLES 100000            /* the budget of an input, unless -c */
+#define FUZZ_QUANTUM 1000             /* cycles a turn */
+#define FUZZ_CORPUS 4096              /* inputs kept, at most */
+#define FUZZ_REPORT 100000            /* runs between reports */
+#define FUZZ_ARGS 32                  /* words of XFUZZ_ARGS, at most */
+#define FUZZ_NAME 512
+
+// an input worth keeping
+typedef struct fuzz_input {
+  unsigned char *data;
+  int length;
+} fuzz_input;
+
+static void usage(char *name);
+static int setup(int argc, char *argv[]);
+static int load_image(char *name, unsigned char *image);
+static int run_input(const unsigned char *data, int length);
+static void take_output(void *arg, int id, unsigned char ch);
+static void take_stop(void *arg, const xmachine_stop *stop);
+#ifndef XFUZZ_LIBFUZZER
+static int replay(int n, char *names[]);
+static void fuzz(void);
+static void try_input(const unsigned char *data, int length);
+static int mutate(unsigned char *data, int length);
+static int news(unsigned char *seen);
+static void keep(const unsigned char *data, int length, int write);
+static void write_input(char *name, const unsigned char *data, int length);
+static int read_input(char *name, unsigned char *data);
+static unsigned int below(unsigned int n);
+#endif
+
+/** GLOBAL VARIABLES (NECESSARY EVILS) **/
+
+xmachine *m;             // the machine, reset for each input
+unsigned char *edges;    // the map its CPUs count edges into
+int buffer_at = -1;      // where each input goes (-b)
+int buffer_size;         // and the most of it that fits
+int cycles = FUZZ_CYCLES;// the budget of each input (-c)
+int warming = 0;         // the stops of the warm-up are no crash (-w)
+int crashed;             // a CPU of the last run took a fault,
+int timed_out;           // or ran out of time
+xmachine_stop last_stop; // of the last CPU that stopped
+int show = 0;            // write out the guest's output (-o)
+char *dir = NULL;        // the corpus (-d)
+long runs = 0;           // how many inputs to try, 0 for no end (-n)
+unsigned long long rng = 1;  // the state of the random numbers (-s)
+
+// the map, unless AFL gives one; libFuzzer finds it by its section
+#ifdef XFUZZ_LIBFUZZER
+__attribute__((section("__libfuzzer_extra_counters"), used))
+#endif
+unsigned char map[XCPU_EDGES];
+
+#ifndef XFUZZ_LIBFUZZER
+unsigned char seen[XCPU_EDGES];       // the buckets each edge has been seen
+unsigned char seen_crashing[XCPU_EDGES];  // in, and by a crash
+unsigned char bucket[256];            // AFL's buckets of counts, as bits
+fuzz_input corpus[FUZZ_CORPUS];
+int ncorpus = 0;
+long ncrashes = 0, nsaved = 0, ntimeouts = 0;
+long pages = 0;                       // copied back by the resets, over all
+unsigned char work[MEMSIZE];          // the input being tried
+#endif
+
+/***************************************************************************/
+
+#ifdef XFUZZ_LIBFUZZER
+
+// make the machine, from the words of XFUZZ_ARGS (libFuzzer has argv)
+int LLVMFuzzerInitialize(int *argc, char ***argv){
+  char *args = getenv("XFUZZ_ARGS"), *arg[FUZZ_ARGS + 1], *word;
+  int n = 0;
+
+  arg[n++] = (*argv)[0];
+  if (args == NULL || (args = strdup(args)) == NULL)
+    usage(arg[0]);
+  for (word = strtok(args, " "); word != NULL && n < FUZZ_ARGS;
+       word = strtok(NULL, " "))
+    arg[n++] = word;
+  arg[n] = NULL;
+  if (setup(n, arg) != n)     // no inputs: libFuzzer gives those
+    usage(arg[0]);
+  return 0;
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size){
+  if (run_input(data, (size > (size_t) buffer_size)? buffer_size : size))
+    abort();
+  return 0;
+}
+
+#else
+
+int main(int argc, char *argv[]){
+  int first = setup(argc, argv), bad = 0;
+
+  if (first < argc)
+    bad = replay(argc - first, argv + first);
+  else
+    fuzz();
+  xmachine_destroy(m);
+  if (bad)
+    abort();                // a crash of the process, for AFL to see
+  return 0;
+}
+
+#endif
+
+static void usage(char *name){
+  fprintf(LOG, "Usage: %s -b address:size [-c cycles] [-d directory]"
+          " [-i interrupt frequency] [-n runs] [-o] [-p CPUs] [-R]"
+          " [-s seed] [-w cycles] <image> [input ...]\n", name);
+  exit(EXIT_FAILURE);
+}
+
+/**************************************************************
+ * Make the machine from the options and the image, and run it
+ * to where each input starts from. Returns the index of the
+ * first input in argv.
+ **************************************************************/
+static int setup(int argc, char *argv[]){
+  xmachine_config config;
+  unsigned char image[MEMSIZE];
+  int opt, ncpu = 1, warmup = 0, snapshot = 0, len;
+  char *shm;
+
+  xmachine_defaults(&config);
+  config.engine = XMACHINE_THREADED;  // the only one that counts edges
+  config.quantum = FUZZ_QUANTUM;
+  config.console = XOUT_DIRECT;
+  while ((opt = getopt(argc, argv, "b:c:d:i:n:op:Rs:w:")) != -1){
+    switch (opt){
+    case 'b':   // the buffer for each input
+      if (sscanf(optarg, "%i:%i", &buffer_at, &buffer_size) != 2
+          || buffer_at < 0 || buffer_size < 0
+          || buffer_at + 2 + buffer_size > MEMSIZE)
+        usage(argv[0]);
+      break;
+    case 'c':   // the cycles each CPU may run, per input
+      if ((cycles = atoi(optarg)) <= 0)
+        usage(argv[0]);
+      break;
+    case 'd':   // the corpus
+      dir = optarg;
+      break;
+    case 'i':   // the timer's interrupt frequency, as for xmpsim
+      if ((config.interrupt_freq = atoi(optarg)) < 0)
+        usage(argv[0]);
+      break;
+    case 'n':   // how many inputs to try
+      if ((runs = atol(optarg)) < 0)
+        usage(argv[0]);
+      break;
+    case 'o':   // show what the guest writes
+      show = 1;
+      break;
+    case 'p':   // the number of CPUs
+      if ((ncpu = atoi(optarg)) <= 0)
+        usage(argv[0]);
+      break;
+    case 'R':   // the image is a snapshot
+      snapshot = 1;
+      break;
+    case 's':   // the seed of the mutations
+      rng = strtoull(optarg, NULL, 0) | 1;
+      break;
+    case 'w':   // run this many cycles before the first input
+      if ((warmup = atoi(optarg)) < 0)
+        usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind >= argc || buffer_at < 0)
+    usage(argv[0]);
+
+  edges = map;
+  if ((shm = getenv("__AFL_SHM_ID")) != NULL
+      && (edges = shmat(atoi(shm), NULL, 0)) == (void *) -1)
+    fatal("error: could not attach AFL's map");
+  config.coverage = edges;
+  m = xmachine_create(0, ncpu);
+  xmachine_configure(m, &config);
+  xmachine_output(m, take_output, NULL);
+  xmachine_reporter(m, take_stop, NULL);
+  if (snapshot){
+    if (xmachine_restore(m, argv[optind])){
+      char msg[80] = "error: could not restore snapshot ";
+      strncat(msg, argv[optind], 40);
+      fatal(msg);
+    }
+  } else {
+    if ((len = load_image(argv[optind], image)) < 0){
+      char msg[80] = "error: could not load image ";
+      strncat(msg, argv[optind], 40);
+      fatal(msg);
+    }
+    xmachine_load(m, image, len);
+  }
+  if (warmup){
+    warming = 1;
+    if (xmachine_run(m, warmup) == 0)
+      fatal("error: every CPU stopped while warming up");
+    warming = 0;
+  }
+  xmachine_checkpoint(m);
+  return optind + 1;
+}
+
+/**************************************************************
+ * Load an image just as xmpsim does (end-of-file byte and all).
+ * Returns the number of bytes loaded, or -1 if the image is
+ * missing, or too big.
+ **************************************************************/
+static int load_image(char *name, unsigned char *image){
+  FILE *fd;
+  int len;
+
+  if ((fd = fopen(name, "rb")) == NULL)
+    return -1;
+  len = fread(image, 1, MEMSIZE, fd);
+  fclose(fd);
+  if (len >= MEMSIZE - 1)
+    return -1;
+  image[len++] = (unsigned char) EOF;
+  return len;
+}
+
+/**************************************************************
+ * Put the machine back at its checkpoint, put the input into
+ * its buffer, and run it. Returns whether it crashed.
+ **************************************************************/
+static int run_input(const unsigned char *data, int length){
+  unsigned char *mem = xmachine_memory(m);
+
+  if (length > buffer_size)
+    length = buffer_size;
+#ifndef XFUZZ_LIBFUZZER
+  pages += xmachine_reset(m);
+#else
+  xmachine_reset(m);
+#endif
+  mem[buffer_at] = length >> 8;
+  mem[buffer_at + 1] = length & 0xFF;
+  memcpy(mem + buffer_at + 2, data, length);
+  xmachine_wrote(m, buffer_at, length + 2);
+  crashed = timed_out = 0;
+  xmachine_run(m, cycles);
+  return crashed;
+}
+
+// the CPUs all run on the one thread, so no lock is needed
+static void take_output(void *arg, int id, unsigned char ch){
+  if (show)
+    putchar(ch);
+}
+
+static void take_stop(void *arg, const xmachine_stop *stop){
+  if (warming)
+    return;
+  last_stop = *stop;
+  if (stop->why == XMACHINE_FAULT)
+    crashed = 1;
+  else if (stop->why == XMACHINE_OUT_OF_TIME)
+    timed_out = 1;
+}
+
+#ifndef XFUZZ_LIBFUZZER
+
+/**************************************************************
+ * Run each of the inputs once, and say how it went. Returns
+ * whether any crashed.
+ **************************************************************/
+static int replay(int n, char *names[]){
+  int k, length, bad = 0;
+
+  for (k = 0; k < n; k++){
+    if ((length = read_input(names[k], work)) < 0){
+      fprintf(LOG, "<%s: could not be read>\n", names[k]);
+      continue;
+    }
+    memset(edges, 0, XCPU_EDGES);
+    if (run_input(work, length)){
+      bad = 1;
+      fprintf(LOG, "<%s: crashed at PC = %4.4x : %4.4x>\n", names[k],
+              last_stop.pc, last_stop.instruction);
+    } else
+      fprintf(LOG, "<%s: %s>\n", names[k],
+              (timed_out)? "ran out of time" : "halted");
+    fflush(stdout);
+  }
+  return bad;
+}
+
+/**************************************************************
+ * Fuzz, from the corpus in dir (if any), for runs inputs (or
+ * for ever), saying how it goes every FUZZ_REPORT of them.
+ **************************************************************/
+static void fuzz(void){
+  struct timespec from, to;
+  DIR *d;
+  struct dirent *e;
+  char name[FUZZ_NAME];
+  int k, length;
+  long run;
+  double secs;
+
+  // AFL's buckets: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128 and more
+  for (k = 1; k < 256; k++)
+    bucket[k] = (k < 4)? 1 << (k-1) : (k < 8)? 8 : (k < 16)? 16
+      : (k < 32)? 32 : (k < 128)? 64 : 128;
+  if (dir != NULL && (d = opendir(dir)) != NULL){
+    while ((e = readdir(d)) != NULL && ncorpus < FUZZ_CORPUS){
+      if (e->d_name[0] == '.' || !strncmp(e->d_name, "crash.", 6))
+        continue;
+      snprintf(name, FUZZ_NAME, "%s/%s", dir, e->d_name);
+      if ((length = read_input(name, work)) < 0)
+        continue;
+      try_input(work, length);
+      if (!crashed)
+        keep(work, length, 0);  // the seeds are all kept, new or not
+    }
+    closedir(d);
+  }
+  if (ncorpus == 0){
+    try_input(work, 0);
+    keep(work, 0, dir != NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &from);
+  for (run = 1; runs == 0 || run <= runs; run++){
+    fuzz_input *in = &corpus[below(ncorpus)];
+    memcpy(work, in->data, in->length);
+    try_input(work, mutate(work, in->length));
+    if (run % FUZZ_REPORT == 0 || run == runs){
+      int edges_seen = 0;
+      clock_gettime(CLOCK_MONOTONIC, &to);
+      secs = (to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) / 1e9;
+      for (k = 0; k < XCPU_EDGES; k++)
+        edges_seen += (seen[k] != 0);
+      fprintf(LOG, "<%ld runs in %.3f seconds: %.1f runs per second, %d"
+              " edges, %d kept, %ld crashes (%ld saved), %ld out of time,"
+              " %.1f pages reset per run>\n", run, secs,
+              (secs > 0)? run / secs : 0.0, edges_seen, ncorpus, ncrashes,
+              nsaved, ntimeouts, (double) pages / run);
+    }
+  }
+}
+
+// run the input, and keep it (or save it, if it crashed) if it is new
+static void try_input(const unsigned char *data, int length){
+  char name[FUZZ_NAME];
+
+  memset(edges, 0, XCPU_EDGES);
+  if (run_input(data, length)){
+    ncrashes++;
+    if (news(seen_crashing)){
+      snprintf(name, FUZZ_NAME, "%s/crash.%ld", (dir)? dir : ".", nsaved++);
+      write_input(name, data, length);
+      fprintf(LOG, "<crashed at PC = %4.4x : %4.4x, saved to %s>\n",
+              last_stop.pc, last_stop.instruction, name);
+    }
+    return;
+  }
+  ntimeouts += timed_out;
+  if (news(seen))
+    keep(data, length, dir != NULL);
+}
+
+/**************************************************************
+ * Change the input a few times over, in ways picked at random:
+ * flip a bit, set a byte (to anything, or to a value that is
+ * often interesting), add to one, put one in or take one out,
+ * or copy a run of bytes from another input over it. Returns
+ * the new length, at most buffer_size.
+ **************************************************************/
+static int mutate(unsigned char *data, int length){
+  static const unsigned char interesting[] = {
+    0, 1, 0x7F, 0x80, 0xFF, '\n', ' ', '0', 'a'
+  };
+  int n = 1 + below(4), at, k;
+
+  while (n--){
+    at = below(length + 1);     // length itself only to append
+    switch ((length == 0)? 4 : below(7)){
+    case 0:
+      data[below(length)] ^= 1 << below(8);
+      break;
+    case 1:
+      data[below(length)] = below(256);
+      break;
+    case 2:
+      data[below(length)] = interesting[below(sizeof(interesting))];
+      break;
+    case 3:
+      data[below(length)] += below(17) - 8;
+      break;
+    case 4:
+      if (length < buffer_size){
+        memmove(data + at + 1, data + at, length - at);
+        data[at] = below(256);
+        length++;
+      }
+      break;
+    case 5:
+      if (at < length){
+        memmove(data + at, data + at + 1, length - at - 1);
+        length--;
+      }
+      break;
+    case 6: {
+      fuzz_input *other = &corpus[below(ncorpus)];
+      if (other->length){
+        int from = below(other->length);
+        k = 1 + below(other->length - from);
+        if (at + k > buffer_size)
+          k = buffer_size - at;
+        memcpy(data + at, other->data + from, k);
+        if (at + k > length)
+          length = at + k;
+      }
+      break;
+    }
+    }
+  }
+  return length;
+}
+
+// bring seen up to date with the last run's edges; were any of them new?
+static int news(unsigned char *seen){
+  unsigned long long word;
+  int k, i, found = 0;
+
+  for (k = 0; k < XCPU_EDGES; k += sizeof(word)){
+    memcpy(&word, edges + k, sizeof(word));
+    if (word)
+      for (i = k; i < k + (int) sizeof(word); i++)
+        if (bucket[edges[i]] & ~seen[i]){
+          seen[i] |= bucket[edges[i]];
+          found = 1;
+        }
+  }
+  return found;
+}
+
+// add the input to the corpus (and write it to dir), if there is room
+static void keep(const unsigned char *data, int length, int write){
+  char name[FUZZ_NAME];
+  fuzz_input *in = &corpus[ncorpus];
+
+  if (ncorpus == FUZZ_CORPUS)
+    return;
+  if ((in->data = malloc(length + 1)) == NULL){
+    fprintf(stderr, "FAILURE IN <keep>: OUT OF MEMORY\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(in->data, data, length);
+  in->length = length;
+  if (write){
+    snprintf(name, FUZZ_NAME, "%s/input.%d", dir, ncorpus);
+    write_input(name, data, length);
+  }
+  ncorpus++;
+}
+
+static void write_input(char *name, const unsigned char *data, int length){
+  FILE *fd;
+  if ((fd = fopen(name, "wb")) == NULL){
+    char msg[80] = "error: could not write to ";
+    strncat(msg, name, 50);
+    fatal(msg);
+  }
+  fwrite(data, 1, length, fd);
+  fclose(fd);
+}
+
+// read up to buffer_size bytes of the file; returns how many, or -1
+static int read_input(char *name, unsigned char *data){
+  FILE *fd;
+  int length;
+  if ((fd = fopen(name, "rb")) == NULL)
+    return -1;
+  length = fread(data, 1, buffer_size, fd);
+  fclose(fd);
+  return length;
+}
+
+// a number from 0 to n-1, at random (xorshift64*)
+static unsigned int below(unsigned int n){
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return (unsigned int) ((rng * 2685821657736338717ULL) >> 32) % n;
+}
+
+#endif
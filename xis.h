@@ -18,7 +18,7 @@
 #define XIS_REL_SIZE 8        /* number of bits in a relative address */
 #define XIS_ABS_SIZE 16       /* number of bits in an absolute address */
 
-#define I_NUM 47              /* number of opcodes */
+#define I_NUM 48              /* number of opcodes */
 
 /* Instruction (opcodes) encodings */
 
@@ -47,6 +47,7 @@ enum {
  I_LIT     = 0x4A, /* 01  0 01010  */
  I_CPUID   = 0x4B, /* 01  0 01011  */
  I_CPUNUM  = 0x4C, /* 01  0 01100  */
+ I_IPI     = 0x4D, /* 01  0 01101  */
 
                    /* OPS I OPNUM   Operations with one immediate operand */
  I_BR      = 0x61, /* 01  1 00001  */
@@ -116,6 +117,7 @@ static struct x_inst x_instructions[I_NUM] = {
  { "lit", I_LIT },
  { "cpuid", I_CPUID },
  { "cpunum", I_CPUNUM },
+ { "ipi", I_IPI },
 
  { "br", I_BR },
  { "jr", I_JR },
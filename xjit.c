@@ -0,0 +1,850 @@
+#define XCPU
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#define X_INSTRUCTIONS_NOT_NEEDED
+#include "xis.h"
+#include "xcpu.h"
+#include "xjit.h"
+#include "xspin.h"
+
+/**
+ * The basic-block translator. Straight-line runs of X instructions, ending at
+ * the first branch, jump, call, return, iret or trap, are translated into
+ * x86-64 code in a private executable buffer, and blocks that jump to one
+ * another at fixed addresses are then chained together, by patching the jump
+ * at the end of one to land on the next. Indirect jumps (jmpr, callr, ret,
+ * iret, trap) look their target up in a table indexed by X address.
+ *
+ * While translated code runs, rbx holds the cpu context, r12 the memory,
+ * r13 the number of cycles left in the burst, r14 the translator, and r15 the
+ * table of blocks. The X registers stay in the cpu context and are operated
+ * on in place, so that helpers written in C (out, the atomic instructions,
+ * exceptions) see them as usual.
+ *
+ * Cycle counts must come out exactly as with the other engines, so that the
+ * periodic interrupts arrive on the same instruction. Each block charges
+ * itself to r13 on entry; if the burst does not have room for the whole of
+ * it, control returns to xjit_run, which steps through the remaining cycles
+ * one at a time with xcpu_execute. The same happens for anything that is not
+ * worth translating: bad instructions, std, code outside the loaded image,
+ * and anything run while the debug bit is set.
+ *
+ * Self-modifying code is detected through the predecoded instruction cache,
+ * which every translated instruction is taken from: when a store lands on a
+ * decoded instruction, the cache bumps its generation. Every block checks the
+ * generation on entry (and after any store that might have hit code), and
+ * when it has moved, the whole of this CPU's translation is thrown away.
+ * Stores by other CPUs are caught the same way, at the next block boundary.
+ **/
+
+#define XJIT_CODE_SIZE (4 << 20)   // bytes of translated code, per CPU
+#define XJIT_MAX_BLOCK 64          // instructions per block
+#define XJIT_SLACK     (16 << 10)  // room that must be free to start a block
+#define XJIT_NO_BLOCK  0xFF        // length of a pc that cannot be translated
+
+// why translated code returned to xjit_run
+enum { EXIT_PC, EXIT_CHAIN, EXIT_TRACE, EXIT_IDLE };
+
+struct xjit {
+  /* these are used by the translated code, and must come first */
+  unsigned int *generation;           /* the cache's code generation */
+  unsigned int snapshot;              /* generation the blocks were made in */
+  unsigned short lastpc;              /* last instruction completed */
+  long budget;                        /* cycles left on return */
+  void **block;                       /* translated block for each pc */
+  unsigned char *patch;               /* jump to chain, after EXIT_CHAIN */
+  /* the rest is private to xjit.c */
+  xcpu *c;
+  IHandler *table;
+  unsigned int limit;                 /* pcs below limit may be translated */
+  unsigned int reach;                 /* stores below reach may hit code */
+  unsigned char *length;              /* instructions in each block */
+  unsigned char *code;                /* the executable buffer */
+  unsigned char *first;               /* first byte after the glue code */
+  unsigned char *free;                /* next byte to translate into */
+  unsigned char *leave;               /* returns from translated code */
+  unsigned int flushes;               /* how many times the code was dropped */
+  int (*enter)(xcpu *c, void *code, long budget, xjit *j);
+};
+
+// a forward jump out of a block, to be resolved once the block is done
+typedef struct xjit_exit {
+  unsigned char *site;                /* rel32 of the jump */
+  int kind;
+  int pc;                             /* pc to leave with, or -1 */
+  int lastpc;                         /* last instruction done, or -1 */
+  int done;                           /* instructions done in the block */
+} xjit_exit;
+
+enum { X_GUARD, X_MID, X_CHAIN, X_DYN, X_TRACE, X_IDLE };
+
+// x86 registers, by number
+enum { AX = 0, CX = 1, DX = 2 };
+
+// displacements of the cpu context (off rbx) and translator (off r14) fields
+#define REG(r)     (offsetof(xcpu, regs) + 2*(r))
+#define MEMORY     offsetof(xcpu, memory)
+#define STATE      offsetof(xcpu, state)
+#define ITR        offsetof(xcpu, itr)
+#define ID         offsetof(xcpu, id)
+#define NUM        offsetof(xcpu, num)
+#define PC         offsetof(xcpu, pc)
+#define SPIN       offsetof(xcpu, spin)
+#define DIRTY      offsetof(xcpu, dirty)
+#define READY      offsetof(xspin, ready)
+#define GENERATION offsetof(xjit, generation)
+#define SNAPSHOT   offsetof(xjit, snapshot)
+#define LASTPC     offsetof(xjit, lastpc)
+#define BUDGET     offsetof(xjit, budget)
+#define BLOCK      offsetof(xjit, block)
+#define PATCH      offsetof(xjit, patch)
+
+// every displacement is encoded in a single byte
+_Static_assert(offsetof(xcpu, pc) < 0x80, "cpu context too big for disp8");
+_Static_assert(offsetof(xcpu, spin) < 0x80, "cpu context too big for disp8");
+_Static_assert(offsetof(xjit, patch) < 0x80, "translator too big for disp8");
+
+static void flush(xjit *j);
+static void * translate(xjit *j, unsigned short int start, int *length);
+static void * block_at(xjit *j, unsigned short int pc);
+
+// a helper for stores to the loaded image: c->decoded is non-NULL; and to
+// either end of memory, whose copy of byte 0 it keeps (see MIRROR_SIZE)
+static void wrote(xcpu *c, unsigned int addr, int n){
+  xcpu_mirror(c->memory, addr, n);
+  xdcache_invalidate(c->decoded, addr, n);
+}
+
+/******************************************************************
+   The emitter. Machine code is written a byte at a time to j->free.
+******************************************************************/
+#define EMIT(...) emit(j, (const unsigned char []){__VA_ARGS__}, \
+                       sizeof((const unsigned char []){__VA_ARGS__}))
+
+static void emit(xjit *j, const unsigned char *bytes, int n){
+  memcpy(j->free, bytes, n);
+  j->free += n;
+}
+
+static void emit16(xjit *j, unsigned int v){
+  EMIT(v & 0xFF, (v >> 8) & 0xFF);
+}
+
+static void emit32(xjit *j, unsigned int v){
+  emit16(j, v & 0xFFFF);
+  emit16(j, v >> 16);
+}
+
+static void emit64(xjit *j, uint64_t v){
+  emit32(j, (unsigned int) v);
+  emit32(j, (unsigned int) (v >> 32));
+}
+
+// point the rel32 at site to target
+static void land(unsigned char *site, unsigned char *target){
+  int32_t rel = (int32_t) (target - (site + 4));
+  memcpy(site, &rel, 4);
+}
+
+// jcc rel32 / jmp rel32 to be landed later: return the rel32's address
+static unsigned char * jcc(xjit *j, unsigned char cc){
+  EMIT(0x0F, cc);
+  emit32(j, 0);
+  return j->free - 4;
+}
+#define JB  0x82
+#define JAE 0x83
+#define JE  0x84
+#define JNE 0x85
+
+static unsigned char * jump(xjit *j){
+  EMIT(0xE9);
+  emit32(j, 0);
+  return j->free - 4;
+}
+
+// op reg16, [rbx+disp], or op [rbx+disp], reg16
+static void op16(xjit *j, unsigned char op, int reg, int disp){
+  EMIT(0x66, op, 0x43 | reg << 3, disp);
+}
+#define MOV_LOAD  0x8B
+#define MOV_STORE 0x89
+
+// movzx reg32, word [rbx+disp]
+static void movzx(xjit *j, int reg, int disp){
+  EMIT(0x0F, 0xB7, 0x43 | reg << 3, disp);
+}
+
+// mov word [rbx+disp], imm16
+static void set16(xjit *j, int disp, unsigned int v){
+  EMIT(0x66, 0xC7, 0x43, disp);
+  emit16(j, v);
+}
+
+// and/or word [rbx+STATE], imm16
+static void state_and(xjit *j, unsigned int mask){
+  EMIT(0x66, 0x81, 0x63, STATE);
+  emit16(j, mask);
+}
+static void state_or(xjit *j, unsigned int bits){
+  EMIT(0x66, 0x81, 0x4B, STATE);
+  emit16(j, bits);
+}
+
+// state = (cc holds)? state | 1 : state & ~1, for the flags just set
+static void set_cond(xjit *j, unsigned char setcc){
+  EMIT(0x0F, setcc, 0xC2,             // setcc dl
+       0x0F, 0xB6, 0xD2);             // movzx edx, dl
+  state_and(j, 0xFFFE);
+  op16(j, 0x09, DX, STATE);           // or [state], dx
+}
+
+// mov word [r14+LASTPC], pc
+static void set_lastpc(xjit *j, unsigned int pc){
+  EMIT(0x66, 0x41, 0xC7, 0x46, LASTPC);
+  emit16(j, pc);
+}
+
+// call fn(c, esi, edx, ...), with rdi = c; rsp is kept 16-byte aligned
+static void call_c(xjit *j, void *fn){
+  EMIT(0x48, 0x89, 0xDF);             // mov rdi, rbx
+  EMIT(0x48, 0xB8);                   // mov rax, fn
+  emit64(j, (uintptr_t) fn);
+  EMIT(0xFF, 0xD0);                   // call rax
+}
+
+// call one of the xcpu.c instruction functions
+static void call_handler(xjit *j, xdecoded *d){
+  EMIT(0xBE);                         // mov esi, instruction
+  emit32(j, d->instruction);
+  call_c(j, d->handler);
+}
+
+// ecx = the big-endian word at X address eax (0xFFFF reads the mirror of
+// byte 0, so there is no wrapping round)
+static void fetch_word(xjit *j){
+  EMIT(0x41, 0x0F, 0xB7, 0x0C, 0x04,  // movzx ecx, word [r12+rax]
+       0x66, 0xC1, 0xC1, 0x08);       // rol cx, 8
+}
+
+// store cx, big-endian, at X address eax (clobbers edx; esi = eax); a
+// store at either end of memory is mirrored by wrote (see after_store)
+static void store_word(xjit *j){
+  EMIT(0x89, 0xC6,                    // mov esi, eax
+       0x89, 0xCA,                    // mov edx, ecx
+       0x66, 0xC1, 0xC2, 0x08,        // rol dx, 8
+       0x66, 0x41, 0x89, 0x14, 0x04); // mov [r12+rax], dx
+}
+
+// jump to site if an atomic read has just found a spin loop (see xspin.h)
+static unsigned char * check_spin(xjit *j){
+  EMIT(0x48, 0x8B, 0x43, SPIN,        // mov rax, [rbx+SPIN]
+       0x48, 0x85, 0xC0,              // test rax, rax
+       0x74, 0x0A,                    // je past the jne
+       0x83, 0x78, READY, 0x00);      // cmp dword [rax+READY], 0
+  return jcc(j, JNE);
+}
+
+// jump to site if the code generation has moved since the translation
+static unsigned char * check_generation(xjit *j){
+  EMIT(0x49, 0x8B, 0x46, GENERATION,  // mov rax, [r14+GENERATION]
+       0x8B, 0x00,                    // mov eax, [rax]
+       0x41, 0x3B, 0x46, SNAPSHOT);   // cmp eax, [r14+SNAPSHOT]
+  return jcc(j, JNE);
+}
+
+/******************************************************************
+   Everything needed to translate one block.
+******************************************************************/
+typedef struct xjit_block {
+  xjit *j;
+  unsigned short int start;
+  int done;                           /* instructions translated so far */
+  int nexits;
+  xjit_exit exit[4*XJIT_MAX_BLOCK + 2];
+} xjit_block;
+
+static void add_exit(xjit_block *b, unsigned char *site, int kind, int pc,
+                     int lastpc){
+  xjit_exit *e = &b->exit[b->nexits++];
+  e->site = site;
+  e->kind = kind;
+  e->pc = pc;
+  e->lastpc = lastpc;
+  e->done = b->done;
+}
+
+// mark the page of the X address in edx as written (clobbers edx)
+static void mark_dirty(xjit *j){
+  EMIT(0x0F, 0xB6, 0xD6,              // movzx edx, dh
+       0xC6, 0x84, 0x13);             // mov byte [rbx+rdx+DIRTY], XCPU_DIRTY
+  emit32(j, DIRTY);
+  EMIT(XCPU_DIRTY);
+}
+
+/**
+ * After a store of n bytes at the X address in esi: mark its page as
+ * written (and the next, which the second byte of a word may be on). If
+ * the store may have landed on code, report it to the instruction cache,
+ * and leave the block (at pc, having done the instruction at lastpc) if
+ * any code was hit. A
+ * store at address 0 is always below reach (there is code, or there would
+ * be no block), and a word at 0xFFFF is sent on as well, so wrote sees
+ * every store that needs mirroring.
+ **/
+static void after_store(xjit_block *b, int n, int pc, int lastpc){
+  xjit *j = b->j;
+  unsigned char *hit, *miss;
+
+  EMIT(0x89, 0xF2);                   // mov edx, esi
+  mark_dirty(j);
+  if (n > 1){
+    EMIT(0x8D, 0x56, n - 1);          // lea edx, [rsi+n-1]: dh is its page
+    mark_dirty(j);
+  }
+  EMIT(0x81, 0xFE);                   // cmp esi, reach
+  emit32(j, j->reach);
+  hit = jcc(j, JB);
+  if (n > 1){
+    EMIT(0x81, 0xFE);                 // cmp esi, 0xFFFF: wraps to address 0
+    emit32(j, MEMSIZE - 1);
+    miss = jcc(j, JNE);
+  } else {
+    miss = jump(j);
+  }
+  land(hit, j->free);
+  EMIT(0xBA);                         // mov edx, n
+  emit32(j, n);
+  call_c(j, wrote);
+  add_exit(b, check_generation(j), X_MID, pc, lastpc);
+  land(miss, j->free);
+}
+
+// push cx (clobbers eax, edx, esi)
+static void push_cx(xjit_block *b, int pc, int lastpc){
+  xjit *j = b->j;
+  EMIT(0x66, 0x83, 0x6B, REG(X_STACK_REG), WORD_SIZE);  // sub [r15], 2
+  movzx(j, AX, REG(X_STACK_REG));
+  store_word(j);
+  after_store(b, WORD_SIZE, pc, lastpc);
+}
+
+// ecx = popped word (clobbers eax, edx)
+static void pop_cx(xjit *j){
+  movzx(j, AX, REG(X_STACK_REG));
+  fetch_word(j);
+  EMIT(0x66, 0x83, 0x43, REG(X_STACK_REG), WORD_SIZE);  // add [r15], 2
+}
+
+// jump to the block for the X address in eax, if there is one
+static void indirect(xjit_block *b){
+  xjit *j = b->j;
+  EMIT(0x3D);                         // cmp eax, limit
+  emit32(j, j->limit);
+  add_exit(b, jcc(j, JAE), X_DYN, -1, -1);
+  EMIT(0x49, 0x8B, 0x14, 0xC7,        // mov rdx, [r15+rax*8]
+       0x48, 0x85, 0xD2);             // test rdx, rdx
+  add_exit(b, jcc(j, JE), X_DYN, -1, -1);
+  EMIT(0xFF, 0xE2);                   // jmp rdx
+}
+
+// jump to the (possibly not yet translated) block at pc
+static void chain(xjit_block *b, unsigned short int pc){
+  add_exit(b, jump(b->j), X_CHAIN, pc, -1);
+}
+
+// as chain, but from the branch at from (done), which may close an idle
+// loop, and if so, should go back to xmpsim rather than round again
+static void branch_to(xjit_block *b, xdecoded *d, unsigned short int from,
+                      unsigned short int pc, unsigned char *site){
+  if (d->op == XDC_IDLE && pc <= from)
+    add_exit(b, site, X_IDLE, pc, from);
+  else
+    add_exit(b, site, X_CHAIN, pc, -1);
+}
+
+/**
+ * Translate the instruction d, at pc. Returns 1 if it ends the block.
+ **/
+static int translate_one(xjit_block *b, xdecoded *d, unsigned short int pc){
+  xjit *j = b->j;
+  unsigned short int next = pc + d->size;
+  unsigned short int target = pc + (signed char) (d->instruction & 0xFF);
+  unsigned short int immediate = d->instruction >> 16;
+  int r1 = REG(d->reg1), r2 = REG(d->reg2);
+
+  switch (d->opcode){
+  case I_ADD:
+    op16(j, MOV_LOAD, AX, r1);
+    op16(j, 0x01, AX, r2);              // add [r2], ax
+    break;
+  case I_SUB:                           // r2 + ~r1, as in xcpu.c
+    op16(j, MOV_LOAD, AX, r1);
+    EMIT(0x66, 0xF7, 0xD0);             // not ax
+    op16(j, 0x01, AX, r2);
+    break;
+  case I_MUL:
+    op16(j, MOV_LOAD, AX, r2);
+    EMIT(0x66, 0x0F, 0xAF, 0x43, r1);   // imul ax, [r1]
+    op16(j, MOV_STORE, AX, r2);
+    break;
+  case I_DIV:                           // faults on zero, as in xcpu.c
+    movzx(j, AX, r2);
+    movzx(j, CX, r1);
+    EMIT(0x31, 0xD2,                    // xor edx, edx
+         0xF7, 0xF1);                   // div ecx
+    op16(j, MOV_STORE, AX, r2);
+    break;
+  case I_AND:
+    op16(j, MOV_LOAD, AX, r1);
+    op16(j, 0x21, AX, r2);
+    break;
+  case I_OR:
+    op16(j, MOV_LOAD, AX, r1);
+    op16(j, 0x09, AX, r2);
+    break;
+  case I_XOR:
+    op16(j, MOV_LOAD, AX, r1);
+    op16(j, 0x31, AX, r2);
+    break;
+  case I_SHR:                           // the count is taken mod 32, as in C
+  case I_SHL:
+    movzx(j, AX, r2);
+    EMIT(0x8A, 0x4B, r1,                // mov cl, [r1]
+         0xD3, (d->opcode == I_SHR)? 0xE8 : 0xE0);  // shr/shl eax, cl
+    op16(j, MOV_STORE, AX, r2);
+    break;
+  case I_TEST:
+    op16(j, MOV_LOAD, AX, r1);
+    op16(j, 0x85, AX, r2);              // test [r2], ax
+    set_cond(j, 0x95);                  // setnz
+    break;
+  case I_CMP:
+    op16(j, MOV_LOAD, AX, r1);
+    op16(j, 0x3B, AX, r2);              // cmp ax, [r2]
+    set_cond(j, 0x92);                  // setb
+    break;
+  case I_EQU:
+    op16(j, MOV_LOAD, AX, r1);
+    op16(j, 0x3B, AX, r2);
+    set_cond(j, 0x94);                  // sete
+    break;
+  case I_MOV:
+    op16(j, MOV_LOAD, AX, r1);
+    op16(j, MOV_STORE, AX, r2);
+    break;
+  case I_NEG:
+    EMIT(0x66, 0xF7, 0x5B, r1);         // neg word [r1]
+    break;
+  case I_NOT:                           // a logical not, as in xcpu.c
+    EMIT(0x66, 0x83, 0x7B, r1, 0x00,    // cmp word [r1], 0
+         0x0F, 0x94, 0xC0,              // sete al
+         0x0F, 0xB6, 0xC0);             // movzx eax, al
+    op16(j, MOV_STORE, AX, r1);
+    break;
+  case I_INC:
+    EMIT(0x66, 0xFF, 0x43, r1);         // inc word [r1]
+    break;
+  case I_DEC:
+    EMIT(0x66, 0xFF, 0x4B, r1);         // dec word [r1]
+    break;
+  case I_LOAD:
+    movzx(j, AX, r1);
+    fetch_word(j);
+    op16(j, MOV_STORE, CX, r2);
+    break;
+  case I_LOADB:
+    movzx(j, AX, r1);
+    EMIT(0x41, 0x0F, 0xB6, 0x04, 0x04); // movzx eax, byte [r12+rax]
+    op16(j, MOV_STORE, AX, r2);
+    break;
+  case I_STOR:
+    movzx(j, AX, r2);
+    op16(j, MOV_LOAD, CX, r1);
+    store_word(j);
+    after_store(b, WORD_SIZE, next, pc);
+    break;
+  case I_STORB:
+    movzx(j, AX, r2);
+    EMIT(0x89, 0xC6,                    // mov esi, eax
+         0x8A, 0x4B, r1,                // mov cl, [r1]
+         0x41, 0x88, 0x0C, 0x04);       // mov [r12+rax], cl
+    after_store(b, 1, next, pc);
+    break;
+  case I_PUSH:                          // r1 is read after the decrement
+    EMIT(0x66, 0x83, 0x6B, REG(X_STACK_REG), WORD_SIZE);
+    movzx(j, AX, REG(X_STACK_REG));
+    op16(j, MOV_LOAD, CX, r1);
+    store_word(j);
+    after_store(b, WORD_SIZE, next, pc);
+    break;
+  case I_POP:
+    pop_cx(j);
+    op16(j, MOV_STORE, CX, r1);
+    if (d->reg1 == X_STACK_REG)         // POPPER adds 2 to what it popped
+      EMIT(0x66, 0x83, 0x43, r1, WORD_SIZE);
+    break;
+  case I_LOADI:
+    set16(j, r1, immediate);
+    break;
+  case I_CLD:
+    state_and(j, 0xFFFD);
+    break;
+  case I_CLI:
+    state_and(j, 0xFFFB);
+    break;
+  case I_STI:
+    state_or(j, 0x0004);
+    break;
+  case I_LIT:
+    op16(j, MOV_LOAD, AX, r1);
+    op16(j, MOV_STORE, AX, ITR);
+    break;
+  case I_CPUID:
+    op16(j, MOV_LOAD, AX, ID);
+    op16(j, MOV_STORE, AX, r1);
+    break;
+  case I_CPUNUM:
+    op16(j, MOV_LOAD, AX, NUM);
+    op16(j, MOV_STORE, AX, r1);
+    break;
+  case I_OUT:
+  case I_IPI:
+    call_handler(j, d);
+    break;
+  case I_LOADA:                         // these look out for spin loops,
+    set16(j, PC, next);                 // which they know by their pc
+    call_handler(j, d);
+    add_exit(b, check_spin(j), X_MID, next, pc);
+    break;
+  case I_STORA:                         // these report their own stores
+    call_handler(j, d);
+    add_exit(b, check_generation(j), X_MID, next, pc);
+    break;
+  case I_TNSET:
+    set16(j, PC, next);
+    call_handler(j, d);
+    add_exit(b, check_generation(j), X_MID, next, pc);
+    add_exit(b, check_spin(j), X_MID, next, pc);
+    break;
+
+    /* the rest end the block */
+  case I_BR:
+    set_lastpc(j, pc);
+    EMIT(0x66, 0xF7, 0x43, STATE);      // test word [state], 1
+    emit16(j, X_STATE_COND_FLAG);
+    branch_to(b, d, pc, target, jcc(j, JNE));
+    chain(b, next);
+    return 1;
+  case I_JR:
+    set_lastpc(j, pc);
+    branch_to(b, d, pc, target, jump(j));
+    return 1;
+  case I_JMP:
+    set_lastpc(j, pc);
+    branch_to(b, d, pc, immediate, jump(j));
+    return 1;
+  case I_CALL:
+    EMIT(0xB9);                         // mov ecx, next
+    emit32(j, next);
+    push_cx(b, immediate, pc);
+    set_lastpc(j, pc);
+    chain(b, immediate);
+    return 1;
+  case I_CALLR:                         // r1 is read after the push
+    EMIT(0xB9);
+    emit32(j, next);
+    EMIT(0x66, 0x83, 0x6B, REG(X_STACK_REG), WORD_SIZE);
+    movzx(j, AX, REG(X_STACK_REG));
+    store_word(j);
+    op16(j, MOV_LOAD, AX, r1);
+    op16(j, MOV_STORE, AX, PC);
+    after_store(b, WORD_SIZE, -1, pc);
+    set_lastpc(j, pc);
+    movzx(j, AX, PC);
+    indirect(b);
+    return 1;
+  case I_JMPR:
+    set_lastpc(j, pc);
+    movzx(j, AX, r1);
+    indirect(b);
+    return 1;
+  case I_RET:
+    set_lastpc(j, pc);
+    pop_cx(j);
+    EMIT(0x0F, 0xB7, 0xC1);             // movzx eax, cx
+    indirect(b);
+    return 1;
+  case I_IRET:
+    set_lastpc(j, pc);
+    pop_cx(j);
+    op16(j, MOV_STORE, CX, PC);
+    pop_cx(j);
+    op16(j, MOV_STORE, CX, STATE);
+    EMIT(0x66, 0xF7, 0x43, STATE);      // test word [state], DEBUG_ON
+    emit16(j, X_STATE_DEBUG_ON);
+    add_exit(b, jcc(j, JNE), X_TRACE, -1, -1);
+    movzx(j, AX, PC);
+    indirect(b);
+    return 1;
+  case I_TRAP:
+    set16(j, PC, next);
+    call_handler(j, d);
+    set_lastpc(j, pc);
+    movzx(j, AX, PC);
+    indirect(b);
+    return 1;
+  }
+  return 0;
+}
+
+// lay down the code for each of the block's exits
+static void emit_exits(xjit_block *b){
+  xjit *j = b->j;
+  xjit_exit *e;
+  int k;
+
+  for (k = 0; k < b->nexits; k++){
+    e = &b->exit[k];
+    land(e->site, j->free);
+    switch (e->kind){
+    case X_GUARD:
+      set16(j, PC, b->start);
+      break;
+    case X_MID:                         // give back what was charged, unrun
+    case X_IDLE:
+      if (b->done > e->done){
+        EMIT(0x49, 0x81, 0xC5);         // add r13, imm32
+        emit32(j, b->done - e->done);
+      }
+      if (e->pc >= 0)
+        set16(j, PC, e->pc);
+      set_lastpc(j, e->lastpc);
+      break;
+    case X_CHAIN:
+      set16(j, PC, e->pc);
+      EMIT(0x48, 0xB8);                 // mov rax, site
+      emit64(j, (uintptr_t) e->site);
+      EMIT(0x49, 0x89, 0x46, PATCH);    // mov [r14+PATCH], rax
+      break;
+    case X_DYN:
+      op16(j, MOV_STORE, AX, PC);
+      break;
+    }
+    EMIT(0xB8);                         // mov eax, reason
+    emit32(j, (e->kind == X_CHAIN)? EXIT_CHAIN :
+           (e->kind == X_TRACE)? EXIT_TRACE :
+           (e->kind == X_IDLE)? EXIT_IDLE : EXIT_PC);
+    land(jump(j), j->leave);
+  }
+}
+
+/******************************************************************
+   Translate the block starting at start. Returns its code, and its
+   length in *length, or NULL if its first instruction cannot be
+   translated.
+******************************************************************/
+static void * translate(xjit *j, unsigned short int start, int *length){
+  xjit_block b;
+  xcpu *c = j->c;
+  xdecoded scratch, *d;
+  unsigned char *entry = j->free, *charge[2];
+  unsigned short int pc = start, last = start;
+  int ended = 0;
+
+  b.j = j;
+  b.start = start;
+  b.done = 0;
+  b.nexits = 0;
+
+  // the guard: is the translation still good, and is there room for it?
+  add_exit(&b, check_generation(j), X_GUARD, -1, -1);
+  EMIT(0x49, 0x81, 0xFD);             // cmp r13, length
+  charge[0] = j->free;
+  emit32(j, 0);
+  add_exit(&b, jcc(j, JB), X_GUARD, -1, -1);
+  EMIT(0x49, 0x81, 0xED);             // sub r13, length
+  charge[1] = j->free;
+  emit32(j, 0);
+
+  while (!ended && b.done < XJIT_MAX_BLOCK && pc < j->limit){
+    // only cached instructions are safe: others are not watched for stores,
+    // and a miss fills the cache, but hands back scratch the first time
+    if ((d = xdcache_lookup(c, j->table, pc, &scratch)) == &scratch)
+      d = xdcache_lookup(c, j->table, pc, &scratch);
+    if (d == &scratch || d->opcode == I_STD || d->handler == bad)
+      break;
+    b.done++;
+    ended = translate_one(&b, d, pc);
+    last = pc;
+    pc += d->size;
+  }
+  if (b.done == 0){
+    j->free = entry;
+    return NULL;
+  }
+  if (!ended){
+    set_lastpc(j, last);
+    chain(&b, pc);
+  }
+  memcpy(charge[0], &b.done, 4);
+  memcpy(charge[1], &b.done, 4);
+  emit_exits(&b);
+  *length = b.done;
+  return entry;
+}
+
+/**
+ * Lay down the glue between C and translated code. enter(c, code, budget, j)
+ * saves the registers that belong to the caller, loads the ones described
+ * above, and jumps to code; leave stores the cycles left in j->budget, and
+ * returns to the caller of enter, with the reason for leaving in eax.
+ **/
+static void emit_glue(xjit *j){
+  j->enter = (int (*)(xcpu *, void *, long, xjit *)) j->free;
+  EMIT(0x53, 0x41, 0x54, 0x41, 0x55,  // push rbx, r12, r13,
+       0x41, 0x56, 0x41, 0x57,        //      r14, r15
+       0x48, 0x89, 0xFB,              // mov rbx, rdi
+       0x4C, 0x8B, 0x67, MEMORY,      // mov r12, [rdi+MEMORY]
+       0x49, 0x89, 0xD5,              // mov r13, rdx
+       0x49, 0x89, 0xCE,              // mov r14, rcx
+       0x4C, 0x8B, 0x79, BLOCK,       // mov r15, [rcx+BLOCK]
+       0xFF, 0xE6);                   // jmp rsi
+  j->leave = j->free;
+  EMIT(0x4D, 0x89, 0x6E, BUDGET,      // mov [r14+BUDGET], r13
+       0x41, 0x5F, 0x41, 0x5E,        // pop r15, r14,
+       0x41, 0x5D, 0x41, 0x5C, 0x5B,  //     r13, r12, rbx
+       0xC3);                         // ret
+  j->first = j->free;
+}
+
+xjit * xjit_create(xcpu *c, IHandler *table){
+  static unsigned int no_generation = 0;
+  xjit *j = calloc(1, sizeof(xjit));
+
+#ifndef __x86_64__
+  fatal("error: the jit engine needs an x86-64 host");
+#endif
+  if (j == NULL){
+    fprintf(stderr, "FAILURE IN <xjit_create>: OUT OF MEMORY\n");
+    exit(EXIT_FAILURE);
+  }
+  j->c = c;
+  j->table = table;
+  j->limit = (c->decoded)? c->decoded->limit : 0;
+  j->reach = (c->decoded)? c->decoded->reach : 0;
+  j->generation = (c->decoded)? &c->decoded->generation : &no_generation;
+  j->block = calloc(j->limit + 1, sizeof(void *));
+  j->length = calloc(j->limit + 1, sizeof(unsigned char));
+  j->code = mmap(NULL, XJIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (j->block == NULL || j->length == NULL || j->code == MAP_FAILED){
+    fprintf(stderr, "FAILURE IN <xjit_create>: OUT OF MEMORY\n");
+    exit(EXIT_FAILURE);
+  }
+  j->free = j->code;
+  emit_glue(j);
+  flush(j);
+  return j;
+}
+
+void xjit_destroy(xjit *j){
+  munmap(j->code, XJIT_CODE_SIZE);
+  free(j->length);
+  free(j->block);
+  free(j);
+}
+
+/******************************************************************
+   Throw away every translation, and start afresh.
+******************************************************************/
+static void flush(xjit *j){
+  j->snapshot = __atomic_load_n(j->generation, __ATOMIC_ACQUIRE);
+  j->flushes++;
+  j->free = j->first;
+  memset(j->block, 0, j->limit * sizeof(void *));
+  memset(j->length, 0, j->limit);
+}
+
+/******************************************************************
+   Return the block at pc, translating it if need be, or NULL if
+   there is none to be had.
+******************************************************************/
+static void * block_at(xjit *j, unsigned short int pc){
+  int length;
+
+  if (pc >= j->limit || j->length[pc] == XJIT_NO_BLOCK)
+    return NULL;
+  if (j->block[pc] == NULL){
+    if (j->free + XJIT_SLACK > j->code + XJIT_CODE_SIZE)
+      flush(j);
+    j->block[pc] = translate(j, pc, &length);
+    j->length[pc] = (j->block[pc])? length : XJIT_NO_BLOCK;
+  }
+  return j->block[pc];
+}
+
+/************************************************************
+ Run up to budget instructions on the cpu, beginning at
+ c->pc. Returns the number of instructions completed; see
+ xcpu_run for the rest.
+*************************************************************/
+int xjit_run(xjit *j, int budget, xstop *stop){
+  xcpu *c = j->c;
+  unsigned char *code, *site;
+  unsigned int flushes;
+  int done = 0, left, reason;
+
+  stop->reason = X_STOP_BUDGET;
+  while (done < budget){
+    if (__atomic_load_n(j->generation, __ATOMIC_ACQUIRE) != j->snapshot)
+      flush(j);
+    left = budget - done;
+    code = (c->state & X_STATE_DEBUG_ON)? NULL : block_at(j, c->pc);
+    if (code == NULL || j->length[c->pc] > left){
+      // step through whatever cannot be run as a whole block
+      stop->pc = c->pc;
+      if (!xcpu_execute(c, j->table)){
+        stop->reason = X_STOP_HALT;
+        return done;
+      }
+      done++;
+      if (c->spin && c->spin->ready){
+        stop->reason = X_STOP_SPIN;
+        return done;
+      }
+      continue;
+    }
+
+    reason = j->enter(c, code, left, j);
+    if (j->budget < left){
+      done += left - j->budget;
+      stop->pc = j->lastpc;
+    }
+    if (c->spin && c->spin->ready){
+      stop->reason = X_STOP_SPIN;
+      return done;
+    }
+    if (reason == EXIT_IDLE){
+      stop->reason = X_STOP_IDLE;
+      return done;
+    }
+    if (reason == EXIT_TRACE){
+      xcpu_print(c);      // iret has just switched the debug bit on
+    } else if (reason == EXIT_CHAIN){
+      // chain the block that just ended to its successor, now that it exists
+      site = j->patch;
+      flushes = j->flushes;
+      code = block_at(j, c->pc);
+      if (code != NULL && j->flushes == flushes)  // the site may be gone
+        land(site, code);
+    }
+  }
+  return done;
+}
+/** That's all, folks! **/
@@ -0,0 +1,27 @@
+#ifndef XJIT_H
+#define XJIT_H
+
+/**
+ * The basic-block translator (xjit.c): X code is translated, a basic block at
+ * a time, into x86-64 machine code, which is then run directly. Each CPU has
+ * a translator of its own, created by the thread that runs the CPU.
+ **/
+typedef struct xjit xjit;
+
+/* title: create/destroy a translator for one CPU
+ * param: pointer to CPU context (whose memory and predecoded instruction
+ *        cache are used), and the jump table
+ * returns: the new translator (exits on failure)
+ */
+extern xjit * xjit_create( xcpu *c, IHandler *table );
+extern void xjit_destroy( xjit *j );
+
+/* title: run a burst of instructions through the translator
+ * param: as xcpu_run
+ * function: performs up to budget instructions, starting at c->pc; only
+ *           stops early to halt (traps and traces are handled in the run)
+ * returns: the number of instructions completed
+ */
+extern int xjit_run( xjit *j, int budget, xstop *stop );
+
+#endif
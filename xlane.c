@@ -0,0 +1,635 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#define X_INSTRUCTIONS_NOT_NEEDED
+#include "xis.h"
+#include "xcpu.h"
+#include "xout.h"
+#include "xspin.h"
+#include "xlane.h"
+
+/**
+ * Each step runs one instruction on every lane still in step: on all of
+ * them at once while they are together, and otherwise on each group of
+ * lanes that agree on the pc in turn. Within a group, the lanes are picked
+ * out by a mask, a word of all ones for each lane in it, so that a vector
+ * operation only changes their words: SET(v, x) puts x into v for just
+ * those lanes. The loop that steps them is built twice, for hosts with and
+ * without AVX2, and the one to use is picked when the programme is loaded.
+ **/
+#define SPLAT(x)     ((xlane_word) {0} + (unsigned short) (x))
+#define SET(v, x)    ((v) = ((x) & M) | ((v) & ~M))
+#define EACH(k, bits)                                                   \
+  for (k = 0; k < XLANE_N; k++) if ((bits) & (1 << k))
+
+// lane k's word of register r, in the lane-at-a-time code
+#define REG(r)       (g->regs[(r)][k])
+
+static inline int lanes(const xlane_word *mask);
+static void gather(xlane *g, int k);
+static void scatter(xlane *g, int k);
+static void leave(xlane *g, int k, int status, int ran);
+static void check(xlane *g, int group, unsigned short pc, int span);
+static unsigned short lane_pop(xlane *g, int k);
+static void lane_push(xlane *g, int k, unsigned short word);
+static void lane_put(xlane *g, int k, unsigned short addr,
+                     unsigned short word);
+static void step_lane(xlane *g, int k, xdecoded *d, unsigned short pc);
+
+/***************************************************************************/
+
+xlane * xlane_create(IHandler *table, unsigned int limit){
+  xlane *g = xcpu_calloc(1, sizeof(xlane));
+
+  if ((g->image = calloc(MEMSIZE + MIRROR_SIZE, sizeof(unsigned char)))
+      == NULL
+      || (g->differs = calloc(MEMSIZE, sizeof(unsigned char))) == NULL){
+    fprintf(stderr, "FAILURE IN <xlane_create>: OUT OF MEMORY\n");
+    exit(EXIT_FAILURE);
+  }
+  g->table = table;
+  g->decoded = xdcache_create(table, limit, 0);
+  g->reader.memory = g->image;
+  g->reader.decoded = g->decoded;
+  return g;
+}
+
+void xlane_destroy(xlane *g){
+  xdcache_destroy(g->decoded);
+  free(g->differs);
+  free(g->image);
+  free(g);
+}
+
+/**************************************************************
+ * The first lane's memory is the gang's copy of the code; the
+ * bytes of any later one that differ from it are marked.
+ **************************************************************/
+int xlane_join(xlane *g, xcpu *c){
+  unsigned int a, reach = g->decoded->reach, n;
+  int k;
+
+  if (g->n == XLANE_N)
+    return -1;
+  k = g->n++;
+  g->cpu[k] = c;
+  if (k == 0){
+    memcpy(g->image, c->memory, MEMSIZE + MIRROR_SIZE);
+  } else {
+    for (a = 0; a < reach; a += X_CACHE_LINE){
+      n = (reach - a < X_CACHE_LINE)? reach - a : X_CACHE_LINE;
+      if (memcmp(g->image + a, c->memory + a, n))
+        for (; n > 0; n--, a++)
+          g->differs[a] |= (g->image[a] != c->memory[a]);
+    }
+  }
+  if (c->state & X_STATE_DEBUG_ON){   // every cycle must be traced
+    g->status[k] = XLANE_ALONE;
+    return k;
+  }
+  g->status[k] = XLANE_IN;
+  g->live |= 1 << k;
+  g->in[k] = 0xFFFF;
+  g->together = 0;
+  return k;
+}
+
+void xlane_leave(xlane *g, int k){
+  g->status[k] = XLANE_OUT;
+  g->live &= ~(1 << k);
+  g->in[k] = 0;
+  g->together = 0;
+}
+
+/**************************************************************
+ * A store of n bytes at addr, by lane k. Its own machine's cache
+ * hears of it, as of any store; the gang marks the bytes, and if
+ * any of them belongs to an instruction that has been decoded,
+ * the lane leaves once this cycle is over (xlane_run).
+ **************************************************************/
+void xlane_wrote(xlane *g, int k, unsigned int addr, int n){
+  xcpu *c = g->cpu[k];
+  xdcache *dc = g->decoded;
+  xdecoded *d;
+  unsigned int a;
+  int j;
+
+  XDC_WROTE(addr, n);
+  if ((addr + n - 1) % MEMSIZE >= dc->reach && addr % MEMSIZE >= dc->reach)
+    return;
+  for (j = 0; j < n; j++){
+    a = (addr + j) % MEMSIZE;
+    if (a < dc->reach)
+      g->differs[a] = 1;
+  }
+  // an entry spans at most XDC_MAX_SPAN bytes (as in xdcache_invalidate)
+  for (j = 1 - XDC_MAX_SPAN; j < n; j++){
+    a = (addr + MEMSIZE + j) % MEMSIZE;
+    if (a >= dc->limit)
+      continue;
+    d = &dc->entry[a];
+    if (d->handler && (j >= 0 || d->span > -j)){
+      g->parting |= 1 << k;
+      return;
+    }
+  }
+}
+
+/**************************************************************
+ * Run the lanes in step for up to cycles cycles. While they are
+ * together, each step is one instruction for all of them; apart,
+ * they are grouped by pc, and the largest group counts as the
+ * gang, so that a lane kept out of it for too long can leave.
+ **************************************************************/
+static void step(xlane *g, int group, const xlane_word *mask,
+                 unsigned short pc);
+
+__attribute__((target_clones("avx2", "default")))
+int xlane_run(xlane *g, int cycles){
+  xlane_word left, M;
+  unsigned short pc;
+  int i, k, todo, group, pack, size, most;
+
+  EACH(k, g->live)
+    gather(g, k);
+  g->together = 0;                    // (their pcs may have moved since)
+  EACH(k, g->parting)                 // (stored over code between runs)
+    leave(g, k, XLANE_ALONE, 0);
+  g->parting = g->ended = 0;
+  for (i = 0; i < cycles && g->live; i++){
+    g->cycle = i;
+    if (g->together){
+      step(g, g->live, &g->in, g->pc[__builtin_ctz(g->live)]);
+    } else {
+      todo = g->live;
+      left = g->in;
+      pack = most = 0;
+      while (todo){
+        pc = g->pc[__builtin_ctz(todo)];
+        M = (xlane_word) (g->pc == SPLAT(pc)) & left;
+        group = lanes(&M);
+        todo &= ~group;
+        left &= ~M;
+        if ((size = __builtin_popcount(group)) > most){
+          most = size;
+          pack = group;
+        }
+        if (group == g->live){        // they have come back together
+          g->together = 1;
+          EACH(k, g->live)
+            g->apart[k] = 0;
+        }
+        step(g, group, &M, pc);
+      }
+      EACH(k, g->live & ~pack)
+        if (++g->apart[k] >= XLANE_APART)
+          g->parting |= 1 << k;
+      EACH(k, pack)
+        g->apart[k] = 0;
+    }
+    if (g->halting){
+      EACH(k, g->halting)
+        leave(g, k, XLANE_HALTED, i);
+      g->halting = 0;
+    }
+    if (g->parting){
+      EACH(k, g->parting & g->live){
+        leave(g, k, XLANE_ALONE, i+1);
+        if (g->cpu[k]->state & X_STATE_DEBUG_ON)
+          xcpu_print(g->cpu[k]);      // the engines trace the instruction
+      }                               // that switched it on
+      g->parting = 0;
+    }
+  }
+  EACH(k, g->live){
+    scatter(g, k);
+    g->ran[k] = i;
+  }
+  return i;
+}
+
+/**************************************************************
+ * Step the lanes of group (picked out by mask, too), all at pc,
+ * through one instruction. The arithmetic is done for them all
+ * at once; everything else, a lane at a time.
+ **************************************************************/
+static inline __attribute__((always_inline))
+void step(xlane *g, int group, const xlane_word *mask, unsigned short pc){
+  xlane_word *R = g->regs, M = *mask, taken;
+  xdecoded scratch, *d;
+  unsigned short next;
+  signed char leap;
+  int k, r1, r2;
+
+  if (pc >= g->decoded->limit){       // beyond the image, each has its own
+    EACH(k, group)
+      step_lane(g, k, NULL, pc);
+    g->together = 0;
+    return;
+  }
+  d = &g->decoded->entry[pc];
+  if (!d->handler){                   // not yet decoded, or run
+    d = xdcache_lookup(&g->reader, g->table, pc, &scratch);
+    check(g, group, pc, d->span);
+    group &= g->live;
+    M &= g->in;
+  }
+  if (__builtin_popcount(group) == 1){
+    step_lane(g, __builtin_ctz(group), d, pc);
+    return;
+  }
+
+  r1 = d->reg1;
+  r2 = d->reg2;
+  next = pc + d->size;
+  SET(g->oldpc, SPLAT(pc));
+  SET(g->pc, SPLAT(next));
+  switch (d->opcode){
+  case I_ADD:
+    SET(R[r2], R[r1] + R[r2]);
+    break;
+  case I_SUB:
+    SET(R[r2], R[r2] + ~R[r1]);
+    break;
+  case I_MUL:
+    SET(R[r2], R[r2] * R[r1]);
+    break;
+  case I_AND:
+    SET(R[r2], R[r1] & R[r2]);
+    break;
+  case I_OR:
+    SET(R[r2], R[r2] | R[r1]);
+    break;
+  case I_XOR:
+    SET(R[r2], R[r2] ^ R[r1]);
+    break;
+  case I_TEST:
+    SET(g->state, (g->state & 0xFFFE)
+        | ((xlane_word) ((R[r1] & R[r2]) != SPLAT(0)) & 1));
+    break;
+  case I_CMP:
+    SET(g->state, (g->state & 0xFFFE) | ((xlane_word) (R[r1] < R[r2]) & 1));
+    break;
+  case I_EQU:
+    SET(g->state, (g->state & 0xFFFE) | ((xlane_word) (R[r1] == R[r2]) & 1));
+    break;
+  case I_MOV:
+    SET(R[r2], R[r1]);
+    break;
+  case I_NEG:
+    SET(R[r1], ~R[r1] + 1);
+    break;
+  case I_NOT:
+    SET(R[r1], (xlane_word) (R[r1] == SPLAT(0)) & 1);
+    break;
+  case I_INC:
+    SET(R[r1], R[r1] + 1);
+    break;
+  case I_DEC:
+    SET(R[r1], R[r1] - 1);
+    break;
+  case I_LOADI:
+    SET(R[r1], SPLAT(d->instruction >> 16));
+    break;
+  case I_CPUID:
+    SET(R[r1], g->id);
+    break;
+  case I_CPUNUM:
+    SET(R[r1], g->num);
+    break;
+  case I_CLD:
+    SET(g->state, g->state & 0xfffd);
+    break;
+  case I_CLI:
+    SET(g->state, g->state & 0xFFFB);
+    break;
+  case I_STI:
+    SET(g->state, g->state | 0x0004);
+    break;
+  case I_LIT:
+    SET(g->itr, R[r1]);
+    break;
+  case I_BR:
+    leap = d->instruction & 0x00FF;
+    taken = (xlane_word) ((g->state & 1) != SPLAT(0));
+    SET(g->pc, (SPLAT(pc + leap) & taken) | (SPLAT(next) & ~taken));
+    g->together = 0;                  // (unless they all went the same way)
+    break;
+  case I_JR:
+    leap = d->instruction & 0x00FF;
+    SET(g->pc, SPLAT(pc + leap));
+    break;
+  case I_JMP:
+    SET(g->pc, SPLAT(d->instruction >> 16));
+    break;
+  case I_JMPR:
+    SET(g->pc, R[r1]);
+    g->together = 0;
+    break;
+  case I_RET:
+  case I_IRET:
+  case I_CALLR:
+  case I_TRAP:
+    g->together = 0;                  // (they may part here, too)
+    EACH(k, group)
+      step_lane(g, k, d, pc);
+    break;
+  default:
+    EACH(k, group)
+      step_lane(g, k, d, pc);
+    break;
+  }
+}
+
+// the lanes whose words are set in mask, a bit each
+static inline int lanes(const xlane_word *mask){
+  int k, bits = 0;
+  for (k = 0; k < XLANE_N; k++)
+    bits |= ((*mask)[k] & 1) << k;
+  return bits;
+}
+
+static void gather(xlane *g, int k){
+  xcpu *c = g->cpu[k];
+  int r;
+  for (r = 0; r < X_MAX_REGS; r++)
+    g->regs[r][k] = c->regs[r];
+  g->pc[k] = c->pc;
+  g->state[k] = c->state;
+  g->itr[k] = c->itr;
+  g->id[k] = c->id;
+  g->num[k] = c->num;
+}
+
+static void scatter(xlane *g, int k){
+  xcpu *c = g->cpu[k];
+  int r;
+  for (r = 0; r < X_MAX_REGS; r++)
+    c->regs[r] = g->regs[r][k];
+  c->pc = g->pc[k];
+  c->state = g->state[k];
+  c->itr = g->itr[k];
+}
+
+// the lane stops (or leaves), having run ran cycles of this run
+static void leave(xlane *g, int k, int status, int ran){
+  scatter(g, k);
+  g->status[k] = status;
+  g->ran[k] = ran;
+  g->live &= ~(1 << k);
+  g->in[k] = 0;
+  g->together = 0;
+}
+
+/**************************************************************
+ * The instruction at pc has just been decoded for the first
+ * time, from the gang's copy of the code, for the lanes of group.
+ * If some lane may have changed any of its bytes since, every
+ * lane's own bytes are looked at: those of the group that differ
+ * leave before running it, and the rest once this cycle is over
+ * (an entry once decoded is never looked at again).
+ **************************************************************/
+static void check(xlane *g, int group, unsigned short pc, int span){
+  unsigned int a;
+  int j, k;
+
+  for (j = 0; j < span; j++)
+    if (g->differs[(pc + j) % MEMSIZE])
+      break;
+  if (j == span)
+    return;
+  EACH(k, g->live)
+    for (j = 0; j < span; j++){
+      a = (pc + j) % MEMSIZE;
+      if (g->cpu[k]->memory[a] != g->image[a]){
+        if (group & (1 << k))
+          leave(g, k, XLANE_ALONE, g->cycle);
+        else
+          g->parting |= 1 << k;
+        break;
+      }
+    }
+}
+
+/**************************************************************
+ * The stack, and stores, for the lane-at-a-time code (with the
+ * same arithmetic as PUSHER and POPPER, in xcpu.h).
+ **************************************************************/
+static unsigned short lane_pop(xlane *g, int k){
+  xcpu *c = g->cpu[k];
+  unsigned short word = FETCH_WORD(REG(X_STACK_REG));
+  REG(X_STACK_REG) += 2;
+  return word;
+}
+
+static void lane_push(xlane *g, int k, unsigned short word){
+  REG(X_STACK_REG) -= 2;
+  lane_put(g, k, REG(X_STACK_REG), word);
+}
+
+static void lane_put(xlane *g, int k, unsigned short addr,
+                     unsigned short word){
+  xcpu *c = g->cpu[k];
+  STORE_WORD(addr, word);
+  xlane_wrote(g, k, addr, WORD_SIZE);
+}
+
+/**************************************************************
+ * Step lane k alone through the instruction at pc: decoded as d,
+ * or, beyond the image (d NULL), from the lane's own memory. The
+ * instructions do just what their handlers in xcpu.c do; since
+ * a machine in a gang has but the one CPU, the atomic ones need
+ * no lock, and a lane never waits in a spin loop, but goes round.
+ **************************************************************/
+static void step_lane(xlane *g, int k, xdecoded *d, unsigned short pc){
+  xcpu *c = g->cpu[k];
+  xdecoded scratch;
+  unsigned short next, addr;
+  unsigned int instruction;
+  int r1, r2;
+
+  if (d == NULL)
+    d = xdcache_lookup(c, g->table, pc, &scratch);
+  instruction = d->instruction;
+  r1 = d->reg1;
+  r2 = d->reg2;
+  next = pc + WORD_SIZE;              // just as c->pc is, in the handlers
+  g->oldpc[k] = pc;
+
+  switch (d->opcode){
+  case I_BAD:                         // only a zero opcode halts
+    g->halting |= 1 << k;
+    break;
+  case I_RET:
+    next = lane_pop(g, k);
+    break;
+  case I_CLD:
+    g->state[k] &= 0xfffd;
+    break;
+  case I_STD:
+    g->state[k] |= 0x0002;
+    g->parting |= 1 << k;             // to be traced from here on
+    g->ended |= 1 << k;
+    break;
+  case I_NEG:
+    REG(r1) = ~REG(r1) + 1;
+    break;
+  case I_NOT:
+    REG(r1) = !REG(r1);
+    break;
+  case I_PUSH:  // (as PUSHER, which reads the register after the decrement)
+    REG(X_STACK_REG) -= 2;
+    lane_put(g, k, REG(X_STACK_REG), REG(r1));
+    break;
+  case I_POP:   // (and POPPER, which adds to the stack pointer last)
+    REG(r1) = FETCH_WORD(REG(X_STACK_REG));
+    REG(X_STACK_REG) += 2;
+    break;
+  case I_JMPR:
+    next = REG(r1);
+    break;
+  case I_CALLR:
+    lane_push(g, k, next);
+    next = REG(r1);
+    break;
+  case I_OUT:
+    xout_putc(c->console, c->id, REG(r1) & 0xFF);
+    break;
+  case I_INC:
+    REG(r1)++;
+    break;
+  case I_DEC:
+    REG(r1)--;
+    break;
+  case I_BR:
+    if (g->state[k] & 0x0001)
+      next = pc + (signed char) (instruction & 0x00FF);
+    break;
+  case I_JR:
+    next = pc + (signed char) (instruction & 0x00FF);
+    break;
+  case I_ADD:
+    REG(r2) = REG(r1) + REG(r2);
+    break;
+  case I_SUB:
+    REG(r2) = REG(r2) + ~REG(r1);
+    break;
+  case I_MUL:
+    REG(r2) = REG(r2) * REG(r1);
+    break;
+  case I_DIV:
+    REG(r2) = REG(r2) / REG(r1);
+    break;
+  case I_AND:
+    REG(r2) = REG(r1) & REG(r2);
+    break;
+  case I_OR:
+    REG(r2) = REG(r2) | REG(r1);
+    break;
+  case I_XOR:
+    REG(r2) = REG(r2) ^ REG(r1);
+    break;
+  case I_SHR:   // (the host masks the count to 5 bits, as it does in xcpu.c)
+    REG(r2) = (unsigned short) (REG(r2) >> (REG(r1) & 31));
+    break;
+  case I_SHL:
+    REG(r2) = (unsigned short) (REG(r2) << (REG(r1) & 31));
+    break;
+  case I_TEST:
+    g->state[k] = (REG(r1) & REG(r2))? (g->state[k] | 0x0001)
+                                     : (g->state[k] & 0xFFFE);
+    break;
+  case I_CMP:
+    g->state[k] = (REG(r1) < REG(r2))? (g->state[k] | 0x0001)
+                                     : (g->state[k] & 0xFFFE);
+    break;
+  case I_EQU:
+    g->state[k] = (REG(r1) == REG(r2))? (g->state[k] | 0x0001)
+                                      : (g->state[k] & 0xFFFE);
+    break;
+  case I_MOV:
+    REG(r2) = REG(r1);
+    break;
+  case I_LOAD:
+  case I_LOADA:
+    REG(r2) = FETCH_WORD(REG(r1));
+    break;
+  case I_STOR:
+  case I_STORA:
+    lane_put(g, k, REG(r2), REG(r1));
+    break;
+  case I_LOADB:
+    REG(r2) = c->memory[REG(r1)];
+    break;
+  case I_STORB:
+    STORE_BYTE(REG(r2), REG(r1) & 0x00FF);
+    xlane_wrote(g, k, REG(r2), 1);
+    break;
+  case I_TNSET:
+    // the lock is set at wherever REG1 points *after* the fetch
+    addr = REG(r1);
+    REG(r2) = FETCH_WORD(addr);
+    lane_put(g, k, REG(r1), 1);
+    break;
+  case I_JMP:
+    next = instruction >> 16;
+    break;
+  case I_CALL:
+    lane_push(g, k, next + WORD_SIZE);
+    next = instruction >> 16;
+    break;
+  case I_LOADI:
+    REG(r1) = instruction >> 16;
+    next += WORD_SIZE;
+    break;
+  case I_CLI:
+    g->state[k] &= 0xFFFB;
+    break;
+  case I_STI:
+    g->state[k] |= 0x0004;
+    break;
+  case I_IRET:
+    next = lane_pop(g, k);
+    g->state[k] = lane_pop(g, k);
+    if (g->state[k] & X_STATE_DEBUG_ON){
+      g->parting |= 1 << k;
+      g->ended |= 1 << k;
+    }
+    break;
+  case I_TRAP:  // as xcpu_exception
+    if (!(g->state[k] & X_STATE_IN_EXCEPTION) && g->itr[k]){
+      lane_push(g, k, g->state[k]);
+      lane_push(g, k, next);
+      g->state[k] |= X_STATE_IN_EXCEPTION;
+      next = FETCH_WORD(g->itr[k] + X_E_TRAP * WORD_SIZE);
+      if (__atomic_load_n(&c->ipi, __ATOMIC_RELAXED)){
+        g->parting |= 1 << k;         // the engines end the burst here, and
+        g->ended |= 1 << k;           // look for the ipi then
+      }
+    }
+    break;
+  case I_LIT:
+    g->itr[k] = REG(r1);
+    break;
+  case I_CPUID:
+    REG(r1) = c->id;
+    break;
+  case I_CPUNUM:
+    REG(r1) = c->num;
+    break;
+  case I_IPI:   // taken between runs, by whoever runs the gang
+    addr = REG(r1);
+    if (c->peers && addr < c->num){
+      __atomic_store_n(&c->peers[addr].ipi, 1, __ATOMIC_SEQ_CST);
+      if (c->peers[addr].spin)
+        xspin_wake(&c->peers[addr]);
+    }
+    break;
+  default:      // let xcpu.c report the bad instruction
+    c->pc = next;
+    bad(c, instruction);
+    break;
+  }
+  g->pc[k] = next;
+}
@@ -0,0 +1,110 @@
+#ifndef XLANE_H
+#define XLANE_H
+
+/**
+ * Lockstep lanes (xlane.c): a gang of up to XLANE_N one-CPU machines that
+ * run the same image, stepped together, a cycle each per step. Their
+ * registers are kept as a struct of arrays -- each register a vector of
+ * XLANE_N words, a word per lane -- so that while the lanes agree on the
+ * pc, the instruction there is decoded once for all of them, and if it
+ * only does arithmetic on registers, it is run as a single vector operation
+ * (two SSE2 ones, or one AVX2 one where the host has it). Everything else
+ * (loads and stores above all, since each lane has a memory of its own) is
+ * run a lane at a time, on the same struct of arrays.
+ *
+ * Lanes whose pcs part (at a branch, say) are stepped apart, a group of
+ * lanes at a time, each group being those that still agree on the pc; the
+ * one lane of a group of one is simply stepped on its own. A lane that is
+ * kept apart from the largest group for XLANE_APART cycles in a row leaves
+ * the gang for good (XLANE_ALONE), to be run the usual way, on its own, as
+ * does a lane whose trace bit is switched on, or whose code is no longer
+ * that of the others. The code is decoded from the first lane's memory, as
+ * it was when the lane joined; a byte of it that any lane may since have
+ * changed is marked, and every lane's copy of a marked instruction is looked
+ * at before it is first run, while a lane that stores over an instruction
+ * that has already been run leaves.
+ *
+ * The gang only ever runs for as many cycles as it is asked (xlane_run);
+ * when each lane is interrupted, and how much it may run, is left to the
+ * caller (see xmachine_run_lockstep), which deals with the CPUs themselves
+ * between runs.
+ **/
+
+#define XLANE_N 16          /* lanes in a gang (16 words: an AVX2 register) */
+#define XLANE_APART 1024    /* cycles a lane may be kept apart, at most */
+
+typedef unsigned short xlane_word
+  __attribute__((vector_size(XLANE_N * sizeof(unsigned short))));
+
+/* what has become of a lane */
+enum {
+  XLANE_IN,          /* still in step with the gang */
+  XLANE_HALTED,      /* met a halting (bad) instruction */
+  XLANE_ALONE,       /* left, to be run on its own from where it stopped */
+  XLANE_OUT          /* taken out by the caller (xlane_leave) */
+};
+
+typedef struct xlane {
+  xlane_word regs[X_MAX_REGS];        /* each register, a word per lane */
+  xlane_word pc, state, itr;
+  xlane_word id, num;
+  xlane_word oldpc;                   /* the last instruction each ran */
+  xlane_word in;                      /* 0xFFFF for each lane in step */
+  int live;                           /* and a bit for each of them */
+  int together;                       /* they are all at the same pc */
+  int n;                              /* lanes joined */
+  int cycle;                          /* of the run, so far */
+  int halting;                        /* lanes stopping at this cycle, */
+  int parting;                        /* and leaving after it */
+  int ended;                          /* of which, where the engines would
+                                         have ended a burst (std, a trap) */
+  int status[XLANE_N];                /* XLANE_* */
+  int ran[XLANE_N];                   /* cycles run in the last xlane_run */
+  int apart[XLANE_N];                 /* cycles apart from the largest group */
+  xcpu *cpu[XLANE_N];                 /* each lane's CPU, its memory and its
+                                         console; up to date between runs */
+  IHandler *table;
+  xdcache *decoded;                   /* the code, decoded once for all */
+  xcpu reader;                        /* which decodes it, from image */
+  unsigned char *image;               /* the first lane's memory, as it was */
+  unsigned char *differs;             /* may differ in some lane (below the
+                                         cache's reach) */
+} xlane;
+
+/* title: create/destroy a gang
+ * param: the jump table, and the length of the image the lanes run
+ * returns: the new gang, with no lanes (exits on failure)
+ */
+extern xlane * xlane_create( IHandler *table, unsigned int limit );
+extern void xlane_destroy( xlane *g );
+
+/* title: add a CPU to the gang, as its next lane
+ * param: the gang, and the CPU (the only one of its machine), which must
+ *        stay put until the gang is destroyed
+ * function: the CPU is left out at once (XLANE_ALONE) if its trace bit is
+ *           on
+ * returns: the CPU's lane, or -1 if the gang is full
+ */
+extern int xlane_join( xlane *g, xcpu *c );
+
+/* title: run every lane still in step for up to cycles cycles
+ * param: the gang, and the cycles
+ * function: each lane's CPU is read at the start, and written back at the
+ *           end, or as soon as the lane stops or leaves; says how many
+ *           cycles each lane ran (g->ran) and what became of it (g->status)
+ * returns: the cycles run by the lanes still in step
+ */
+extern int xlane_run( xlane *g, int cycles );
+
+/* title: take a lane out of the gang, between runs
+ */
+extern void xlane_leave( xlane *g, int k );
+
+/* title: tell the gang of a store to lane k's memory, made from outside (by
+ *        an exception, say) between runs, or by the lane itself
+ * function: marks the bytes, and makes the lane leave at the start of the
+ *           next run if they held code the gang has already run
+ */
+extern void xlane_wrote( xlane *g, int k, unsigned int addr, int n );
+
+#endif
@@ -0,0 +1,1635 @@
+#define _GNU_SOURCE                   // for memfd_create
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "xcpu.h"
+#include "xjit.h"
+#include "xevent.h"
+#include "xout.h"
+#include "xspin.h"
+#include "xpool.h"
+#include "xlane.h"
+#include "xmachine.h"
+
+#if XMACHINE_LANES != XLANE_N
+#error "XMACHINE_LANES (xmachine.h) must match XLANE_N (xlane.h)"
+#endif
+
+/**
+ * The execution engines that a machine can be driven by. XMACHINE_TABLE is
+ * the original xcpu_execute, which calls through the IHandler jump table
+ * once per cycle. XMACHINE_THREADED is xcpu_run, the computed-goto run loop
+ * in xcpuj.c, which runs a whole burst of instructions (up to the next
+ * interrupt, or the end of the run) per call. It comes in three builds: the
+ * usual one has tracing compiled out, so each CPU switches to the traced
+ * build (xcpu_run_traced) once its debug bit is set; traced starts every CPU
+ * in the traced build; and a map of coverage starts them in the covered one
+ * (xcpu_run_covered), which traces too. XMACHINE_JIT translates the code into x86-64 machine
+ * code a basic block at a time (xjit.c), and runs bursts the same way. All
+ * of them produce the same output; the latter two just get there sooner.
+ **/
+// how many cycles to hand the threaded engine at once, if nothing else is due
+#define MAX_BURST (1 << 20)
+// how many cycles a thread must run before its speed is known well enough
+// to let it sleep through a spin loop
+#define MIN_PACE (1 << 16)
+// how many cycles a worker of the pool runs a CPU for at a time
+#define POOL_SLICE (1 << 14)
+// how many cycles a burst may run, at most, while the timer is on, so that
+// its interrupts are not kept waiting for long
+#define TIMER_BURST (1 << 12)
+// for each lane k of a gang whose bit is set in bits (see run_gang)
+#define EACH_LANE(k, bits)                                              \
+  for (k = 0; k < XLANE_N; k++) if ((bits) & (1 << k))
+// how many times the whole machine must be seen waiting, just as it was the
+// time before, before it is given up as stuck (livelock)
+#define QUIET_ROUNDS 3
+
+/**
+ * Everything that a CPU needs to keep running from one turn to the next.
+ * Usually each CPU has a thread of its own, which runs it from start to
+ * finish in one go; but with a quantum, a single thread runs all of the
+ * CPUs, a turn at a time (see round_robin), and with workers, a pool of
+ * threads runs them a slice at a time (see run_pool).
+ **/
+typedef struct cpu_state {
+  xmachine *m;                        /* the machine it belongs to */
+  xcpu *c;
+  int i;                              /* cycles run so far */
+  int end;                            /* the end of its budget, or 0 */
+  int until;                          /* when the current turn is over */
+  int oldpc;                          /* holds previous programme counter */
+  int halted;
+  int running;                        /* until the CPU has stopped for good */
+  int (*run)(xcpu *, IHandler *, int, xstop *);
+  xjit *jit;                          /* the translator keeps code per CPU */
+  xevq events;                        /* things due to happen to the CPU */
+  int credited;                       /* cycles made up for time asleep */
+  int skipped;                        /* cycles skipped in idle loops */
+  long ran;                           /* host CPU time spent in earlier slices,
+                                         less the time this one began (pool) */
+  double rate;                        /* cycles per nanosecond, when waiting */
+  int wait_length;                    /* the length of the loop waited in */
+  int wait_left;                      /* and the cycles left before its end */
+  long wait_for;                      /* nanoseconds to park for (pool) */
+  long parked_at;                     /* when it was parked, or 0 */
+  int raised;                         /* exceptions raised from outside (the
+                                         timer's, for one), a bit each */
+  int waiting;                        /* in a spin loop, not since woken */
+} X_ALIGNED cpu_state;
+
+/**
+ * A machine's memory is a private mapping, so that the pages it never
+ * touches cost nothing. Loaded from a shared image (xmachine_share), it
+ * is a private mapping of the image's memfd instead: the machines all
+ * read the same physical pages, and the kernel copies a page (4KB) for
+ * a machine only once it writes to it, so that code, and whatever else
+ * is only ever read, is kept just once however many machines there are.
+ *
+ * Beside it, each machine keeps a copy of its memory as it was at its
+ * checkpoint (base), mapped the same way, for a reset to copy pages back
+ * from; the checkpoint is where the machine was loaded, or restored,
+ * until it is given another (xmachine_checkpoint).
+ **/
+struct xmachine_image {
+  int fd;                             /* a memfd holding it (MEMSIZE, and
+                                         the mirror of byte 0) */
+  int len;                            /* the bytes of the image itself */
+};
+
+/**
+ * A snapshot (xmachine_save) is the whole of a machine between runs, in the
+ * host's byte order: a header, a record for each CPU, and then, from the
+ * first page boundary after them, the memory (MEMSIZE, and the mirror of
+ * byte 0), so that a machine restored from it can map its memory straight
+ * from the file, copy on write, as it does a shared image. Whatever the
+ * machine rebuilds for itself when it starts (the decoded code, the jit's
+ * translations, the spin detectors) is left out.
+ *
+ * A delta (xmachine_save_delta) holds only the pages (of X_PAGES) written
+ * since the snapshot it adds to, whose name follows the CPUs' records,
+ * and then a byte for each page it holds, saying which; the pages follow
+ * from the page boundary. It is restored by restoring the snapshot it adds
+ * to, and copying its pages over.
+ **/
+#define SNAPSHOT_MAGIC "xsnapsht"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_PAGE 4096            /* the host's pages (x86-64), at least */
+#define SNAPSHOT_CHAIN 256            /* deltas on deltas, at most */
+
+typedef struct snapshot_header {
+  char magic[8];                      /* SNAPSHOT_MAGIC */
+  int version;                        /* SNAPSHOT_VERSION */
+  int ncpu;
+  int image_len;
+  int memory_at;                      /* where the memory starts in the file */
+  unsigned long seed;                 /* the turns' seed, as it stands */
+  int base_len;                       /* the length of the name of the
+                                         snapshot a delta adds to, or 0 if
+                                         it is not a delta */
+  int pages;                          /* the pages a delta holds */
+} snapshot_header;
+
+typedef struct snapshot_cpu {
+  unsigned short regs[X_MAX_REGS];
+  unsigned short pc, state, itr;
+  int ipi;
+  int i, oldpc, halted, running;      /* as in cpu_state */
+  int credited, skipped, raised;
+  xevq events;
+} snapshot_cpu;
+
+// what each byte of a machine's map of the pages written says
+#define DIRTY_RESET 1                 /* written since the checkpoint */
+#define DIRTY_SAVED 2                 /* since the snapshot last saved, or
+                                         restored (saved_as) */
+
+struct xmachine {
+  int ncpu;
+  xmachine_config config;
+  unsigned char *memory;              /* shared among all of the CPUs */
+  int image_len;                      /* the bytes loaded into it */
+  IHandler *table;                    /* the instruction-function pointers */
+  xdcache *decoded;                   /* the code, decoded once for all */
+  xout *console;                      /* what the CPUs write */
+  xspin *spins;                       /* and how they wait on one another */
+  xcpu *cpus;
+  cpu_state *states;                  /* what each CPU needs to keep running */
+  int started;                        /* the CPUs have been started */
+  void (*out)(void *, int, unsigned char);
+  void *out_arg;
+  void (*stopped)(void *, const xmachine_stop *);
+  void *stopped_arg;
+  int timer_done;                     /* stop the timer thread once set */
+  pthread_mutex_t timer_lock;
+  pthread_cond_t timer_stop;
+  int quiescent;                      /* no CPU can get any further */
+  unsigned long quiet_hash;           /* the state of the machine, when last */
+  int quiet_rounds;                   /* all waiting, and how many times */
+  pthread_mutex_t lock;               /* for the check */
+  unsigned char *base;                /* the memory as at the checkpoint */
+  snapshot_cpu *mark;                 /* and the CPUs (see xmachine_reset) */
+  unsigned char dirty[X_PAGES];       /* the pages written since (DIRTY_*),
+                                         as gathered from the CPUs */
+  char *saved_as;                     /* the snapshot last saved, or restored,
+                                         or NULL */
+};
+
+static void start(xmachine *m);
+static int live(cpu_state *s);
+static int save(xmachine *m, const char *file, int delta);
+static int restore(xmachine *m, const char *file, snapshot_cpu *r,
+                   int depth);
+static int read_header(FILE *fd, snapshot_header *h);
+static int read_cpus(FILE *fd, snapshot_cpu *r, int ncpu);
+static void get_cpu(cpu_state *s, snapshot_cpu *r);
+static void put_cpu(cpu_state *s, const snapshot_cpu *r);
+static void gather(xmachine *m);
+static void saved_as(xmachine *m, const char *file);
+static void set_budget(xmachine *m, int budget);
+static void * execution_loop(void *);
+static void * timer(void *);
+static void round_robin(xmachine *m);
+static void run_pool(xmachine *m);
+static int pool_slice(void *states, int id, long *deadline);
+static int pool_arm(void *states, int id);
+static void pool_wake(void *pool, int id);
+static int in_step(xmachine *m);
+static void run_gang(xmachine **gang, int n);
+static void run_alone(cpu_state *s, int at);
+static int turn_length(xmachine *m);
+static void start_cpu(cpu_state *s);
+static void choose_run(cpu_state *s);
+static void run_cpu(cpu_state *s);
+static int deliver(cpu_state *s);
+static void report(cpu_state *s, int why);
+static void finish_cpu(cpu_state *s, int why);
+static int interrupt(cpu_state *s, unsigned int ex);
+static int take_raised(cpu_state *s);
+static int burst_length(cpu_state *s);
+static int due_in(cpu_state *s);
+static void spin_wait(cpu_state *s);
+static void credit_wait(cpu_state *s, long slept);
+static long clock_ns(clockid_t clock);
+static int idle_branch(xcpu *c, unsigned short pc);
+static void fast_forward(cpu_state *s, int spinning);
+static void quiet(cpu_state *s);
+static int stuck(xmachine *m);
+static void pin(xmachine *m, pthread_t thread, int k);
+
+/***************************************************************************/
+
+xmachine * xmachine_create(int memsize, int ncpu){
+  xmachine *m;
+
+  if ((memsize && memsize != MEMSIZE) || ncpu < 1)
+    return NULL;
+  if ((m = malloc(sizeof(xmachine))) == NULL
+      || (m->memory = mmap(NULL, MEMSIZE + MIRROR_SIZE,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))
+         == MAP_FAILED
+      || (m->base = mmap(NULL, MEMSIZE + MIRROR_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED
+      || (m->mark = malloc(ncpu * sizeof(snapshot_cpu))) == NULL){
+    fprintf(stderr, "FAILURE IN <xmachine_create>: OUT OF MEMORY\n");
+    exit(EXIT_FAILURE);
+  }
+  m->ncpu = ncpu;
+  xmachine_defaults(&m->config);
+  m->image_len = 0;
+  m->table = build_jump_table();
+  m->decoded = NULL;
+  m->console = NULL;
+  m->spins = NULL;
+  m->cpus = xcpu_calloc(ncpu, sizeof(xcpu));
+  m->states = xcpu_calloc(ncpu, sizeof(cpu_state));
+  m->started = 0;
+  m->out = NULL;
+  m->out_arg = NULL;
+  m->stopped = NULL;
+  m->stopped_arg = NULL;
+  m->timer_done = 0;
+  pthread_mutex_init(&m->timer_lock, NULL);
+  m->quiescent = 0;
+  m->quiet_hash = 0;
+  m->quiet_rounds = 0;
+  pthread_mutex_init(&m->lock, NULL);
+  memset(m->dirty, 0, X_PAGES);
+  m->saved_as = NULL;
+  return m;
+}
+
+void xmachine_destroy(xmachine *m){
+  int u;
+
+  for (u = 0; u < m->ncpu; u++)
+    if (m->states[u].jit)
+      xjit_destroy(m->states[u].jit);
+  if (m->started){
+    xout_destroy(m->console);
+    xspin_destroy(m->decoded);
+    xdcache_destroy(m->decoded);
+  }
+  destroy_jump_table(m->table);
+  pthread_mutex_destroy(&m->lock);
+  pthread_mutex_destroy(&m->timer_lock);
+  free(m->states);
+  free(m->cpus);
+  munmap(m->memory, MEMSIZE + MIRROR_SIZE);
+  munmap(m->base, MEMSIZE + MIRROR_SIZE);
+  free(m->mark);
+  free(m->saved_as);
+  free(m);
+}
+
+void xmachine_defaults(xmachine_config *config){
+  config->engine = XMACHINE_THREADED;
+  config->traced = 0;
+  config->console = XOUT_SEQ;
+  config->interrupt_freq = 0;
+  config->idle_skip = 0;
+  config->quantum = 0;
+  config->seed = 0;
+  config->workers = -1;
+  config->cores = NULL;
+  config->ncores = 0;
+  config->timer_period = 0;
+  config->livelock = 0;
+  config->coverage = NULL;
+}
+
+int xmachine_configure(xmachine *m, const xmachine_config *config){
+  if (config->quantum && (config->workers >= 0 || config->timer_period))
+    return -1;
+  if (config->coverage && config->engine != XMACHINE_THREADED)
+    return -1;
+  m->config = *config;
+  return 0;
+}
+
+int xmachine_load(xmachine *m, const unsigned char *image, int len){
+  if (len > MEMSIZE)
+    return -1;
+  memcpy(m->memory, image, len);
+  memcpy(m->base, image, len);
+  if (len > 0)
+    m->memory[MEMSIZE] = m->base[MEMSIZE] = image[0];
+  m->image_len = len;
+  return 0;
+}
+
+xmachine_image * xmachine_image_create(const unsigned char *image, int len){
+  xmachine_image *img;
+  int fd;
+
+  if (len > MEMSIZE || (fd = memfd_create("xmachine", MFD_CLOEXEC)) < 0)
+    return NULL;
+  if (ftruncate(fd, MEMSIZE + MIRROR_SIZE) || pwrite(fd, image, len, 0) != len
+      || (len > 0 && pwrite(fd, image, MIRROR_SIZE, MEMSIZE) != MIRROR_SIZE)){
+    close(fd);
+    return NULL;
+  }
+  if ((img = malloc(sizeof(xmachine_image))) == NULL){
+    fprintf(stderr, "FAILURE IN <xmachine_image_create>: OUT OF MEMORY\n");
+    exit(EXIT_FAILURE);
+  }
+  img->fd = fd;
+  img->len = len;
+  return img;
+}
+
+// the machines keep their mappings, and with them the memfd, after this
+void xmachine_image_destroy(xmachine_image *img){
+  close(img->fd);
+  free(img);
+}
+
+int xmachine_share(xmachine *m, const xmachine_image *img){
+  if (mmap(m->memory, MEMSIZE + MIRROR_SIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED, img->fd, 0) == MAP_FAILED
+      || mmap(m->base, MEMSIZE + MIRROR_SIZE, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_FIXED, img->fd, 0) == MAP_FAILED)
+    return -1;
+  m->image_len = img->len;
+  return 0;
+}
+
+int xmachine_snapshot(const char *file){
+  snapshot_header h;
+  FILE *fd;
+  int ok;
+
+  if ((fd = fopen(file, "rb")) == NULL)
+    return 0;
+  ok = read_header(fd, &h);
+  fclose(fd);
+  return (ok)? h.ncpu : 0;
+}
+
+int xmachine_save(xmachine *m, const char *file){
+  return save(m, file, 0);
+}
+
+int xmachine_save_delta(xmachine *m, const char *file){
+  return (m->saved_as)? save(m, file, 1) : -1;
+}
+
+/**************************************************************
+ * Restore a machine from a snapshot, before its first run: map
+ * the memory from the file (or from the snapshot that a delta
+ * adds to, and copy the delta's pages over), start the CPUs as
+ * usual, and then put back everything they were doing.
+ **************************************************************/
+int xmachine_restore(xmachine *m, const char *file){
+  snapshot_cpu r[m->ncpu];
+  int u;
+
+  if (m->started || restore(m, file, r, 0))
+    return -1;
+  start(m);
+  for (u = 0; u < m->ncpu; u++){
+    put_cpu(&m->states[u], &r[u]);
+    m->mark[u] = r[u];
+  }
+  saved_as(m, file);
+  return 0;
+}
+
+/**************************************************************
+ * Make the machine as it stands its checkpoint, for a reset to
+ * put it back to: only the pages written since the last one are
+ * copied.
+ **************************************************************/
+void xmachine_checkpoint(xmachine *m){
+  int p, u;
+
+  if (!m->started)
+    start(m);
+  gather(m);
+  for (p = 0; p < X_PAGES; p++)
+    if (m->dirty[p] & DIRTY_RESET){
+      memcpy(m->base + (p << X_PAGE_BITS), m->memory + (p << X_PAGE_BITS),
+             1 << X_PAGE_BITS);
+      m->dirty[p] &= ~DIRTY_RESET;
+    }
+  m->base[MEMSIZE] = m->memory[MEMSIZE];
+  for (u = 0; u < m->ncpu; u++){
+    xout_drain(m->console, u);
+    get_cpu(&m->states[u], &m->mark[u]);
+  }
+}
+
+/**************************************************************
+ * Put the machine back as it was at its checkpoint: copy back
+ * the pages written since, and no others, and forget whatever
+ * code was decoded from them.
+ **************************************************************/
+int xmachine_reset(xmachine *m){
+  int p, u, n = 0;
+
+  if (!m->started)
+    return 0;
+  gather(m);
+  for (p = 0; p < X_PAGES; p++)
+    if (m->dirty[p] & DIRTY_RESET){
+      memcpy(m->memory + (p << X_PAGE_BITS), m->base + (p << X_PAGE_BITS),
+             1 << X_PAGE_BITS);
+      if ((p << X_PAGE_BITS) < m->decoded->reach)
+        xdcache_invalidate(m->decoded, p << X_PAGE_BITS, 1 << X_PAGE_BITS);
+      m->dirty[p] &= ~DIRTY_RESET;
+      n++;
+    }
+  m->memory[MEMSIZE] = m->base[MEMSIZE];
+  for (u = 0; u < m->ncpu; u++){
+    xout_drain(m->console, u);
+    put_cpu(&m->states[u], &m->mark[u]);
+  }
+  m->quiescent = 0;
+  m->quiet_hash = 0;
+  m->quiet_rounds = 0;
+  return n;
+}
+
+void xmachine_wrote(xmachine *m, int addr, int n){
+  int k;
+
+  for (k = 0; k < n; k++)
+    m->dirty[(unsigned short) (addr + k) >> X_PAGE_BITS] = XCPU_DIRTY;
+  m->memory[MEMSIZE] = m->memory[0];
+  if (m->started)
+    xdcache_invalidate(m->decoded, addr, n);
+}
+
+unsigned char * xmachine_memory(xmachine *m){
+  return m->memory;
+}
+
+void xmachine_output(xmachine *m, void (*out)(void *arg, int id,
+                                               unsigned char ch),
+                     void *arg){
+  m->out = out;
+  m->out_arg = arg;
+}
+
+void xmachine_reporter(xmachine *m, void (*stopped)(void *arg,
+                                                    const xmachine_stop *stop),
+                       void *arg){
+  m->stopped = stopped;
+  m->stopped_arg = arg;
+}
+
+/**************************************************************
+ * Run every CPU that can still run, within the budget: each one
+ * on a thread of its own, unless they take turns, or share a
+ * pool. The timer thread, if asked for, interrupts them all as
+ * time goes by.
+ **************************************************************/
+int xmachine_run(xmachine *m, int budget){
+  pthread_t threads[m->ncpu], timer_thread;
+  int u, running = 0;
+
+  if (!m->started)
+    start(m);
+  set_budget(m, budget);
+
+  if (m->config.timer_period){
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m->timer_stop, &attr);
+    pthread_condattr_destroy(&attr);
+    m->timer_done = 0;
+    if (pthread_create(&timer_thread, NULL, timer, m)){
+      fprintf(stderr, "FAILURE IN <xmachine_run>: NO TIMER THREAD\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (m->config.quantum){
+    if (m->config.cores)
+      pin(m, pthread_self(), 0);
+    round_robin(m);
+  } else if (m->config.workers >= 0){
+    run_pool(m);
+  } else {
+    int spawned[m->ncpu];
+    for (u = 0; u < m->ncpu; u++){
+      if (!(spawned[u] = live(&m->states[u])))
+        continue;
+      if (pthread_create(&threads[u], NULL, execution_loop,
+                         (void *) (m->states+u))){
+        fprintf(stderr, "FAILURE IN <xmachine_run>: NO THREAD FOR CPU %d\n",
+                u);
+        exit(EXIT_FAILURE);
+      }
+      if (m->config.cores)
+        pin(m, threads[u], u);
+    }
+
+    /** Wait for the threads to come home. **/
+    for (u = m->ncpu-1; u >= 0; u--)
+      if (spawned[u])
+        pthread_join(threads[u], NULL);
+  }
+
+  if (m->config.timer_period){
+    pthread_mutex_lock(&m->timer_lock);
+    m->timer_done = 1;
+    pthread_cond_signal(&m->timer_stop);
+    pthread_mutex_unlock(&m->timer_lock);
+    pthread_join(timer_thread, NULL);
+    pthread_cond_destroy(&m->timer_stop);
+  }
+
+  for (u = running = 0; u < m->ncpu; u++)
+    running += m->states[u].running;
+  return running;
+}
+
+/**************************************************************
+ * Run many machines, one after another, each as xmachine_run
+ * would; but those of one CPU that the fast engines run, with
+ * nothing that depends on the host's timing (the timer, idle
+ * skipping, livelock) and nothing to trace, are run in gangs of
+ * up to XLANE_N, in lockstep (see xlane.h), which is quickest by
+ * far when they run the same image, and step alike.
+ **************************************************************/
+int xmachine_run_lockstep(xmachine **m, int n, const int *budget){
+  xmachine *gang[XLANE_N];
+  int ganged[n];
+  int k, size = 0, running = 0;
+
+  for (k = 0; k < n; k++){
+    if (!m[k]->started)
+      start(m[k]);
+    set_budget(m[k], (budget)? budget[k] : 0);
+    if (!(ganged[k] = in_step(m[k]))){
+      running += xmachine_run(m[k], (budget)? budget[k] : 0);
+      continue;
+    }
+    gang[size++] = m[k];
+    if (size == XLANE_N){
+      run_gang(gang, size);
+      size = 0;
+    }
+  }
+  if (size)
+    run_gang(gang, size);
+  for (k = 0; k < n; k++)
+    if (ganged[k])
+      running += m[k]->states[0].running;
+  return running;
+}
+
+/**************************************************************
+ * Raise exception ex on CPU id, from outside: it is taken just
+ * as the timer's interrupt is, between bursts.
+ **************************************************************/
+void xmachine_interrupt(xmachine *m, int id, unsigned int ex){
+  if (id < 0 || id >= m->ncpu || ex >= X_E_LAST)
+    return;
+  __atomic_or_fetch(&m->states[id].raised, 1 << ex, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&m->started, __ATOMIC_ACQUIRE))
+    xspin_wake(&m->cpus[id]);         // (a CPU waiting in a spin loop)
+}
+
+int xmachine_stuck(xmachine *m){
+  return stuck(m);
+}
+
+/**************************************************************
+ * Put off CPU id's periodic interrupt by so many cycles: the
+ * next one falls due that much later, and each one after it a
+ * period after that. The machine is started first, if need be,
+ * since starting schedules the interrupt.
+ **************************************************************/
+int xmachine_delay_timer(xmachine *m, int id, int cycles){
+  xevq *q;
+  xevent ev;
+  int k;
+
+  if (id < 0 || id >= m->ncpu || cycles < 0)
+    return 0;
+  if (!m->started)
+    start(m);
+  q = &m->states[id].events;
+  for (k = 0; k < q->n && q->heap[k].source != XEV_TIMER; k++)
+    ;
+  if (k == q->n)
+    return 0;
+  ev = q->heap[k];
+  xevq_cancel(q, XEV_TIMER);
+  xevq_schedule(q, ev.due + cycles, ev.period, XEV_TIMER, ev.ex);
+  return 1;
+}
+
+/**************************************************************
+ * Hash the machine as it stands: its memory, and each CPU's
+ * registers, and whether it still runs -- but not the cycles it
+ * has run, nor what is pending on it, so that machines that got
+ * to the same place by different roads hash the same.
+ **************************************************************/
+unsigned long xmachine_hash(xmachine *m){
+  unsigned long h = 14695981039346656037UL;   // FNV-1a, over the lot
+  int u, k;
+  xcpu *c;
+
+  for (u = 0; u < m->ncpu; u++){
+    c = &m->cpus[u];
+    h = (h ^ m->states[u].running) * 1099511628211UL;
+    h = (h ^ c->pc) * 1099511628211UL;
+    h = (h ^ c->state) * 1099511628211UL;
+    h = (h ^ c->itr) * 1099511628211UL;
+    for (k = 0; k < X_MAX_REGS; k++)
+      h = (h ^ c->regs[k]) * 1099511628211UL;
+  }
+  for (k = 0; k < MEMSIZE; k++)
+    h = (h ^ m->memory[k]) * 1099511628211UL;
+  return h;
+}
+
+/**************************************************************
+ * Save the machine, between runs: the whole of it, or, as a
+ * delta, just the pages written since the snapshot it last saved
+ * or was restored from. The console is drained first, so that
+ * nothing written before the snapshot is written again by a
+ * machine restored from it. The snapshot is written to a file of
+ * its own, next to the one asked for, and renamed over it once
+ * written: the machine's memory may be mapped from the file it
+ * replaces, which must not be cut short under it.
+ **************************************************************/
+static int save(xmachine *m, const char *file, int delta){
+  snapshot_header h;
+  snapshot_cpu r;
+  unsigned char pages[X_PAGES];
+  char *temp, *path;
+  FILE *fd = NULL;
+  int u, p, ok, fdn;
+
+  if (!m->started)
+    start(m);
+  gather(m);
+  // a delta saved over the snapshot it adds to would add to itself
+  if (delta && (path = realpath(file, NULL)) != NULL){
+    ok = strcmp(path, m->saved_as);
+    free(path);
+    if (!ok)
+      return -1;
+  }
+  if ((temp = malloc(strlen(file) + 8)) == NULL){
+    fprintf(stderr, "FAILURE IN <save>: OUT OF MEMORY\n");
+    exit(EXIT_FAILURE);
+  }
+  sprintf(temp, "%s.XXXXXX", file);
+  if ((fdn = mkstemp(temp)) < 0 || (fd = fdopen(fdn, "wb")) == NULL){
+    if (fdn >= 0){
+      close(fdn);
+      remove(temp);
+    }
+    free(temp);
+    return -1;
+  }
+  fchmod(fdn, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+  h.version = SNAPSHOT_VERSION;
+  h.ncpu = m->ncpu;
+  h.image_len = m->image_len;
+  h.seed = m->config.seed;
+  if (delta){
+    for (p = 0; p < X_PAGES; p++)
+      if (m->dirty[p] & DIRTY_SAVED)
+        pages[h.pages++] = p;
+    h.base_len = strlen(m->saved_as);
+  }
+  h.memory_at = (sizeof(h) + m->ncpu * sizeof(r) + h.base_len + h.pages
+                 + SNAPSHOT_PAGE - 1) / SNAPSHOT_PAGE * SNAPSHOT_PAGE;
+  ok = (fwrite(&h, sizeof(h), 1, fd) == 1);
+  for (u = 0; u < m->ncpu && ok; u++){
+    xout_drain(m->console, u);
+    get_cpu(&m->states[u], &r);
+    ok = (fwrite(&r, sizeof(r), 1, fd) == 1);
+  }
+  if (delta){
+    ok = ok && fwrite(m->saved_as, 1, h.base_len, fd) == (size_t) h.base_len
+      && fwrite(pages, 1, h.pages, fd) == (size_t) h.pages
+      && fseek(fd, h.memory_at, SEEK_SET) == 0;
+    for (p = 0; p < h.pages && ok; p++)
+      ok = (fwrite(m->memory + (pages[p] << X_PAGE_BITS), 1 << X_PAGE_BITS,
+                   1, fd) == 1);
+  } else {
+    ok = ok && fseek(fd, h.memory_at, SEEK_SET) == 0
+      && fwrite(m->memory, MEMSIZE + MIRROR_SIZE, 1, fd) == 1;
+  }
+  if (fclose(fd) || !ok || rename(temp, file)){
+    remove(temp);
+    free(temp);
+    return -1;
+  }
+  free(temp);
+  for (p = 0; p < X_PAGES; p++)
+    m->dirty[p] &= ~DIRTY_SAVED;
+  saved_as(m, file);
+  return 0;
+}
+
+/**************************************************************
+ * Read a snapshot into the memory (and the copy of it kept for
+ * resets), and its CPUs' records into r: a delta on top of the
+ * snapshot it adds to, and that on top of its own, and so on,
+ * depth deep so far. Returns 0, or -1 if it cannot be read.
+ **************************************************************/
+static int restore(xmachine *m, const char *file, snapshot_cpu *r,
+                   int depth){
+  snapshot_header h;
+  unsigned char pages[X_PAGES];
+  char *base = NULL;
+  FILE *fd;
+  int p, ok;
+
+  if ((fd = fopen(file, "rb")) == NULL)
+    return -1;
+  ok = read_header(fd, &h) && h.ncpu == m->ncpu && read_cpus(fd, r, m->ncpu);
+  if (ok && h.base_len){
+    if ((base = calloc(h.base_len + 1, 1)) == NULL){
+      fprintf(stderr, "FAILURE IN <restore>: OUT OF MEMORY\n");
+      exit(EXIT_FAILURE);
+    }
+    ok = fread(base, 1, h.base_len, fd) == (size_t) h.base_len
+      && fread(pages, 1, h.pages, fd) == (size_t) h.pages
+      && depth < SNAPSHOT_CHAIN;
+    // the snapshot it adds to comes first, and then its own records
+    if (ok && restore(m, base, r, depth + 1) == 0){
+      ok = fseek(fd, sizeof(h), SEEK_SET) == 0 && read_cpus(fd, r, m->ncpu)
+        && fseek(fd, h.memory_at, SEEK_SET) == 0;
+      for (p = 0; p < h.pages && ok; p++){
+        ok = (fread(m->memory + (pages[p] << X_PAGE_BITS),
+                    1 << X_PAGE_BITS, 1, fd) == 1);
+        memcpy(m->base + (pages[p] << X_PAGE_BITS),
+               m->memory + (pages[p] << X_PAGE_BITS), 1 << X_PAGE_BITS);
+      }
+      m->memory[MEMSIZE] = m->base[MEMSIZE] = m->memory[0];
+    } else
+      ok = 0;
+    free(base);
+  } else if (ok){
+    struct stat st;
+    ok = fstat(fileno(fd), &st) == 0
+      && st.st_size >= h.memory_at + MEMSIZE + MIRROR_SIZE
+      && mmap(m->memory, MEMSIZE + MIRROR_SIZE, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_FIXED, fileno(fd), h.memory_at) != MAP_FAILED
+      && mmap(m->base, MEMSIZE + MIRROR_SIZE, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_FIXED, fileno(fd), h.memory_at) != MAP_FAILED;
+  }
+  fclose(fd);
+  if (!ok)
+    return -1;
+  m->image_len = h.image_len;
+  // random turns go on from where they were (but are not turned on)
+  if (m->config.seed && h.seed)
+    m->config.seed = h.seed;
+  return 0;
+}
+
+// read a snapshot's header, and check that it is one this build can read
+static int read_header(FILE *fd, snapshot_header *h){
+  return fread(h, sizeof(*h), 1, fd) == 1
+    && !memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic))
+    && h->version == SNAPSHOT_VERSION && h->ncpu >= 1
+    && h->image_len >= 0 && h->image_len <= MEMSIZE
+    && h->memory_at % SNAPSHOT_PAGE == 0
+    && h->base_len >= 0 && h->base_len < SNAPSHOT_PAGE
+    && h->pages >= 0 && h->pages <= X_PAGES && (h->base_len || !h->pages);
+}
+
+// read the CPUs' records, and check that each one could have been saved
+// (since they go straight into the running machine, events and all)
+static int read_cpus(FILE *fd, snapshot_cpu *r, int ncpu){
+  int u, k;
+
+  if (fread(r, sizeof(r[0]), ncpu, fd) != (size_t) ncpu)
+    return 0;
+  for (u = 0; u < ncpu; u++){
+    if (r[u].events.n < 0 || r[u].events.n > XEV_MAX
+        || (r[u].running & ~1) || (r[u].halted & ~1))
+      return 0;
+    for (k = 0; k < r[u].events.n; k++)
+      if (r[u].events.heap[k].source >= XEV_LAST
+          || r[u].events.heap[k].ex >= X_E_LAST
+          || r[u].events.heap[k].period < 0)
+        return 0;
+  }
+  return 1;
+}
+
+// a CPU's record, for a snapshot or a checkpoint
+static void get_cpu(cpu_state *s, snapshot_cpu *r){
+  memset(r, 0, sizeof(*r));
+  memcpy(r->regs, s->c->regs, sizeof(r->regs));
+  r->pc = s->c->pc;
+  r->state = s->c->state;
+  r->itr = s->c->itr;
+  r->ipi = s->c->ipi;
+  r->i = s->i;
+  r->oldpc = s->oldpc;
+  r->halted = s->halted;
+  r->running = s->running;
+  r->credited = s->credited;
+  r->skipped = s->skipped;
+  r->raised = s->raised;
+  r->events = s->events;
+}
+
+// and put it back, on a started machine, between runs
+static void put_cpu(cpu_state *s, const snapshot_cpu *r){
+  xmachine *m = s->m;
+  xcpu *c = s->c;
+
+  memcpy(c->regs, r->regs, sizeof(r->regs));
+  c->pc = r->pc;
+  c->state = r->state;
+  c->itr = r->itr;
+  c->ipi = r->ipi;
+  s->i = r->i;
+  s->oldpc = r->oldpc;
+  s->halted = r->halted;
+  s->running = r->running;
+  s->credited = r->credited;
+  s->skipped = r->skipped;
+  s->raised = r->raised;
+  s->events = r->events;    // the timer's among them, from the record
+  choose_run(s);
+  c->from = 0;              // the edges start afresh
+  s->wait_for = 0;
+  s->parked_at = 0;
+  s->waiting = 0;
+  c->spin->ready = 0;
+  c->spin->hits = 0;
+  if (s->running && !s->jit && m->config.engine == XMACHINE_JIT)
+    s->jit = xjit_create(c, m->table);
+  else if (!s->running && s->jit){
+    xjit_destroy(s->jit);
+    s->jit = NULL;
+  }
+}
+
+// take the CPUs' maps of the pages they wrote into the machine's
+static void gather(xmachine *m){
+  int p, u;
+
+  for (u = 0; u < m->ncpu; u++){
+    for (p = 0; p < X_PAGES; p++)
+      m->dirty[p] |= m->cpus[u].dirty[p];
+    memset(m->cpus[u].dirty, 0, X_PAGES);
+  }
+}
+
+// note the snapshot that a delta would now add to
+static void saved_as(xmachine *m, const char *file){
+  free(m->saved_as);
+  if ((m->saved_as = realpath(file, NULL)) == NULL
+      && (m->saved_as = strdup(file)) == NULL){
+    fprintf(stderr, "FAILURE IN <saved_as>: OUT OF MEMORY\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**************************************************************
+ * Before the first run: decode the code the CPUs share, open
+ * the console they write to, and get each of them ready to run.
+ **************************************************************/
+static void start(xmachine *m){
+  int u;
+
+  // all CPUs run the same code, so they can share one decoding of it
+  m->decoded = xdcache_create(m->table, m->image_len,
+                              m->ncpu > 1 && !m->config.quantum);
+  m->decoded->idle = m->config.idle_skip;  // and mark its idle loops, if
+                                           // they are skipped
+  // and buffer what they write, rather than fight over stdout
+  m->console = xout_create(m->config.console, m->ncpu);
+  if (m->out)
+    xout_sink(m->console, m->out, m->out_arg);
+  // and let those waiting on one another sleep, rather than spin
+  m->spins = xspin_create(m->decoded, m->ncpu);
+
+  for (u = 0; u < m->ncpu; u++){
+    m->cpus[u].memory = m->memory;
+    m->cpus[u].decoded = m->decoded;
+    m->cpus[u].console = m->console;
+    m->cpus[u].spin = &m->spins[u];
+    m->cpus[u].peers = m->cpus;
+    m->cpus[u].num = m->ncpu;
+    m->cpus[u].id = u;
+    m->cpus[u].edges = m->config.coverage;
+    m->states[u].m = m;
+    m->states[u].c = &m->cpus[u];
+    start_cpu(&m->states[u]);
+    get_cpu(&m->states[u], &m->mark[u]);  // the first checkpoint
+  }
+  __atomic_store_n(&m->started, 1, __ATOMIC_RELEASE);
+}
+
+// can the CPU run any further, this run?
+static int live(cpu_state *s){
+  return s->running && (s->end == 0 || s->i < s->end);
+}
+
+// where each CPU's budget for this run ends (0 for no limit)
+static void set_budget(xmachine *m, int budget){
+  cpu_state *s;
+  int u;
+
+  for (u = 0; u < m->ncpu; u++){
+    s = &m->states[u];
+    s->end = (budget == 0)? 0 : (s->i > INT_MAX - budget)? INT_MAX
+                                                          : s->i + budget;
+  }
+}
+
+/**************************************************************
+ * The central execution loop, for a thread of its own: run the
+ * CPU to the end of the run.
+ **************************************************************/
+static void * execution_loop(void * state){ // expects pointer to a cpu_state
+  cpu_state *s = (cpu_state *) state;
+  run_cpu(s);
+  if (live(s))
+    finish_cpu(s, XMACHINE_OUT_OF_TIME);
+  return NULL;
+}
+
+/**************************************************************
+ * With a timer period, the timer thread raises an interrupt on
+ * every CPU once a period, by the clock on the wall rather than
+ * by the CPU's cycles, so that fast and slow CPUs alike are
+ * interrupted at the same rate. It only raises it; the CPU
+ * itself takes the interrupt between bursts, which are kept
+ * short (TIMER_BURST) for the purpose, and a CPU asleep in a
+ * spin loop is woken to take it. Ticks that come faster than a
+ * CPU can take them are merged into one, and ticks that come
+ * before it has loaded its interrupt table (lit) are dropped.
+ **************************************************************/
+static void * timer(void *arg){
+  xmachine *m = (xmachine *) arg;
+  struct timespec next;
+  long at = clock_ns(CLOCK_MONOTONIC);
+  int u;
+
+  pthread_mutex_lock(&m->timer_lock);
+  while (!m->timer_done){
+    at += m->config.timer_period;
+    next.tv_sec = at / 1000000000L;
+    next.tv_nsec = at % 1000000000L;
+    if (pthread_cond_timedwait(&m->timer_stop, &m->timer_lock, &next)
+        != ETIMEDOUT)
+      continue;
+    for (u = 0; u < m->ncpu; u++){
+      if (!m->cpus[u].itr)              // it cannot take interrupts yet
+        continue;
+      xmachine_interrupt(m, u, X_E_INTR);
+    }
+  }
+  pthread_mutex_unlock(&m->timer_lock);
+  return NULL;
+}
+
+/**************************************************************
+ * With a quantum, a single thread takes every CPU in turn, round
+ * and round, for a quantum of instructions each, until all of
+ * them have stopped. Nothing here depends on the host's timing,
+ * so every run comes out the same (and the same as any other
+ * run with the same quantum and seed).
+ **************************************************************/
+static void round_robin(xmachine *m){
+  cpu_state *s = m->states;
+  int u, running = 0;
+
+  for (u = 0; u < m->ncpu; u++)
+    running += live(&s[u]);
+  while (running){
+    for (u = 0; u < m->ncpu; u++){
+      if (!live(&s[u]))
+        continue;
+      s[u].until = s[u].i + turn_length(m);
+      s[u].waiting = 0;
+      run_cpu(&s[u]);
+      running -= !live(&s[u]);
+    }
+  }
+}
+
+/**************************************************************
+ * With workers, a pool of worker threads (as many as asked for,
+ * or as there are host cores) shares out the CPUs, running each
+ * of them for a slice of POOL_SLICE cycles at a time (see
+ * xpool.h), so that thousands of CPUs need no more threads than
+ * a few. A CPU found spinning is parked in the pool, rather than
+ * put to sleep, and its worker moves on to another.
+ **************************************************************/
+static void run_pool(xmachine *m){
+  xpool_ops ops = { pool_slice, pool_arm };
+  xpool *pool;
+
+  pool = xpool_create(m->config.workers, &ops, m->states, m->ncpu);
+  xpool_affinity(pool, m->config.cores, m->config.ncores);
+  xspin_waker(m->decoded, pool_wake, pool);
+  xpool_run(pool);
+  xspin_waker(m->decoded, NULL, NULL);
+  xpool_destroy(pool);
+}
+
+/**************************************************************
+ * Run a slice of CPU id, for a worker of the pool: pick up from
+ * a wait, if it was parked, and say what became of it.
+ **************************************************************/
+static int pool_slice(void *states, int id, long *deadline){
+  cpu_state *s = (cpu_state *) states + id;
+
+  if (s->parked_at){
+    xspin_disarm(s->c);
+    credit_wait(s, clock_ns(CLOCK_MONOTONIC) - s->parked_at);
+    s->parked_at = 0;
+    s->waiting = 0;
+  }
+  if (!live(s))                       // (stopped in an earlier run)
+    return XPOOL_DONE;
+  s->until = s->i + POOL_SLICE;
+  s->ran -= clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  run_cpu(s);
+  s->ran += clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  if (!live(s))
+    return XPOOL_DONE;
+  if (s->wait_for){
+    s->parked_at = clock_ns(CLOCK_MONOTONIC);
+    *deadline = s->parked_at + s->wait_for;
+    s->wait_for = 0;
+    return XPOOL_PARK;
+  }
+  return XPOOL_AGAIN;
+}
+
+// a parked CPU is woken by stores to its loop, an exception raised from
+// outside, an ipi, or the end of the run (livelock)...
+static int pool_arm(void *states, int id){
+  cpu_state *s = (cpu_state *) states + id;
+  return xspin_arm(s->c) && !__atomic_load_n(&s->raised, __ATOMIC_SEQ_CST)
+    && !__atomic_load_n(&s->c->ipi, __ATOMIC_SEQ_CST) && !stuck(s->m);
+}
+
+// ...which come through here
+static void pool_wake(void *pool, int id){
+  xpool_wake((xpool *) pool, id);
+}
+
+/**************************************************************
+ * Can the machine run in lockstep with others? It must have but
+ * the one CPU, still able to run, and nothing that the gang does
+ * not: no table engine, tracing, idle skipping, pool, timer or
+ * livelock check. Turns it may take (alone, they only change
+ * where its bursts end).
+ **************************************************************/
+static int in_step(xmachine *m){
+  xmachine_config *k = &m->config;
+  return m->ncpu == 1 && live(&m->states[0])
+    && k->engine != XMACHINE_TABLE && !k->traced && !k->idle_skip
+    && k->workers < 0 && !k->timer_period && !k->livelock && !k->coverage;
+}
+
+/**************************************************************
+ * Run a gang of machines in lockstep, each to the end of its
+ * run. Each CPU's bursts are just as long as they would be on
+ * its own (see burst_length), and what falls due is delivered at
+ * the end of each, just as run_cpu would; the gang itself runs
+ * as far as the nearest end of a burst at a time. A lane that
+ * stops is reported on; one that leaves is run on its own from
+ * there (see run_alone).
+ **************************************************************/
+static void run_gang(xmachine **gang, int n){
+  xlane *g = xlane_create(gang[0]->table, gang[0]->image_len);
+  cpu_state *s;
+  unsigned short sp;
+  int at[XLANE_N];                    // where each lane's burst ends
+  int k, len, live;
+
+  for (k = 0; k < n; k++){
+    s = gang[k]->states;
+    xlane_join(g, s->c);
+    at[k] = s->i;
+    if (gang[k]->config.quantum)      // a turn begins with the run
+      s->until = s->i;
+  }
+  for (k = 0; k < n; k++)
+    if (g->status[k] == XLANE_ALONE)
+      run_alone(gang[k]->states, at[k]);
+
+  while (g->live){
+    len = INT_MAX;
+    EACH_LANE(k, g->live){
+      s = gang[k]->states;
+      if (s->i == at[k]){
+        if (s->end && s->i >= s->end){
+          xlane_leave(g, k);
+          report(s, XMACHINE_OUT_OF_TIME);
+          continue;
+        }
+        if (gang[k]->config.quantum && s->i >= s->until){
+          s->until = s->i + turn_length(gang[k]);
+          s->waiting = 0;
+        }
+        sp = s->c->regs[X_STACK_REG];
+        if (!deliver(s)){
+          xlane_leave(g, k);
+          continue;
+        }
+        if (s->c->regs[X_STACK_REG] != sp)   // an exception was taken
+          xlane_wrote(g, k, s->c->regs[X_STACK_REG],
+                      (unsigned short) (sp - s->c->regs[X_STACK_REG]));
+        at[k] = s->i + burst_length(s);
+      }
+      if (at[k] - s->i < len)
+        len = at[k] - s->i;
+    }
+    if (!g->live)
+      break;
+    live = g->live;
+    xlane_run(g, len);
+    EACH_LANE(k, live){
+      s = gang[k]->states;
+      s->i += g->ran[k];
+      if (g->ran[k] > 0 || g->status[k] == XLANE_HALTED)
+        s->oldpc = g->oldpc[k];
+      if (g->status[k] == XLANE_HALTED){
+        s->halted = 1;
+        finish_cpu(s, XMACHINE_HALTED);
+      } else if (g->status[k] == XLANE_ALONE){
+        run_alone(s, (g->ended & (1 << k))? s->i : at[k]);
+      }
+    }
+  }
+  xlane_destroy(g);
+}
+
+/**************************************************************
+ * Run a CPU that has left its gang on its own, to the end of its
+ * run. It may have left in the middle of a burst, where the CPU
+ * would not have stopped on its own: the rest of the burst, up
+ * to at, is run first, with any ipi held back until its end, and
+ * then the rest of its turn, if it takes turns.
+ **************************************************************/
+static void run_alone(cpu_state *s, int at){
+  int until = s->until, ipi;
+
+  if (s->i < at && live(s)){
+    ipi = __atomic_exchange_n(&s->c->ipi, 0, __ATOMIC_ACQUIRE);
+    s->until = at;
+    run_cpu(s);
+    s->until = until;
+    if (ipi)
+      __atomic_store_n(&s->c->ipi, ipi, __ATOMIC_RELEASE);
+  }
+  if (!s->m->config.quantum){
+    if (live(s))
+      execution_loop(s);
+    return;
+  }
+  if (live(s))
+    run_cpu(s);
+  round_robin(s->m);
+}
+
+/**************************************************************
+ * How long the next turn is: the quantum, or, given a seed, a
+ * length drawn at random (by xorshift) from 1 to twice the
+ * quantum, less one, so that the CPUs interleave differently
+ * from one seed to the next.
+ **************************************************************/
+static int turn_length(xmachine *m){
+  unsigned long seed = m->config.seed;
+  if (seed == 0)
+    return m->config.quantum;
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  m->config.seed = seed;
+  return 1 + seed % (2*m->config.quantum - 1);
+}
+
+/**************************************************************
+ * Get a CPU ready to run.
+ **************************************************************/
+static void start_cpu(cpu_state *s){
+  xmachine *m = s->m;
+  xcpu *c = s->c;
+  s->i = 0;
+  s->until = INT_MAX;
+  s->oldpc = 0;
+  s->halted = 0;
+  s->running = 1;
+  choose_run(s);
+  c->from = 0;
+  s->jit = (m->config.engine == XMACHINE_JIT)? xjit_create(c, m->table)
+                                              : NULL;
+  s->credited = 0;
+  s->skipped = 0;
+  s->ran = 0;
+  s->wait_for = 0;
+  s->parked_at = 0;
+  s->waiting = 0;
+  xevq_init(&s->events);
+  if (m->config.interrupt_freq > 0)
+    xevq_schedule(&s->events, m->config.interrupt_freq,
+                  m->config.interrupt_freq, XEV_TIMER, X_E_INTR);
+}
+
+// which build of the threaded engine the CPU starts in
+static void choose_run(cpu_state *s){
+  xmachine_config *k = &s->m->config;
+  s->run = (k->coverage)? xcpu_run_covered
+         : (k->traced)? xcpu_run_traced : xcpu_run;
+}
+
+/**************************************************************
+ * Run the CPU until the end of its turn (s->until), or of its
+ * budget, or until it stops for good (or they all do: see
+ * quiet).
+ **************************************************************/
+static void run_cpu(cpu_state *s){
+  xmachine *m = s->m;
+  xcpu *c = s->c;
+  IHandler *table = m->table;
+  xstop stop;
+
+  while ((s->i < s->end || !s->end) && s->i < s->until && !stuck(m)){
+    if (!deliver(s))
+      return;
+    
+    if (m->config.engine != XMACHINE_TABLE){
+      // the fast build cannot trace, so once asked to, stay with the other
+      if (c->state & X_STATE_DEBUG_ON && s->run == xcpu_run)
+        s->run = xcpu_run_traced;
+      // run everything up to the next interrupt (or the end) in one go
+      if (m->config.engine == XMACHINE_JIT)
+        s->i += xjit_run(s->jit, burst_length(s), &stop);
+      else
+        s->i += s->run(c, table, burst_length(s), &stop);
+      s->oldpc = stop.pc;
+      s->halted = (stop.reason == X_STOP_HALT);
+      if (s->halted) break;
+      if (stop.reason == X_STOP_SPIN)
+        spin_wait(s);
+      else if (stop.reason == X_STOP_IDLE)
+        fast_forward(s, 0);
+      continue;
+    }
+
+    s->oldpc = c->pc; // save current instruction for error reporting
+
+    // Now, call xcpu_execute function to perform the instruction at c->pc.
+
+    s->halted = !xcpu_execute(c,table); 
+
+    if (s->halted) break;
+    s->i ++;
+    if (c->spin->ready)
+      spin_wait(s);
+    else if (m->config.idle_skip && idle_branch(c, s->oldpc))
+      fast_forward(s, 0);
+  }
+  if (s->halted)
+    finish_cpu(s, XMACHINE_HALTED);
+  else if (stuck(m))
+    finish_cpu(s, XMACHINE_SPINNING);
+  else if (s->end && s->i >= s->end)
+    report(s, XMACHINE_OUT_OF_TIME);
+}
+
+/**************************************************************
+ * Between bursts: deliver whatever has fallen due (the periodic
+ * interrupt, for one), whatever has been raised from outside
+ * since the last burst (the timer's interrupt, for one), and any
+ * ipi from another CPU, once this one is ready for it. If the CPU
+ * halts on one of them, 0 is returned.
+ **************************************************************/
+static int deliver(cpu_state *s){
+  xcpu *c = s->c;
+  xevent ev;
+
+  if (s->i >= XEVQ_NEXT(&s->events)){
+    while (xevq_pop(&s->events, s->i, &ev))
+      if (!interrupt(s, ev.ex))
+        return 0;
+  }
+  if (__atomic_load_n(&s->raised, __ATOMIC_RELAXED) && !take_raised(s))
+    return 0;
+  if (__atomic_load_n(&c->ipi, __ATOMIC_RELAXED) && c->itr
+      && !(c->state & X_STATE_IN_EXCEPTION)
+      && __atomic_exchange_n(&c->ipi, 0, __ATOMIC_ACQUIRE)
+      && !interrupt(s, X_E_IPI))
+    return 0;
+  return 1;
+}
+
+/**************************************************************
+ * Say why the CPU stopped (to the reporter, if there is one),
+ * once its output has caught up, so that it comes first.
+ **************************************************************/
+static void report(cpu_state *s, int why){
+  xmachine *m = s->m;
+  xcpu *c = s->c;
+  xmachine_stop stop;
+
+  xout_drain(c->console, c->id);
+  stop.id = c->id;
+  stop.why = why;
+  stop.cycles = s->i;
+  stop.skipped = s->skipped;
+  // a CPU left spinning is stopped at the top of its loop
+  stop.pc = (why == XMACHINE_HALTED || why == XMACHINE_OUT_OF_TIME)? s->oldpc
+                                                                   : c->pc;
+  stop.instruction = FETCH_WORD(stop.pc);
+  if (m->stopped)
+    m->stopped(m->stopped_arg, &stop);
+}
+
+/**************************************************************
+ * Say why the CPU stopped for good, and tidy up after it.
+ **************************************************************/
+static void finish_cpu(cpu_state *s, int why){
+  report(s, why);
+  if (s->jit)
+    xjit_destroy(s->jit);
+  s->jit = NULL;
+  __atomic_store_n(&s->running, 0, __ATOMIC_SEQ_CST);
+  quiet(s);
+}
+
+/**************************************************************
+ * Raise exception ex on the CPU. If it cannot be raised, the CPU
+ * halts, and 0 is returned.
+ **************************************************************/
+static int interrupt(cpu_state *s, unsigned int ex){
+  if (xcpu_exception(s->c, ex))
+    return 1;
+  finish_cpu(s, XMACHINE_FAULT);
+  return 0;
+}
+
+// take the exceptions raised from outside, in the order of X_E_*
+static int take_raised(cpu_state *s){
+  int raised = __atomic_exchange_n(&s->raised, 0, __ATOMIC_ACQUIRE);
+  unsigned int ex;
+
+  for (ex = 0; ex < X_E_LAST; ex++)
+    if ((raised & (1 << ex)) && !interrupt(s, ex))
+      return 0;
+  return 1;
+}
+
+/**************************************************************
+ * How many cycles may run, from where the CPU is now, before the
+ * next event is due, or the budget or its turn runs out; with
+ * the timer on, a burst is cut short, lest a tick wait.
+ **************************************************************/
+static int burst_length(cpu_state *s){
+  int left = due_in(s);
+  return (s->m->config.timer_period && left > TIMER_BURST)? TIMER_BURST
+                                                          : left;
+}
+
+// the same, for as long as the CPU may wait in a spin loop (the timer
+// can wake it from that)
+static int due_in(cpu_state *s){
+  int next = (s->end)? s->end : s->i + MAX_BURST;
+  if (XEVQ_NEXT(&s->events) < next)
+    next = XEVQ_NEXT(&s->events);
+  if (s->until < next)
+    next = s->until;
+  return next - s->i;
+}
+
+/**************************************************************
+ * The CPU has been seen spinning (see xspin.h). Step once round
+ * the loop to make sure it is only waiting, then sleep until some
+ * other CPU stores to what it waits on, or until its next event
+ * is due. Each time round the loop is the same as the last, so
+ * the time slept can be made up by crediting the CPU with as many
+ * whole times round as it would have managed meanwhile, at the
+ * rate this thread runs when it has the host CPU to itself (by
+ * its own CPU time, which does not pass while it sleeps, or while
+ * other threads have the host CPU); it then runs the odd few
+ * cycles left before the deadline for itself, and arrives there
+ * just as if it had spun all along.
+ *
+ * Taking turns, nobody else can run until this CPU's turn is
+ * over, so the loop cannot end before then: the rest of the turn
+ * is skipped, just as for an idle loop. In a pool, the slice
+ * ends here instead, and the CPU is parked (see pool_slice); the
+ * wait may well outlast the slice.
+ **************************************************************/
+static void spin_wait(cpu_state *s){
+  xmachine *m = s->m;
+  xcpu *c = s->c;
+  unsigned short lastpc;
+  int length, left, until = s->until;
+  long ran;
+
+  if (m->config.quantum){
+    fast_forward(s, 1);
+    return;
+  }
+  // cycles actually run per nanosecond spent running them
+  ran = s->ran + clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  if (ran > 0 && s->i - s->credited >= MIN_PACE){
+    s->rate = (double) (s->i - s->credited) / ran;
+  } else if (m->config.timer_period){
+    s->rate = 0;        // the timer will wake it, though nothing is made up
+  } else {
+    xspin_skip(c);
+    return;
+  }
+
+  if (m->config.workers >= 0)
+    s->until = INT_MAX;               // the wait may well outlast the slice
+  lastpc = s->oldpc;                  // kept, if the turn is already over
+  s->i += xspin_probe(c, m->table, burst_length(s), &length, &lastpc);
+  s->oldpc = lastpc;
+  left = due_in(s);
+  s->until = until;
+  if (length == 0 || left < length)
+    return;
+
+  s->wait_length = length;
+  s->wait_left = left;
+  __atomic_store_n(&s->waiting, 1, __ATOMIC_SEQ_CST);
+  quiet(s);
+  if (m->config.workers >= 0){
+    s->wait_for = (s->rate)? (long) (left / s->rate) : m->config.timer_period;
+    s->until = s->i;                  // the slice ends here
+  } else if (!stuck(m)){
+    credit_wait(s, xspin_park(c, (s->rate)? (long) (left / s->rate)
+                                          : m->config.timer_period));
+    s->waiting = 0;
+  }
+}
+
+/**************************************************************
+ * Credit a CPU that has waited (slept nanoseconds) in a spin loop
+ * with the whole times round it that it would have managed.
+ **************************************************************/
+static void credit_wait(cpu_state *s, long slept){
+  double credit = slept * s->rate;
+  if (credit > s->wait_left)
+    credit = s->wait_left;
+  credit = (int) credit - (int) credit % s->wait_length;
+  s->credited += credit;
+  s->i += credit;
+}
+
+static long clock_ns(clockid_t clock){
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/**************************************************************
+ * Did the instruction at pc just take the branch back to the
+ * top of an idle loop (see XDC_IDLE)?
+ **************************************************************/
+static int idle_branch(xcpu *c, unsigned short pc){
+  xdecoded *d;
+  if (c->decoded == NULL || pc >= c->decoded->limit)
+    return 0;
+  d = &c->decoded->entry[pc];
+  return d->op == XDC_IDLE && d->handler && c->pc <= pc;
+}
+
+/**************************************************************
+ * The CPU has taken the branch back to the top of what looks to
+ * be an idle loop. Step once round it, to make sure that it ends
+ * up just where it began, having read nothing from memory; if so,
+ * nothing but an interrupt can ever get it out, and every time
+ * round is the same as the last, so as many whole times round
+ * as fit before the next event (or the end of the run) can be
+ * skipped at once. The odd few cycles left are run as usual, so
+ * the CPU arrives at the deadline exactly as if it had run them.
+ * A spin loop (spinning) may read memory, so long as nobody else
+ * can write to it before the deadline. With the timer on, the
+ * next interrupt comes in its own time, so the CPU waits for it
+ * just as if it were spinning (see spin_wait); so it does if
+ * nothing at all is due, and only an ipi can get it out (or the
+ * end of the run, with livelock, if it never comes).
+ **************************************************************/
+static void fast_forward(cpu_state *s, int spinning){
+  xmachine *m = s->m;
+  xcpu *c = s->c;
+  unsigned short lastpc;
+  int length, left;
+
+  if (c->state & X_STATE_DEBUG_ON)    // every cycle must be traced
+    return;
+  if (!spinning && (m->config.timer_period
+                    || ((m->ncpu > 1 || m->config.livelock)
+                        && !m->config.quantum && !s->end
+                        && XEVQ_NEXT(&s->events) == XEV_NEVER))){
+    spin_wait(s);
+    return;
+  }
+  lastpc = s->oldpc;                  // kept, if the turn is already over
+  s->i += xspin_probe(c, m->table, burst_length(s), &length, &lastpc);
+  s->oldpc = lastpc;
+  if (length == 0 || (!spinning && c->spin->nwatch > 0))
+    return;
+  left = burst_length(s);
+  left -= left % length;
+  s->i += left;
+  if (!spinning)
+    s->skipped += left;
+  // taking turns, a CPU that waits out the rest of its turn, with nothing
+  // due, will be no different when its next turn comes
+  if (m->config.quantum && s->i >= s->until
+      && XEVQ_NEXT(&s->events) == XEV_NEVER){
+    s->waiting = 1;
+    quiet(s);
+  }
+}
+
+/**************************************************************
+ * With livelock set, the run stops early once no CPU can get any
+ * further: once every CPU has halted, or is waiting in a spin
+ * loop (see spin_wait), and the whole machine -- its memory, and
+ * where each waiting CPU waits, with what in its registers -- is
+ * just as it was the last time they were all seen waiting,
+ * QUIET_ROUNDS times over. Interrupts may still come, so long as
+ * they only send the CPUs back round the same loops, with nothing
+ * to show for it (a kernel whose CPUs all poll an empty run
+ * queue, say). Each CPU checks as it starts to wait, or halts;
+ * the last one to see the machine unchanged wakes the others,
+ * and they all stop, saying where they were spinning.
+ **************************************************************/
+static void quiet(cpu_state *s){
+  xmachine *m = s->m;
+  unsigned long h = 14695981039346656037UL;   // FNV-1a, over the lot
+  int u, k, waiting = 0;
+  xcpu *c;
+
+  if (!m->config.livelock)
+    return;
+  pthread_mutex_lock(&m->lock);
+  for (u = 0; u < m->ncpu; u++){
+    if (!__atomic_load_n(&m->states[u].running, __ATOMIC_SEQ_CST))
+      continue;
+    if (!__atomic_load_n(&m->states[u].waiting, __ATOMIC_SEQ_CST)){
+      pthread_mutex_unlock(&m->lock);
+      return;                         // somebody is still getting on
+    }
+    c = m->states[u].c;
+    h = (h ^ u) * 1099511628211UL;
+    h = (h ^ c->pc) * 1099511628211UL;
+    h = (h ^ c->state) * 1099511628211UL;
+    h = (h ^ c->ipi) * 1099511628211UL;
+    for (k = 0; k < X_MAX_REGS; k++)
+      h = (h ^ c->regs[k]) * 1099511628211UL;
+    waiting++;
+  }
+  if (waiting == 0){                  // they have all halted anyway
+    pthread_mutex_unlock(&m->lock);
+    return;
+  }
+  for (k = 0; k < MEMSIZE; k++)
+    h = (h ^ m->memory[k]) * 1099511628211UL;
+  if (h != m->quiet_hash || m->quiet_rounds == 0){
+    m->quiet_hash = h;
+    m->quiet_rounds = 0;
+  }
+  if (++m->quiet_rounds >= QUIET_ROUNDS && !stuck(m)){
+    __atomic_store_n(&m->quiescent, 1, __ATOMIC_SEQ_CST);
+    for (u = 0; u < m->ncpu; u++)
+      if (&m->states[u] != s && __atomic_load_n(&m->states[u].running,
+                                                __ATOMIC_SEQ_CST))
+        xspin_wake(m->states[u].c);
+  }
+  pthread_mutex_unlock(&m->lock);
+}
+
+// have they all stopped getting anywhere?
+static int stuck(xmachine *m){
+  return __atomic_load_n(&m->quiescent, __ATOMIC_RELAXED);
+}
+
+/**************************************************************
+ * Pin the k-th thread to its host core.
+ **************************************************************/
+static void pin(xmachine *m, pthread_t thread, int k){
+  int core = m->config.cores[k % m->config.ncores];
+  if (xpool_pin(thread, core))
+    fprintf(LOG, "warning: could not pin thread %d to core %d\n", k, core);
+}
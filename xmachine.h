@@ -0,0 +1,267 @@
+#ifndef XMACHINE_H
+#define XMACHINE_H
+
+/**
+ * The machine (xmachine.c): everything it takes to run an X machine -- its
+ * memory, its CPUs, the code they share, the console they write to, and the
+ * threads that run them -- kept together, so that a process may have as
+ * many machines as it likes, each independent of the others, and create
+ * and destroy them as it goes. xmpsim is just one user of it: it makes one
+ * machine from its command line, runs it to the end, and reports on it.
+ *
+ * A machine is created, configured (or left with the defaults), loaded with
+ * an image, and run. A run may be given a budget of cycles, per CPU; once
+ * a CPU has run that many more it is paused, and the next run picks up
+ * where it left off. Anything the CPUs send to the out instruction goes to
+ * stdout, unless a function is given to take it instead (xmachine_output),
+ * and each CPU says why it stopped through another (xmachine_reporter).
+ * Between runs, the machine may be saved to a snapshot (xmachine_save), and
+ * a new machine restored from it, in place of the image, to go on from
+ * there (xmachine_restore): a kernel need only be booted once. The machine
+ * keeps track of which pages of memory (X_PAGES of them, in xcpu.h) its CPUs
+ * write to, so that it can be put back as it was at a checkpoint, or saved
+ * as a delta on the snapshot before, by copying just those pages.
+ **/
+
+typedef struct xmachine xmachine;
+typedef struct xmachine_image xmachine_image;
+
+/* machines run in lockstep at once, at most (xmachine_run_lockstep) */
+#define XMACHINE_LANES 16
+
+/* the execution engines (see xmpsim -e) */
+enum { XMACHINE_TABLE, XMACHINE_THREADED, XMACHINE_JIT };
+
+/* how the CPUs are run, and what they may skip */
+typedef struct xmachine_config {
+  int engine;          /* one of XMACHINE_* */
+  int traced;          /* start in the build of the threaded engine that can
+                          trace */
+  int console;         /* how output is ordered (XOUT_*, in xout.h) */
+  int interrupt_freq;  /* cycles between timer interrupts, 0 for none */
+  int idle_skip;       /* skip the cycles of idle loops */
+  int quantum;         /* take turns on one thread, this many cycles each */
+  unsigned long seed;  /* and vary the turns at random, from this seed */
+  int workers;         /* or share a pool of this many threads (0: one per
+                          host core); -1 for a thread per CPU */
+  int *cores;          /* pin the threads to these host cores, in turn */
+  int ncores;
+  long timer_period;   /* interrupt every CPU this often, in real time
+                          (nanoseconds), 0 for never */
+  int livelock;        /* stop once no CPU can get any further */
+  unsigned char *coverage;  /* count the edges the CPUs take into this map
+                               (XCPU_EDGES bytes, in xcpu.h), or NULL; the
+                               threaded engine only */
+} xmachine_config;
+
+/* why a CPU stopped (see xmachine_reporter) */
+enum {
+  XMACHINE_HALTED,     /* it ran bad (opcode 0x00) */
+  XMACHINE_OUT_OF_TIME,/* it has used up the budget of this run */
+  XMACHINE_SPINNING,   /* it was left spinning (livelock) */
+  XMACHINE_FAULT       /* it took an exception it had no table for */
+};
+
+typedef struct xmachine_stop {
+  int id;                             /* the CPU */
+  int why;                            /* one of the above */
+  int cycles;                         /* cycles run, over every run so far */
+  int skipped;                        /* of which, skipped in idle loops */
+  unsigned short pc;                  /* where it stopped */
+  unsigned short instruction;         /* and the word there */
+} xmachine_stop;
+
+/* title: create/destroy a machine
+ * param: the size of its memory in bytes (0 for MEMSIZE), and its number
+ *        of CPUs
+ * function: the machine starts out with the default configuration, and
+ *           its memory cleared; destroying it writes out anything its
+ *           console still holds
+ * returns: the new machine, or NULL if the memory is not MEMSIZE (an X
+ *          address is always taken modulo MEMSIZE) or there are no CPUs
+ */
+extern xmachine * xmachine_create( int memsize, int ncpu );
+extern void xmachine_destroy( xmachine *m );
+
+/* title: the default configuration, and change it
+ * function: (xmachine_configure) copies the configuration, which must be
+ *           given before the first run; the list of cores must last until
+ *           the machine is destroyed
+ * returns: (xmachine_configure) 0, or -1 if the options do not go together
+ *          (taking turns with a pool of workers, or with the timer; or
+ *          coverage with another engine than the threaded one)
+ */
+extern void xmachine_defaults( xmachine_config *config );
+extern int xmachine_configure( xmachine *m, const xmachine_config *config );
+
+/* title: load an image into memory, from address 0
+ * param: the machine, the image, and its length in bytes
+ * function: must come before the first run, and only once
+ * returns: 0, or -1 if the image is too big to fit
+ */
+extern int xmachine_load( xmachine *m, const unsigned char *image, int len );
+
+/* title: make/unmake an image that many machines can share
+ * param: the image, and its length in bytes
+ * function: the machines loaded from it (xmachine_share) share its pages
+ *           until they write to them, when each gets a copy of its own
+ *           (copy on write); it may be destroyed once they are loaded
+ * returns: the image, or NULL if it is too big, or cannot be made
+ */
+extern xmachine_image * xmachine_image_create( const unsigned char *image,
+                                               int len );
+extern void xmachine_image_destroy( xmachine_image *img );
+
+/* title: load a shared image into memory (instead of xmachine_load)
+ * function: must come before the first run, and only once
+ * returns: 0, or -1 if it cannot be mapped
+ */
+extern int xmachine_share( xmachine *m, const xmachine_image *img );
+
+/* title: save the whole machine to a snapshot, between runs
+ * param: the machine, and the file
+ * function: keeps the memory, and each CPU's registers, cycle counts and
+ *           pending events, for a machine to go on from (xmachine_restore);
+ *           writes out what the console holds first; the file is only
+ *           replaced once the snapshot is written in full
+ * returns: 0, or -1 if the file cannot be written
+ */
+extern int xmachine_save( xmachine *m, const char *file );
+
+/* title: save a delta: just what has changed since the snapshot the
+ *        machine last saved (or was restored from)
+ * param: the machine, and the file
+ * function: as xmachine_save, but only the pages written since are kept,
+ *           with the name of that snapshot, which must be there (as it was)
+ *           whenever the delta is restored
+ * returns: 0, or -1 if the file cannot be written, or there is no snapshot
+ *          for it to add to, or the file is that snapshot
+ */
+extern int xmachine_save_delta( xmachine *m, const char *file );
+
+/* title: restore a machine from a snapshot (instead of loading an image)
+ * param: the machine, created with as many CPUs as the one saved, and the
+ *        file
+ * function: must come after xmachine_configure and xmachine_output, and
+ *           before the first run; the memory is mapped from the file, copy
+ *           on write, so it costs next to nothing however many machines are
+ *           restored from it; the pending events (the periodic interrupt's
+ *           among them) are the snapshot's, and the budget of the next run
+ *           is counted from the cycles the CPUs had run when it was saved;
+ *           a delta is restored from the snapshot it adds to, with its own
+ *           pages copied over; the machine's checkpoint is the snapshot
+ * returns: 0, or -1 if the file (or one it adds to) cannot be read, or is
+ *          not a snapshot (of this version) of a machine with as many CPUs,
+ *          or holds a CPU no machine could have saved (a damaged file), when
+ *          the machine should be destroyed
+ */
+extern int xmachine_restore( xmachine *m, const char *file );
+
+/* title: is the file a snapshot (of this version)?
+ * returns: the number of CPUs of the machine saved in it, or 0 if it is not
+ */
+extern int xmachine_snapshot( const char *file );
+
+/* title: make the machine as it stands its checkpoint, between runs
+ * function: copies just the pages written since the last one (the first
+ *           is where it was loaded, or restored); writes out what the
+ *           console holds first
+ */
+extern void xmachine_checkpoint( xmachine *m );
+
+/* title: put the machine back as it was at its checkpoint, between runs
+ * function: copies back just the pages written since, and the CPUs as they
+ *           were (a CPU halted since runs again)
+ * returns: the number of pages copied
+ */
+extern int xmachine_reset( xmachine *m );
+
+/* title: the machine's memory (MEMSIZE bytes), for looking at or poking
+ * function: never write to code the CPUs may have decoded, unless the
+ *           machine is told (xmachine_wrote); byte MEMSIZE is a copy of
+ *           byte 0 (see MIRROR_SIZE, in xcpu.h), so whatever pokes byte 0
+ *           must poke it too, or tell the machine
+ */
+extern unsigned char * xmachine_memory( xmachine *m );
+
+/* title: tell the machine of a poke, between runs
+ * param: the machine, and the address and length of what was poked (which
+ *        must not go past the end of memory)
+ * function: a reset puts it back (and a delta keeps it); the copy of byte
+ *           0 is brought up to date, and any code decoded from it forgotten
+ */
+extern void xmachine_wrote( xmachine *m, int addr, int n );
+
+/* title: take what the CPUs write to the console
+ * param: the machine; the function to call with arg, the CPU and a byte
+ *        (NULL for stdout), from whatever thread writes the console out
+ * function: must come before the first run
+ */
+extern void xmachine_output( xmachine *m,
+                             void (*out)( void *arg, int id,
+                                          unsigned char ch ),
+                             void *arg );
+
+/* title: hear why each CPU stops
+ * param: the machine; the function to call with arg, from the thread that
+ *        ran the CPU, once its output has all been written out
+ */
+extern void xmachine_reporter( xmachine *m,
+                               void (*stopped)( void *arg,
+                                                const xmachine_stop *stop ),
+                               void *arg );
+
+/* title: run the machine
+ * param: the machine, and the cycles each CPU may run before it is paused
+ *        (0 for no limit)
+ * function: starts the CPUs, on the first run, and runs every one that is
+ *           neither halted nor stuck until it stops, or its budget is
+ *           used up; the machine may be run again after that
+ * returns: the number of CPUs still able to run (0 once they all stopped)
+ */
+extern int xmachine_run( xmachine *m, int budget );
+
+/* title: run many machines, those that can in lockstep
+ * param: the machines, how many, and the budget of each (as for
+ *        xmachine_run), or NULL for no limit
+ * function: as xmachine_run for each in turn, but machines of one CPU,
+ *           configured for the threaded or jit engine with none of the
+ *           timer, idle skipping, workers, tracing, coverage or livelock, are
+ *           run up to XMACHINE_LANES at a time in lockstep, sharing the
+ *           decoding of their code, and the arithmetic of each instruction
+ *           while they agree on where they are (best when they share an
+ *           image); what each outputs and reports is just as it would be
+ * returns: the number of CPUs, over all of them, still able to run
+ */
+extern int xmachine_run_lockstep( xmachine **m, int n, const int *budget );
+
+/* title: raise an exception on a CPU, from outside
+ * param: the machine, the CPU, and the exception (X_E_*, in xcpu.h)
+ * function: the CPU takes it before its next burst (waking from a wait for
+ *           it), unless it is already in an exception; may be called from
+ *           any thread, while the machine runs or not
+ */
+extern void xmachine_interrupt( xmachine *m, int id, unsigned int ex );
+
+/* title: did the last run stop early, with the machine stuck (livelock)?
+ */
+extern int xmachine_stuck( xmachine *m );
+
+/* title: put off a CPU's periodic interrupt, between runs
+ * param: the machine, the CPU, and the cycles to put it off by
+ * function: shifts the phase of the CPU's timer (see interrupt_freq): the
+ *           next interrupt, and every one after it, falls due so many
+ *           cycles later; a reset puts it back as it was at the checkpoint
+ * returns: 1, or 0 if the CPU has no periodic interrupt to put off
+ */
+extern int xmachine_delay_timer( xmachine *m, int id, int cycles );
+
+/* title: hash the machine as it stands, between runs
+ * function: over its memory, and each CPU's registers, pc, state, table and
+ *           whether it still runs; not over the cycles run, nor the events
+ *           pending, so that machines that end up the same hash the same
+ * returns: the hash (FNV-1a)
+ */
+extern unsigned long xmachine_hash( xmachine *m );
+
+#endif
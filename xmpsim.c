@@ -5,40 +5,13 @@
 #include <string.h>
 #include <pthread.h> // check for multiple def errors
 #include <assert.h>
+#include <time.h>
+#include <limits.h>
 #include "xcpu.h"
 #include "xdb.h"
-
-/**
- * MOREDEBUG turns on a host of helpful debugging features, which I 
- * gradually pieced together for my own benefit, in trying to get 
- * this programme to run. Features actived by the MOREDEBUG macro
- * switch are: a pretty and much-improved xcpu_print called 
- * xcpu_pretty_print, on-the-fly natural language disassembly and
- * running commentary on the active instruction in each cycle, and
- * a cycle counter. The default channel for all of this is stderr,
- * leaving stdout unsullied, and still usable for comparing with the
- * output of xsim_gold. To temporarily turn off the MOREDEBUG features,
- * just redirect stderr to /dev/null on the command line. To more 
- * permanently turn it off, just switch it to 0 below and recompile. 
- * For an optimised version of xcpu, I may consider trimming the fat
- * and commenting out all of the MOREDEBUG features, since, taken
- * together, they linearly increase the runtime relative to the number
- * of cycles (since, even when deactived, they mean another if-statement
- * or two to evaluate for every machine instruction). Since this cpu is
- * being developed for experimentation rather than for speed, however, 
- * it seems advisable to leave the MOREDEBUG features intact.  
- * 
- * UPDATE: MOREDEBUG is no longer interpreted as boolean. It selects the 
- *         CPU for which debugging info is desired. If set to -1, all CPUs
- *         will be attended to (-1 is the new 1). If set to -2, no CPUs will.
- **/
-
-// There seems to be a data corruption issue when interrupts are frequent and
-// multiple threads are being used. This is probably due to stack overflow.
-// check to make sure that the lock functions are clearing the stack? but gold
-// doesn't have this problem... so it's probably in the C code. 
-
-#define MOREDEBUG -2
+#include "xout.h"
+#include "xpool.h"
+#include "xmachine.h"
 
 #define CYCLE_ARG 1
 #define IMAGE_ARG 2
@@ -49,35 +22,140 @@
 #define DEFAULT_CPU 1
 #define DEFAULT_INTERRUPT 0
 #define DEFAULT_CYCLES 0
+#define MAX_SAVES 16
+
+/**
+ * xmpsim builds a single machine (see xmachine.h) from its command line,
+ * runs it to the end, and says why each CPU stopped. The engine is chosen
+ * with -e table, -e threaded or -e jit; -t starts every CPU in the build of
+ * the threaded engine that can trace.
+ *
+ * -S cycle:file saves the machine to a snapshot once each CPU has run that
+ * many cycles, and runs on; -R takes <filename> to be such a snapshot, to
+ * go on from, rather than an image, so that a kernel's start-up need only
+ * be run once. <cycles> are then counted from the snapshot's. Going on
+ * from a snapshot is just like running on after it was saved (with -q, the
+ * turns may fall differently from those of one unbroken run, as they do
+ * whenever a run is broken in two). -S may be given again, for later
+ * cycles (up to MAX_SAVES in all): each snapshot after the first is saved
+ * as a delta on the one before (see xmachine_save_delta), holding just the
+ * pages written since.
+ **/
 
 void init_cpu(xcpu *c);
 FILE* load_file(char *filename);
 int load_programme(unsigned char *mem, FILE *fd);
 void shutdown(xcpu *c);
-static void * execution_loop(void *);
 
-/** GLOBAL VARIABLES (NECESSARY EVILS) **/
+static void stopped(void *arg, const xmachine_stop *stop);
+static int parse_engine(char *name);
 
-// build the jump table of instruction-function pointers 
-IHandler *table;
-int cycles, interrupt_freq, cpu_num;
+/** GLOBAL VARIABLES (NECESSARY EVILS) **/
 
-// The memory to be shared among all CPUs/threads. 
-unsigned char *mem; 
+xmachine_config config;  // how the machine is to run (set by the switches)
+long idle_skipped = 0;   // how many idle cycles were skipped (-f), over all
+                         // the CPUs
+int save_at[MAX_SAVES];  // save a snapshot after this many cycles (-S),
+char *save_file[MAX_SAVES];  // to this file
+int nsaves = 0;
+int restoring = 0;       // the image is a snapshot to go on from (-R)
+int saving = 0;          // running up to the snapshot: keep quiet about the
+                         // end of the run
 
 /***************************************************************************/
 
 int main(int argc, char *argv[]){
+  int opt, cycles, interrupt_freq, cpu_num;
+  xmachine_defaults(&config);
+  // parse command-line switches, which precede the positional arguments
+  while ((opt = getopt(argc, argv, "+a:e:flo:p:q:r:stw:RS:")) != -1){
+    switch (opt){
+    case 'a':   // pin the threads to host cores ("all", or a list: "0-3,8")
+      if ((config.ncores = xpool_cores(optarg, &config.cores)) <= 0){
+        char msg[80] = "error: bad list of host cores ";
+        strncat(msg, optarg, 30);
+        fatal(msg);
+      }
+      break;
+    case 'e':
+      config.engine = parse_engine(optarg);
+      break;
+    case 'f':   // fast-forward through idle loops, to the next interrupt
+      config.idle_skip = 1;
+      break;
+    case 'l':   // stop early, once every CPU is halted or stuck spinning
+      config.livelock = 1;
+      break;
+    case 'o':   // how the output of the CPUs is buffered and ordered
+      if ((config.console = xout_policy(optarg)) < 0){
+        char msg[80] = "error: unknown output policy ";
+        strncat(msg, optarg, 30);
+        fatal(msg);
+      }
+      break;
+    case 'p':   // interrupt every CPU this often, by the clock on the wall
+      if ((config.timer_period = atol(optarg) * 1000L) <= 0)
+        fatal("error: the timer period must be at least 1 microsecond");
+      break;
+    case 'q':   // run every CPU on this thread, taking turns
+      if ((config.quantum = atoi(optarg)) <= 0)
+        fatal("error: the quantum must be at least 1");
+      break;
+    case 'r':   // the seed for the lengths of the turns
+      config.seed = strtoul(optarg, NULL, 0);
+      break;
+    case 's':   // report how often the fused instruction pairs ran
+      xcpuj_fusion_stats = 1;
+      break;
+    case 't':   // use the build of the threaded engine that can trace
+      config.traced = 1;
+      break;
+    case 'w':   // run the CPUs a slice at a time on a pool of threads
+      if ((config.workers = atoi(optarg)) < 0)
+        fatal("error: the number of workers must be at least 0");
+      break;
+    case 'R':   // go on from a snapshot, rather than start from an image
+      restoring = 1;
+      break;
+    case 'S':   // save a snapshot at this cycle, to this file
+      if (nsaves == MAX_SAVES)
+        fatal("error: too many snapshots (-S)");
+      save_at[nsaves] = atoi(optarg);
+      if (save_at[nsaves] <= (nsaves? save_at[nsaves-1] : 0)
+          || (save_file[nsaves] = strchr(optarg, ':')) == NULL
+          || !*++save_file[nsaves])
+        fatal("error: -S takes a cycle (at least 1, and later than the one"
+              " before) and a file: cycle:file");
+      nsaves++;
+      break;
+    default:
+      argc = 1; // print the usage message
+      break;
+    }
+  }
+  if (config.quantum && config.workers >= 0)
+    fatal("error: -q and -w cannot be used together");
+  if (config.quantum && config.timer_period)
+    fatal("error: -q and -p cannot be used together");
+  argv[optind-1] = argv[0];
+  argc -= optind-1;
+  argv += optind-1;
+
   // parse command-line options
   cycles = (argc >= CYCLE_ARG+2)? atoi(argv[CYCLE_ARG]) : DEFAULT_CYCLES;
   interrupt_freq = (argc >= INTERRUPT_ARG+1)? atoi(argv[INTERRUPT_ARG])
     : DEFAULT_INTERRUPT;
   cpu_num = (argc >= CPU_ARG+1)? atoi(argv[CPU_ARG]) : DEFAULT_CPU;
   if (argc == 1){
-    fprintf(LOG,"Usage: %s <cycles> <filename> <interrupt frequency>"
-            " <number of CPUs>\n",
+    fprintf(LOG,"Usage: %s [-a all|cores] [-e table|threaded|jit] [-f] [-l]"
+            " [-o direct|seq|cpu] [-p microseconds]"
+            " [-q quantum [-r seed]] [-s] [-t] [-w workers] [-R]"
+            " [-S cycle:file ...] <cycles> <filename>"
+            " <interrupt frequency> <number of CPUs>\n",
             argv[0]);
     exit(EXIT_FAILURE);
+  } else if (cycles && nsaves && save_at[nsaves-1] > cycles){
+    fatal("error: the snapshot (-S) must be saved by the end of the run");
   } else if (argc != EXPECTED_ARGC){
     char cyc[15];
     sprintf(cyc, "%d", cycles);
@@ -89,108 +167,104 @@ int main(int argc, char *argv[]){
     getchar();
   }
 
-  FILE *fd= (argc >= IMAGE_ARG+1)? load_file(argv[IMAGE_ARG]) :
-    load_file(argv[IMAGE_ARG-1]);
+  char *filename = (argc >= IMAGE_ARG+1)? argv[IMAGE_ARG] : argv[IMAGE_ARG-1];
+  FILE *fd = load_file(filename);
 
   /**** Now, the interesting modification: create cpu_num different cpu
         contexts, and spin a separate thread to execute each one, in a loop. 
-        You might want a separate function for this. ****/
-
-  table = build_jump_table();
-  //xcpu c[cpu_num];
-  xcpu * c;
-  c = (xcpu *) calloc(cpu_num, sizeof(xcpu));
-  mem = calloc(MEMSIZE, sizeof(unsigned char));
-  load_programme(mem, fd);
-
-  pthread_t threads[cpu_num];
-  int tsignal;  
-  int u;
-
-  /** Now initialize each CPU, in sequence. **/
-  for (u = 0; u < cpu_num; u++){
-    c[u].memory = mem;
-    c[u].num = cpu_num;
-    c[u].id = u;
-    }
+        The machine does all of that; all that is left is to set it up. ****/
 
-  /** Now spin the threads. Each CPU gets one. **/
-  for (u = 0; u < cpu_num; u++){
-    if (pthread_create(&threads[u], NULL, execution_loop, (void *) (c+u))){
-      fprintf(stderr, "Thread %d not okay. Error signal: %d\n", u, tsignal);
-      exit(EXIT_FAILURE);
+  xmachine *m = xmachine_create(0, cpu_num);
+  if (m == NULL)
+    fatal("error: the number of CPUs must be at least 1");
+  config.interrupt_freq = interrupt_freq;
+  xmachine_configure(m, &config);
+  if (restoring){
+    fclose(fd);
+    if (xmachine_restore(m, filename)){
+      char msg[80] = "error: not a snapshot of as many CPUs: ";
+      strncat(msg, filename, 30);
+      fatal(msg);
     }
+  } else {
+    unsigned char *image = calloc(MEMSIZE, sizeof(unsigned char));
+    xmachine_load(m, image, load_programme(image, fd));
+    free(image);
   }
+  xmachine_reporter(m, stopped, NULL);
 
-  /** Wait for the threads to come home. **/
-  int join_count = 0;
-  for (u = cpu_num-1; u >= 0; u--){
-    join_count += !pthread_join(threads[u], NULL);
-  }
-
-  // Check for !errors:
-  if (join_count == cpu_num){
-    free(mem);
-  } else {
-    fprintf(LOG, "join count = %d of %d expected\n",join_count, cpu_num);
+  /** Now run every CPU to the end (by way of the snapshots, if there are
+      to be any), and say why each stopped. **/
+  int k, done = 0, running = 1;
+  for (k = 0; k < nsaves && running; k++){
+    saving = (save_at[k] != cycles);
+    running = xmachine_run(m, save_at[k] - done);
+    if ((k == 0)? xmachine_save(m, save_file[k])
+                : xmachine_save_delta(m, save_file[k])){
+      char msg[80] = "error: could not save the snapshot to ";
+      strncat(msg, save_file[k], 30);
+      fatal(msg);
+    }
+    done = save_at[k];
   }
-  
-  /** Now free the jump table. **/
-  destroy_jump_table(table);
+  saving = 0;
+  if (running && (cycles == 0 || done < cycles))
+    xmachine_run(m, (cycles)? cycles - done : 0);
+  int stuck = xmachine_stuck(m);
+  xmachine_destroy(m);
+  if (stuck)
+    fprintf(LOG, "\n<stopped early: every CPU had halted, or was spinning"
+            " on memory that no longer changed>\n");
+  if (config.idle_skip)
+    fprintf(LOG, "\n<%ld idle cycles skipped in all>\n", idle_skipped);
+  if (xcpuj_fusion_stats)
+    xcpuj_fusion_report(LOG);
+  free(config.cores);
   pthread_exit(NULL);
 }
 
 /**************************************************************
- * The central execution loop
+ * Say why a CPU stopped (called from the thread that ran it).
  **************************************************************/
-static void * execution_loop(void * cpu){ // expects pointer to an xcpu struct
-  xcpu *c = (xcpu *) cpu; // we need our parameter back in the form of an xcpu*
+static void stopped(void *arg, const xmachine_stop *stop){
   char graceful[40];    
   char out_of_time[40];
-  sprintf(graceful, "CPU %d has halted", c->id);
-  sprintf(out_of_time, "CPU ran %d out of time", c->id);
-  int halted[c->num], j, i[c->num]; // deprecate halted?
-  // let's have each thread keep its own cycle counter.
-  for (j=0; j < c->num; j++){
-    i[j]=0;
-    halted[j] = 0;
-  }
-
-  int oldpc[c->num]; // holds previous programme counter
-  
-  while ( i[c->id] < cycles || !cycles){
-     if (MOREDEBUG == -1 || MOREDEBUG == c->id)
-       fprintf(LOG, "<CYCLE %d> <CPU %d>\n",i[c->id],c->id);
-     // if not in 1st cycle, & interrupts are set, then interrupt periodically
-    if (i[c->id] != 0 && interrupt_freq != 0 && i[c->id] % interrupt_freq == 0){
-      if (!xcpu_exception(c, X_E_INTR)){
-        fprintf(stderr, "Exception error at 0x%4.4x. CPU has halted.\n",
-                c->pc);
-        return NULL;
-      }
-    }
-    
-    oldpc[c->id] = c->pc; // save current instruction for error reporting
+  char spinning[40];
+  sprintf(graceful, "CPU %d has halted", stop->id);
+  sprintf(out_of_time, "CPU ran %d out of time", stop->id);
+  sprintf(spinning, "CPU %d was left spinning", stop->id);
 
-    // Now, call xcpu_execute function to perform the instruction at c->pc.
-
-    halted[c->id] = !xcpu_execute(c,table); 
-       
-    if (MOREDEBUG == c->id || MOREDEBUG == -1){
-      LOCK(elk);
-      xcpu_pretty_print(c);
-      UNLOCK(elk);
-    }
-
-    if (halted[c->id]) break;
-    i[c->id] ++;
+  if (saving && stop->why == XMACHINE_OUT_OF_TIME)
+    return;
+  if (stop->why == XMACHINE_FAULT){
+    fprintf(stderr, "Exception error at 0x%4.4x. CPU has halted.\n",
+            stop->pc);
+    return;
   }
-  
-  char *exit_msg = (halted[c->id])? graceful : out_of_time;
+  char *exit_msg = (stop->why == XMACHINE_HALTED)? graceful
+    : (stop->why == XMACHINE_SPINNING)? spinning : out_of_time;
   fprintf(LOG, "\n<%s after %d cycles at PC = %4.4x : %4.4x>\n",
-          exit_msg, i[c->id], oldpc[c->id], FETCH_WORD(oldpc[c->id]));
-  //  disas(c);
-  return NULL;
+          exit_msg, stop->cycles, stop->pc, stop->instruction);
+  if (config.idle_skip){
+    fprintf(LOG, "<CPU %d skipped %d idle cycles>\n", stop->id, stop->skipped);
+    __atomic_add_fetch(&idle_skipped, stop->skipped, __ATOMIC_RELAXED);
+  }
+}
+
+/**************************************************************
+ * Map the argument of the -e switch onto one of the engines.
+ **************************************************************/
+static int parse_engine(char *name){
+  if (!strcmp(name, "table"))
+    return XMACHINE_TABLE;
+  if (!strcmp(name, "threaded"))
+    return XMACHINE_THREADED;
+  if (!strcmp(name, "jit"))
+    return XMACHINE_JIT;
+  char msg[80] = "error: unknown engine ";
+  strncat(msg, name, 30);
+  fatal(msg);
+  return -1;
 }
 
 FILE* load_file(char* filename){
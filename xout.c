@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "xout.h"
+
+/**
+ * Each ring has a single producer (its CPU) and a single consumer (the
+ * writer), so no lock is needed to move bytes through it: the CPU fills in
+ * bytes up to pending, and publishes them by moving tail up to pending; the
+ * writer copies out everything between head and tail, and then moves head
+ * up to free the space. The counters only ever go up, and are taken modulo
+ * XOUT_RING to index the ring. The console lock is only taken to wake the
+ * writer, or to wait for it.
+ **/
+typedef struct xring {
+  unsigned int head;                  /* next byte for the writer */
+  unsigned int tail;                  /* end of the published bytes */
+  unsigned int pending;               /* end of the bytes written (CPU only) */
+  unsigned char data[XOUT_RING];
+  unsigned long seq[XOUT_RING];       /* number of each byte (XOUT_SEQ) */
+} xring;
+
+struct xout {
+  int policy;
+  int ncpu;
+  xring *ring;                        /* one per CPU */
+  unsigned long seq;                  /* bytes numbered so far (XOUT_SEQ) */
+  unsigned long next;                 /* number of the next byte due out */
+  int kicked;                         /* the writer has work waiting */
+  int done;                           /* the CPUs have all stopped */
+  void (*sink)(void *, int, unsigned char);  /* takes the bytes, if not */
+  void *sink_arg;                            /* stdout */
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;                /* signalled to wake the writer */
+  pthread_cond_t drained;             /* broadcast after each pass */
+};
+
+// how long the writer sleeps, if nobody wakes it (nanoseconds)
+#define XOUT_NAP 10000000L
+
+// hand a byte of CPU id on, to stdout or the sink
+#define EMIT(o, id, ch)                                         \
+  ((o)->sink? (o)->sink((o)->sink_arg, (id), (ch))              \
+            : (void) putc_unlocked((ch), stdout))
+
+/******************************************************************
+   Copy whatever has been published to stdout (or the sink),
+   keeping to the policy. Returns the number of bytes copied.
+******************************************************************/
+static int pass(xout *o){
+  unsigned int h, t;
+  int k, n = 0, moved;
+  xring *r;
+
+  if (o->policy == XOUT_CPU){
+    for (k = 0; k < o->ncpu; k++){
+      r = &o->ring[k];
+      h = r->head;
+      t = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+      for (; h != t; h++, n++)
+        EMIT(o, k, r->data[h % XOUT_RING]);
+      __atomic_store_n(&r->head, h, __ATOMIC_RELEASE);
+    }
+  } else {
+    // only ever let out the byte numbered next, wherever it is
+    do {
+      moved = 0;
+      for (k = 0; k < o->ncpu; k++){
+        r = &o->ring[k];
+        h = r->head;
+        t = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        for (; h != t && r->seq[h % XOUT_RING] == o->next; h++, o->next++){
+          EMIT(o, k, r->data[h % XOUT_RING]);
+          moved++;
+        }
+        __atomic_store_n(&r->head, h, __ATOMIC_RELEASE);
+      }
+      n += moved;
+    } while (moved);
+  }
+  if (n && !o->sink)
+    fflush(stdout);
+  return n;
+}
+
+/******************************************************************
+   The writer thread: copy out whatever is waiting, then nap until
+   woken (or until the nap runs out), until the CPUs have stopped.
+******************************************************************/
+static void * writer(void *arg){
+  xout *o = (xout *) arg;
+  struct timespec until;
+  int done;
+
+  do {
+    pass(o);
+    pthread_mutex_lock(&o->lock);
+    pthread_cond_broadcast(&o->drained);
+    if (!o->kicked && !o->done){
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += XOUT_NAP;
+      if (until.tv_nsec >= 1000000000L){
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&o->wake, &o->lock, &until);
+    }
+    __atomic_store_n(&o->kicked, 0, __ATOMIC_RELAXED);
+    done = o->done;
+    pthread_mutex_unlock(&o->lock);
+  } while (!done);
+  pass(o);
+  return NULL;
+}
+
+// wake the writer, unless somebody already has (only then is the lock taken)
+static void kick(xout *o){
+  if (__atomic_load_n(&o->kicked, __ATOMIC_RELAXED))
+    return;
+  pthread_mutex_lock(&o->lock);
+  __atomic_store_n(&o->kicked, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&o->wake);
+  pthread_mutex_unlock(&o->lock);
+}
+
+// make everything the CPU has written visible to the writer
+#define PUBLISH(r)  __atomic_store_n(&(r)->tail, (r)->pending, __ATOMIC_RELEASE)
+
+xout * xout_create(int policy, int ncpu){
+  xout *o = malloc(sizeof(xout));
+  // the rings are only wanted if a writer thread is to empty them
+  if (o == NULL
+      || (policy != XOUT_DIRECT
+          && (o->ring = calloc(ncpu, sizeof(xring))) == NULL)){
+    fprintf(stderr, "FAILURE IN <xout_create>: OUT OF MEMORY\n");
+    exit(EXIT_FAILURE);
+  }
+  if (policy == XOUT_DIRECT)
+    o->ring = NULL;
+  o->policy = policy;
+  o->ncpu = ncpu;
+  o->seq = o->next = 0;
+  o->kicked = o->done = 0;
+  o->sink = NULL;
+  o->sink_arg = NULL;
+  pthread_mutex_init(&o->lock, NULL);
+  pthread_cond_init(&o->wake, NULL);
+  pthread_cond_init(&o->drained, NULL);
+  if (policy != XOUT_DIRECT
+      && pthread_create(&o->writer, NULL, writer, (void *) o)){
+    fprintf(stderr, "FAILURE IN <xout_create>: NO WRITER THREAD\n");
+    exit(EXIT_FAILURE);
+  }
+  return o;
+}
+
+void xout_destroy(xout *o){
+  int k;
+  if (o->policy != XOUT_DIRECT){
+    for (k = 0; k < o->ncpu; k++)
+      PUBLISH(&o->ring[k]);
+    pthread_mutex_lock(&o->lock);
+    o->done = 1;
+    pthread_cond_signal(&o->wake);
+    pthread_mutex_unlock(&o->lock);
+    pthread_join(o->writer, NULL);
+  }
+  fflush(stdout);
+  pthread_cond_destroy(&o->drained);
+  pthread_cond_destroy(&o->wake);
+  pthread_mutex_destroy(&o->lock);
+  free(o->ring);
+  free(o);
+}
+
+void xout_sink(xout *o, void (*sink)(void *arg, int id, unsigned char ch),
+               void *arg){
+  o->sink = sink;
+  o->sink_arg = arg;
+}
+
+void xout_putc(xout *o, int id, unsigned char ch){
+  xring *r;
+  unsigned int i;
+
+  if (o == NULL || o->policy == XOUT_DIRECT){
+    if (o && o->sink)
+      o->sink(o->sink_arg, id, ch);
+    else
+      fprintf(stdout, "%c", ch);
+    return;
+  }
+  r = &o->ring[id];
+  // wait for the writer to make room, if need be
+  if (r->pending - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == XOUT_RING){
+    // (a part line is only let go if there are no whole ones to make room)
+    if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail)
+      PUBLISH(r);
+    pthread_mutex_lock(&o->lock);
+    __atomic_store_n(&o->kicked, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&o->wake);
+    while (r->pending - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)
+           == XOUT_RING)
+      pthread_cond_wait(&o->drained, &o->lock);
+    pthread_mutex_unlock(&o->lock);
+  }
+  i = r->pending++ % XOUT_RING;
+  r->data[i] = ch;
+  if (o->policy == XOUT_SEQ){
+    // numbered bytes are published at once, lest they hold up the others
+    r->seq[i] = __atomic_fetch_add(&o->seq, 1, __ATOMIC_RELAXED);
+    PUBLISH(r);
+  } else if (ch == '\n' || r->pending - r->tail >= XOUT_RING/2){
+    // whole lines only, unless the line will not fit
+    PUBLISH(r);
+  }
+  if (ch == '\n'
+      || r->pending - __atomic_load_n(&r->head, __ATOMIC_RELAXED)
+         >= XOUT_BATCH)
+    kick(o);
+}
+
+void xout_printf(xout *o, int id, const char *format, ...){
+  char line[256];
+  va_list args;
+  int k, n;
+
+  va_start(args, format);
+  if (o == NULL || (o->policy == XOUT_DIRECT && !o->sink)){
+    vfprintf(stdout, format, args);
+  } else {
+    n = vsnprintf(line, sizeof(line), format, args);
+    for (k = 0; k < n && k < sizeof(line)-1; k++)
+      xout_putc(o, id, line[k]);
+  }
+  va_end(args);
+}
+
+void xout_drain(xout *o, int id){
+  xring *r;
+
+  if (o == NULL || o->policy == XOUT_DIRECT){
+    fflush(stdout);
+    return;
+  }
+  r = &o->ring[id];
+  PUBLISH(r);
+  pthread_mutex_lock(&o->lock);
+  __atomic_store_n(&o->kicked, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&o->wake);
+  while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->pending)
+    pthread_cond_wait(&o->drained, &o->lock);
+  pthread_mutex_unlock(&o->lock);
+}
+
+int xout_policy(const char *name){
+  if (!strcmp(name, "direct"))
+    return XOUT_DIRECT;
+  if (!strcmp(name, "seq"))
+    return XOUT_SEQ;
+  if (!strcmp(name, "cpu"))
+    return XOUT_CPU;
+  return -1;
+}
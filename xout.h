@@ -0,0 +1,63 @@
+#ifndef XOUT_H
+#define XOUT_H
+
+/**
+ * The console (xout.c): rather than have every CPU take the stdio lock for
+ * each byte it sends to the out instruction, each CPU puts its bytes in a
+ * ring of its own, and a writer thread copies them to stdout in batches.
+ * A CPU wakes the writer when it writes a newline, or once a good few bytes
+ * have piled up; otherwise the writer looks in every so often.
+ *
+ * The order in which the bytes reach stdout is up to the policy:
+ *   XOUT_DIRECT  no buffering at all: each byte goes straight to stdout, as
+ *                it always did (best for interactive debugging)
+ *   XOUT_SEQ     bytes are numbered as they are written, across all CPUs,
+ *                and come out in that order, just as with XOUT_DIRECT
+ *   XOUT_CPU     each CPU's output comes out a line (or a batch) at a time,
+ *                so that lines from different CPUs are never mixed up
+ **/
+enum { XOUT_DIRECT, XOUT_SEQ, XOUT_CPU };
+
+#define XOUT_RING 4096                /* bytes buffered per CPU */
+#define XOUT_BATCH 512                /* wake the writer once this many wait */
+
+typedef struct xout xout;
+
+/* title: create/destroy a console
+ * param: the ordering policy (XOUT_*), and the number of CPUs
+ * function: starts the writer thread, unless the policy is XOUT_DIRECT;
+ *           destroying it writes out anything still buffered (the CPUs
+ *           must all have stopped by then)
+ * returns: the new console (exits on failure)
+ */
+extern xout * xout_create( int policy, int ncpu );
+extern void xout_destroy( xout *o );
+
+/* title: send the console's bytes to a function, rather than stdout
+ * param: the console, and the function to call with arg, the CPU and a
+ *        byte (from the writer thread, unless the policy is XOUT_DIRECT)
+ * function: must come before anything is written
+ */
+extern void xout_sink( xout *o, void (*sink)( void *arg, int id,
+                                               unsigned char ch ),
+                       void *arg );
+
+/* title: write to the console on behalf of CPU id
+ * param: the console (if NULL, straight to stdout), the CPU, and a byte,
+ *        or a format and its arguments, as for printf
+ * function: used by the out instruction, and by the trace (xcpu_print), so
+ *           that the two still come out in the right order
+ */
+extern void xout_putc( xout *o, int id, unsigned char ch );
+extern void xout_printf( xout *o, int id, const char *format, ... );
+
+/* title: wait until everything CPU id has written has reached stdout
+ */
+extern void xout_drain( xout *o, int id );
+
+/* title: map the name of a policy onto one of XOUT_*
+ * returns: the policy, or -1 if there is no such policy
+ */
+extern int xout_policy( const char *name );
+
+#endif
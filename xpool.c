@@ -0,0 +1,442 @@
+#define _GNU_SOURCE                   // for the affinity of threads
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "xpool.h"
+
+/**
+ * Each task is in exactly one of four places: on a deque, waiting for a
+ * worker; being run by a worker; parked; or done. Only the worker that
+ * took a task off a deque can move it on from there, except that a parked
+ * task may be woken by anybody (by whichever CPU stores to what it waits
+ * on, for one), so parking and waking go under the pool lock. So does
+ * going to sleep: an idle worker sleeps on the pool's condition until a
+ * task is queued, or the earliest deadline of the parked tasks is up, or
+ * the tasks are all done. The number of queued tasks and of sleeping
+ * workers are each bumped before the other is looked at, so that a worker
+ * cannot go to sleep just as a task is queued without being woken for it.
+ *
+ * A task is only parked once it has been armed (made ready to be woken),
+ * and nobody else may take it while it is being armed (ARMING): a wake
+ * that comes in the meantime is kept (WOKEN), and the worker arming it
+ * queues it again as soon as it is done.
+ **/
+enum { QUEUED, TAKEN, ARMING, WOKEN, PARKED, DONE };
+
+typedef struct xworker {
+  struct xpool *pool;
+  int id;
+  pthread_t thread;
+  pthread_mutex_t lock;               /* guards the deque */
+  int *slot;                          /* the deque: a ring of task ids */
+  int head, count;
+} xworker;
+
+struct xpool {
+  xpool_ops *ops;
+  void *arg;
+  int ntasks;
+  int nworkers;
+  xworker *worker;
+  int *state;                         /* where each task is (QUEUED...) */
+  long *deadline;                     /* when each parked task wakes anyway */
+  long earliest;                      /* the soonest of them (LONG_MAX: none) */
+  int queued;                         /* tasks on the deques */
+  int sleepers;                       /* workers asleep on wake */
+  int live;                           /* tasks not yet done */
+  int *cores;                         /* where to pin the workers, or NULL */
+  int ncores;
+  pthread_mutex_t lock;               /* guards state, deadline and sleeping */
+  pthread_cond_t wake;
+};
+
+// the worker that the calling thread is, if any
+static __thread xworker *current = NULL;
+
+static long now_ns(void){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+/******************************************************************
+   Put task id on the back of worker w's deque. Returns nonzero if
+   a worker is asleep, and should be woken to take it.
+******************************************************************/
+static int push(xworker *w, int id){
+  xpool *p = w->pool;
+  __atomic_store_n(&p->state[id], QUEUED, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&w->lock);
+  w->slot[(w->head + w->count++) % p->ntasks] = id;
+  pthread_mutex_unlock(&w->lock);
+  __atomic_add_fetch(&p->queued, 1, __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&p->sleepers, __ATOMIC_SEQ_CST);
+}
+
+// the same, from outside the pool lock
+static void queue(xworker *w, int id){
+  xpool *p = w->pool;
+  if (push(w, id)){
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/******************************************************************
+   Take a task off the front of worker w's own deque, or else off
+   the back of somebody else's. Returns its id, or -1 if every
+   deque is empty.
+******************************************************************/
+static int take(xworker *w){
+  xpool *p = w->pool;
+  xworker *v;
+  int k, id = -1;
+
+  if (!__atomic_load_n(&p->queued, __ATOMIC_SEQ_CST))
+    return -1;
+  pthread_mutex_lock(&w->lock);
+  if (w->count){
+    id = w->slot[w->head];
+    w->head = (w->head + 1) % p->ntasks;
+    w->count--;
+  }
+  pthread_mutex_unlock(&w->lock);
+  for (k = 1; id < 0 && k < p->nworkers; k++){
+    v = &p->worker[(w->id + k) % p->nworkers];
+    if (!__atomic_load_n(&v->count, __ATOMIC_RELAXED))
+      continue;
+    pthread_mutex_lock(&v->lock);
+    if (v->count)
+      id = v->slot[(v->head + --v->count) % p->ntasks];
+    pthread_mutex_unlock(&v->lock);
+  }
+  if (id >= 0){
+    __atomic_sub_fetch(&p->queued, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&p->state[id], TAKEN, __ATOMIC_RELAXED);
+  }
+  return id;
+}
+
+/******************************************************************
+   Wake every parked task whose deadline is up, onto w's deque.
+   Call with the pool lock held.
+******************************************************************/
+static void expire(xworker *w){
+  xpool *p = w->pool;
+  long now = now_ns(), earliest = LONG_MAX;
+  int k;
+
+  if (now < p->earliest)
+    return;
+  for (k = 0; k < p->ntasks; k++){
+    if (p->state[k] != PARKED)
+      continue;
+    if (p->deadline[k] <= now){
+      if (push(w, k))
+        pthread_cond_signal(&p->wake);
+    } else if (p->deadline[k] < earliest){
+      earliest = p->deadline[k];
+    }
+  }
+  __atomic_store_n(&p->earliest, earliest, __ATOMIC_RELAXED);
+}
+
+/******************************************************************
+   Sleep until there may be something to do: a task queued, a
+   deadline up, or the end of it all.
+******************************************************************/
+static void nap(xworker *w){
+  xpool *p = w->pool;
+  struct timespec until;
+
+  pthread_mutex_lock(&p->lock);
+  expire(w);
+  __atomic_add_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&p->queued, __ATOMIC_SEQ_CST) && p->live){
+    if (p->earliest == LONG_MAX){
+      pthread_cond_wait(&p->wake, &p->lock);
+    } else {
+      until.tv_sec = p->earliest / 1000000000L;
+      until.tv_nsec = p->earliest % 1000000000L;
+      pthread_cond_timedwait(&p->wake, &p->lock, &until);
+    }
+  }
+  __atomic_sub_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/******************************************************************
+   A worker thread: run slices until every task is done.
+******************************************************************/
+static void * work(void *arg){
+  xworker *w = (xworker *) arg;
+  xpool *p = w->pool;
+  long deadline;
+  int id, armed;
+
+  current = w;
+  if (p->cores && xpool_pin(pthread_self(), p->cores[w->id % p->ncores]))
+    fprintf(stderr, "warning: could not pin worker %d to core %d\n",
+            w->id, p->cores[w->id % p->ncores]);
+  while (__atomic_load_n(&p->live, __ATOMIC_ACQUIRE)){
+    if (__atomic_load_n(&p->earliest, __ATOMIC_RELAXED) <= now_ns()){
+      pthread_mutex_lock(&p->lock);
+      expire(w);
+      pthread_mutex_unlock(&p->lock);
+    }
+    if ((id = take(w)) < 0){
+      nap(w);
+      continue;
+    }
+    switch (p->ops->slice(p->arg, id, &deadline)){
+    case XPOOL_AGAIN:
+      queue(w, id);
+      break;
+    case XPOOL_PARK:
+      pthread_mutex_lock(&p->lock);
+      p->state[id] = ARMING;
+      pthread_mutex_unlock(&p->lock);
+      // from here on it may be woken, but it is only parked once armed; if
+      // it is too late to wait, or it was woken meanwhile, it runs again
+      armed = p->ops->arm(p->arg, id);
+      pthread_mutex_lock(&p->lock);
+      if (armed && p->state[id] == ARMING){
+        p->state[id] = PARKED;
+        p->deadline[id] = deadline;
+        if (deadline < p->earliest)
+          __atomic_store_n(&p->earliest, deadline, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&p->lock);
+      } else {
+        pthread_mutex_unlock(&p->lock);
+        queue(w, id);
+      }
+      break;
+    case XPOOL_DONE:
+      pthread_mutex_lock(&p->lock);
+      p->state[id] = DONE;
+      if (__atomic_sub_fetch(&p->live, 1, __ATOMIC_RELEASE) == 0)
+        pthread_cond_broadcast(&p->wake);
+      pthread_mutex_unlock(&p->lock);
+      break;
+    }
+  }
+  current = NULL;
+  return NULL;
+}
+
+xpool * xpool_create(int workers, xpool_ops *ops, void *arg, int ntasks){
+  xpool *p = malloc(sizeof(xpool));
+  pthread_condattr_t attr;
+  int k;
+
+  if (workers <= 0)
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers <= 0)
+    workers = 1;
+  if (workers > ntasks)
+    workers = ntasks;
+  if (p == NULL
+      || (p->worker = calloc(workers, sizeof(xworker))) == NULL
+      || (p->state = calloc(ntasks, sizeof(int))) == NULL
+      || (p->deadline = calloc(ntasks, sizeof(long))) == NULL){
+    fprintf(stderr, "FAILURE IN <xpool_create>: OUT OF MEMORY\n");
+    exit(EXIT_FAILURE);
+  }
+  p->ops = ops;
+  p->arg = arg;
+  p->ntasks = ntasks;
+  p->nworkers = workers;
+  p->earliest = LONG_MAX;
+  p->queued = ntasks;
+  p->sleepers = 0;
+  p->live = ntasks;
+  p->cores = NULL;
+  p->ncores = 0;
+  pthread_mutex_init(&p->lock, NULL);
+  // deadlines are on the monotonic clock
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&p->wake, &attr);
+  pthread_condattr_destroy(&attr);
+  for (k = 0; k < workers; k++){
+    p->worker[k].pool = p;
+    p->worker[k].id = k;
+    pthread_mutex_init(&p->worker[k].lock, NULL);
+    if ((p->worker[k].slot = malloc(ntasks * sizeof(int))) == NULL){
+      fprintf(stderr, "FAILURE IN <xpool_create>: OUT OF MEMORY\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  // deal the tasks out evenly to begin with
+  for (k = 0; k < ntasks; k++){
+    xworker *w = &p->worker[k % workers];
+    w->slot[w->count++] = k;
+    p->state[k] = QUEUED;
+  }
+  return p;
+}
+
+void xpool_destroy(xpool *p){
+  int k;
+  for (k = 0; k < p->nworkers; k++){
+    pthread_mutex_destroy(&p->worker[k].lock);
+    free(p->worker[k].slot);
+  }
+  pthread_cond_destroy(&p->wake);
+  pthread_mutex_destroy(&p->lock);
+  free(p->deadline);
+  free(p->state);
+  free(p->worker);
+  free(p);
+}
+
+void xpool_run(xpool *p){
+  int k;
+  for (k = 0; k < p->nworkers; k++){
+    if (pthread_create(&p->worker[k].thread, NULL, work, &p->worker[k])){
+      fprintf(stderr, "FAILURE IN <xpool_run>: NO WORKER THREAD\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (k = 0; k < p->nworkers; k++)
+    pthread_join(p->worker[k].thread, NULL);
+}
+
+void xpool_wake(xpool *p, int id){
+  xworker *w = (current && current->pool == p)? current
+    : &p->worker[id % p->nworkers];
+
+  pthread_mutex_lock(&p->lock);
+  if (p->state[id] == ARMING)
+    p->state[id] = WOKEN;             // its worker queues it, once armed
+  if (p->state[id] != PARKED){
+    pthread_mutex_unlock(&p->lock);
+    return;
+  }
+  p->state[id] = QUEUED;
+  pthread_mutex_unlock(&p->lock);
+  queue(w, id);
+}
+
+int xpool_workers(xpool *p){
+  return p->nworkers;
+}
+
+void xpool_affinity(xpool *p, int *cores, int ncores){
+  p->cores = (ncores > 0)? cores : NULL;
+  p->ncores = ncores;
+}
+
+int xpool_pin(pthread_t thread, int core){
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(core, &set);
+  return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+/******************************************************************
+   Read a number from the topology of host core k in sysfs (its
+   package or core id). Returns -1 if there is no such number.
+******************************************************************/
+static int topology(int k, const char *what){
+  char path[80];
+  FILE *f;
+  int n = -1;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s",
+           k, what);
+  if ((f = fopen(path, "r")) != NULL){
+    if (fscanf(f, "%d", &n) != 1)
+      n = -1;
+    fclose(f);
+  }
+  return n;
+}
+
+// where a core comes in the order of xpool_cores
+typedef struct rank {
+  int smt;                            /* how many of its siblings come first */
+  int package, core, id;
+} rank;
+
+static int by_rank(const void *a, const void *b){
+  const rank *x = a, *y = b;
+  if (x->smt != y->smt)
+    return x->smt - y->smt;
+  if (x->package != y->package)
+    return x->package - y->package;
+  if (x->core != y->core)
+    return x->core - y->core;
+  return x->id - y->id;
+}
+
+int xpool_cores(const char *list, int **cores){
+  cpu_set_t allowed;
+  rank *r;
+  char *end;
+  long from, to;
+  int k, j, n = 0;
+
+  if (strcmp(list, "all")){
+    // an explicit list: ranges and single cores, separated by commas
+    if ((*cores = malloc(CPU_SETSIZE * sizeof(int))) == NULL){
+      fprintf(stderr, "FAILURE IN <xpool_cores>: OUT OF MEMORY\n");
+      exit(EXIT_FAILURE);
+    }
+    while (*list){
+      from = to = strtol(list, &end, 10);
+      if (end == list)
+        break;
+      if (*end == '-'){
+        list = end + 1;
+        to = strtol(list, &end, 10);
+        if (end == list)
+          break;
+      }
+      for (; from <= to && from >= 0 && from < CPU_SETSIZE
+             && n < CPU_SETSIZE; from++)
+        (*cores)[n++] = from;
+      if (from <= to || (*end != ',' && *end != '\0'))
+        break;
+      list = (*end)? end + 1 : end;
+    }
+    if (*list || n == 0){
+      free(*cores);
+      *cores = NULL;
+      return -1;
+    }
+    return n;
+  }
+
+  // every core we may run on, in order of their topology
+  if (sched_getaffinity(0, sizeof(allowed), &allowed)
+      || (r = malloc(CPU_SETSIZE * sizeof(rank))) == NULL
+      || (*cores = malloc(CPU_SETSIZE * sizeof(int))) == NULL){
+    fprintf(stderr, "FAILURE IN <xpool_cores>: NO HOST CORES\n");
+    exit(EXIT_FAILURE);
+  }
+  for (k = 0; k < CPU_SETSIZE; k++){
+    if (!CPU_ISSET(k, &allowed))
+      continue;
+    r[n].id = k;
+    r[n].package = topology(k, "physical_package_id");
+    r[n].core = topology(k, "core_id");
+    r[n].smt = 0;
+    for (j = 0; j < n; j++)
+      if (r[j].package == r[n].package && r[j].core == r[n].core
+          && r[n].core >= 0)
+        r[n].smt++;
+    n++;
+  }
+  qsort(r, n, sizeof(rank), by_rank);
+  for (k = 0; k < n; k++)
+    (*cores)[k] = r[k].id;
+  free(r);
+  return n;
+}
@@ -0,0 +1,94 @@
+#ifndef XPOOL_H
+#define XPOOL_H
+
+/**
+ * The worker pool (xpool.c): rather than give every CPU a host thread of
+ * its own, a fixed number of workers (as many as there are host cores, say)
+ * take the CPUs a slice at a time. Each worker keeps a deque of the CPUs
+ * that are ready to run: it takes the next one from the front of its own,
+ * runs it for a slice, and puts it on the back again; a worker whose deque
+ * runs dry steals from the back of somebody else's.
+ *
+ * A CPU that is waiting on another (see xspin.h) is parked: it leaves the
+ * deques altogether, and is put back on one when it is woken (xpool_wake),
+ * or once its deadline has passed, whichever comes first. A CPU that has
+ * stopped for good leaves them too, and the pool is done once every CPU
+ * has stopped.
+ *
+ * The pool knows nothing of CPUs as such: the things it schedules are
+ * numbered from 0, and it hands each number to the slice function.
+ **/
+
+#include <pthread.h>
+
+typedef struct xpool xpool;
+
+/* what has become of a task after its slice */
+enum {
+  XPOOL_AGAIN,   /* ready for another slice */
+  XPOOL_PARK,    /* waiting: leave it be until it is woken, or its deadline */
+  XPOOL_DONE     /* finished for good */
+};
+
+typedef struct xpool_ops {
+  /* run a slice of task id; for XPOOL_PARK, set *deadline (CLOCK_MONOTONIC,
+     in nanoseconds) */
+  int (*slice)( void *arg, int id, long *deadline );
+  /* the task has been parked: get ready to be woken, returning 0 if it
+     should be woken at once (it may already be too late to wait) */
+  int (*arm)( void *arg, int id );
+} xpool_ops;
+
+/* title: create/destroy a pool
+ * param: the number of workers (0 for one per host core), the operations
+ *        on the tasks and their argument, and the number of tasks
+ * returns: the new pool, with every task ready to run (exits on failure)
+ */
+extern xpool * xpool_create( int workers, xpool_ops *ops, void *arg,
+                             int ntasks );
+extern void xpool_destroy( xpool *p );
+
+/* title: run every task to the end
+ * function: starts the workers, and waits until each task is done
+ */
+extern void xpool_run( xpool *p );
+
+/* title: wake a parked task
+ * function: puts it back on a deque (that of the calling worker, if it is
+ *           one), or, if it is still being armed, has its worker do so once
+ *           it is; does nothing if the task is not parked
+ */
+extern void xpool_wake( xpool *p, int id );
+
+/* title: the number of workers in the pool
+ */
+extern int xpool_workers( xpool *p );
+
+/**
+ * Pinning: the threads running CPUs can be pinned to host cores, one core
+ * each, taken in turn from a list. Unless the list is given, the cores
+ * are taken in an order that suits the CPUs, which share memory
+ * among them: one hardware thread on each physical core of the first
+ * package, then of the next, and so on; only then a second hardware thread
+ * of each core, where there is SMT.
+ **/
+
+/* title: choose the host cores to pin threads to
+ * param: a list of cores, such as "0-3,8" (taken in the order given), or
+ *        "all" (every core this process may run on, in the order above);
+ *        and where to put the array of cores (free it with free)
+ * returns: the number of cores, or -1 if the list is no good
+ */
+extern int xpool_cores( const char *list, int **cores );
+
+/* title: pin the workers of the pool, worker k to cores[k % ncores]
+ * function: takes effect as they start (xpool_run); keep cores until then
+ */
+extern void xpool_affinity( xpool *p, int *cores, int ncores );
+
+/* title: pin a thread to a host core
+ * returns: 0 on success, else an error number (as for pthread functions)
+ */
+extern int xpool_pin( pthread_t thread, int core );
+
+#endif
@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#define X_INSTRUCTIONS_NOT_NEEDED
+#include "xis.h"
+#include "xcpu.h"
+#include "xspin.h"
+
+xspin * xspin_create(xdcache *dc, int ncpu){
+  xspin *spin = xcpu_calloc(ncpu, sizeof(xspin));
+  int k;
+  for (k = 0; k < ncpu; k++)
+    spin[k].need = XSPIN_HITS;
+  dc->spin = spin;
+  dc->nspin = ncpu;
+  dc->parked = 0;
+  return spin;
+}
+
+void xspin_destroy(xdcache *dc){
+  free(dc->spin);
+  dc->spin = NULL;
+  dc->nspin = 0;
+}
+
+void xspin_note(xcpu *c, unsigned short addr, unsigned short value){
+  xspin *s = c->spin;
+
+  if (c->state & X_STATE_DEBUG_ON)    // every cycle must be traced
+    return;
+  if (s->pc == c->pc && s->addr == addr && s->value == value
+      && s->state == c->state && !memcmp(s->regs, c->regs, sizeof(s->regs))){
+    if (++s->hits >= s->need)
+      s->ready = 1;
+    return;
+  }
+  s->pc = c->pc;
+  s->addr = addr;
+  s->value = value;
+  s->state = c->state;
+  memcpy(s->regs, c->regs, sizeof(s->regs));
+  s->hits = 0;
+}
+
+/******************************************************************
+   Is the byte at addr among the n in list? Returns its index, or
+   -1 if not.
+******************************************************************/
+static int find(unsigned short *list, int n, unsigned short addr){
+  int k;
+  for (k = 0; k < n; k++)
+    if (list[k] == addr)
+      return k;
+  return -1;
+}
+
+int xspin_probe(xcpu *c, IHandler *table, int max, int *length,
+                unsigned short *lastpc){
+  xspin *s = c->spin;
+  unsigned short start = c->pc, state = c->state, regs[X_MAX_REGS];
+  // every byte stored to, and what it held before the loop stored to it
+  unsigned short stored[2*XSPIN_MAX_LEN];
+  unsigned char was[2*XSPIN_MAX_LEN];
+  unsigned short r1, r2, sp, read_at = 0, write_at = 0, b;
+  unsigned int instruction;
+  int n = 0, nstored = 0, nread, nwrite, k, ok = 0;
+
+  memcpy(regs, c->regs, sizeof(regs));
+  s->memory = c->memory;
+  s->nwatch = 0;
+  if (max > XSPIN_MAX_LEN)
+    max = XSPIN_MAX_LEN;
+  while (n < max){
+    // work out what the next instruction will read and write, if anything
+    instruction = FETCH_WORD(c->pc);
+    r1 = c->regs[XIS_REG1(instruction)];
+    r2 = c->regs[XIS_REG2(instruction)];
+    sp = c->regs[X_STACK_REG];
+    nread = nwrite = 0;
+    switch ((instruction >> 8) & 0xFF){
+    case I_LOAD: case I_LOADA:
+      read_at = r1;
+      nread = WORD_SIZE;
+      break;
+    case I_LOADB:
+      read_at = r1;
+      nread = 1;
+      break;
+    case I_TNSET:
+      if (XIS_REG1(instruction) == XIS_REG2(instruction))
+        goto done;
+      read_at = write_at = r1;
+      nread = nwrite = WORD_SIZE;
+      break;
+    case I_STOR: case I_STORA:
+      write_at = r2;
+      nwrite = WORD_SIZE;
+      break;
+    case I_STORB:
+      write_at = r2;
+      nwrite = 1;
+      break;
+    case I_PUSH: case I_CALL: case I_CALLR:
+      write_at = sp - WORD_SIZE;
+      nwrite = WORD_SIZE;
+      break;
+    case I_POP: case I_RET:
+      read_at = sp;
+      nread = WORD_SIZE;
+      break;
+    case I_BAD: case I_STD: case I_CLI: case I_STI: case I_IRET: case I_TRAP:
+    case I_OUT: case I_LIT: case I_DIV: case I_IPI:
+      goto done;                      // a wait does none of these
+    default:
+      if (table[(instruction >> 8) & 0xFF] == bad)
+        goto done;
+    }
+    // bytes read from outside the loop must be watched; the rest were
+    // stored by the loop itself
+    for (k = 0; k < nread; k++){
+      b = (read_at + k) % MEMSIZE;
+      if (find(stored, nstored, b) >= 0 || find(s->watch, s->nwatch, b) >= 0)
+        continue;
+      if (s->nwatch == XSPIN_WATCH || c->decoded == NULL
+          || b >= c->decoded->reach)
+        goto done;
+      s->watch[s->nwatch] = b;
+      s->seen[s->nwatch++] = c->memory[b];
+    }
+    for (k = 0; k < nwrite; k++){
+      b = (write_at + k) % MEMSIZE;
+      if (find(stored, nstored, b) >= 0)
+        continue;
+      stored[nstored] = b;
+      was[nstored++] = c->memory[b];
+    }
+
+    *lastpc = c->pc;
+    xcpu_execute(c, table);
+    n++;
+    if (c->pc == start && c->state == state
+        && !memcmp(regs, c->regs, sizeof(regs))){
+      // back where it began: did it put back everything it stored?
+      for (k = 0; k < nstored; k++)
+        if (c->memory[stored[k]] != was[k])
+          goto done;
+      ok = 1;
+      goto done;
+    }
+  }
+ done:
+  *length = (ok)? n : 0;
+  if (ok){
+    s->ready = s->hits = 0;           // (the loop may have seen itself again)
+    s->need = XSPIN_HITS;
+  } else {
+    xspin_skip(c);
+  }
+  return n;
+}
+
+void xspin_skip(xcpu *c){
+  xspin *s = c->spin;
+  s->ready = s->hits = 0;
+  // it will be seen again: try it less often
+  if (s->need < (XSPIN_HITS << XSPIN_BACKOFF))
+    s->need *= 2;
+}
+
+static long since(struct timespec *t0){
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0->tv_sec) * 1000000000L + (t1.tv_nsec - t0->tv_nsec);
+}
+
+void xspin_waker(xdcache *dc, void (*wake)(void *, int), void *arg){
+  int k;
+  for (k = 0; k < dc->nspin; k++){
+    dc->spin[k].wake = wake;
+    dc->spin[k].waker = arg;
+  }
+}
+
+int xspin_arm(xcpu *c){
+  xspin *s = c->spin;
+  int k;
+
+  __atomic_store_n(&s->parked, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&c->decoded->parked, 1, __ATOMIC_SEQ_CST);
+  // a store that came before we were armed would not have rung the bell
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (k = 0; k < s->nwatch; k++)
+    if (__atomic_load_n(&c->memory[s->watch[k]], __ATOMIC_RELAXED)
+        != s->seen[k])
+      return 0;
+  return 1;
+}
+
+void xspin_disarm(xcpu *c){
+  __atomic_sub_fetch(&c->decoded->parked, 1, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&c->spin->parked, 0, __ATOMIC_RELEASE);
+}
+
+long xspin_park(xcpu *c, long timeout){
+  xspin *s = c->spin;
+  struct timespec t0, wait;
+  long slept = 0;
+  int changed;
+
+  changed = !xspin_arm(c);
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  while (!changed && !__atomic_load_n(&s->bell, __ATOMIC_ACQUIRE)
+         && (slept = since(&t0)) < timeout){
+    wait.tv_sec = (timeout - slept) / 1000000000L;
+    wait.tv_nsec = (timeout - slept) % 1000000000L;
+    syscall(SYS_futex, &s->bell, FUTEX_WAIT_PRIVATE, 0, &wait, NULL, 0);
+  }
+  if (!changed)
+    slept = since(&t0);
+
+  xspin_disarm(c);
+  // (the bell is cleared only now, so that one rung before we slept counts)
+  __atomic_store_n(&s->bell, 0, __ATOMIC_SEQ_CST);
+  return slept;
+}
+
+void xspin_wake(xcpu *c){
+  xspin *s = c->spin;
+  int parked;
+
+  __atomic_store_n(&s->bell, 1, __ATOMIC_SEQ_CST);
+  parked = __atomic_load_n(&s->parked, __ATOMIC_SEQ_CST);
+  if (parked && s->wake)
+    s->wake(s->waker, c->id);
+  else if (parked)
+    syscall(SYS_futex, &s->bell, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void xspin_ring(xdcache *dc, unsigned int addr, int n){
+  xspin *s;
+  int k, w;
+
+  for (k = 0; k < dc->nspin; k++){
+    s = &dc->spin[k];
+    if (!__atomic_load_n(&s->parked, __ATOMIC_ACQUIRE))
+      continue;
+    for (w = 0; w < s->nwatch; w++){
+      if ((s->watch[w] + MEMSIZE - addr % MEMSIZE) % MEMSIZE < n
+          && __atomic_load_n(&s->memory[s->watch[w]], __ATOMIC_RELAXED)
+             != s->seen[w]){
+        if (s->wake){
+          s->wake(s->waker, k);
+        } else {
+          __atomic_store_n(&s->bell, 1, __ATOMIC_RELEASE);
+          syscall(SYS_futex, &s->bell, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        }
+        break;
+      }
+    }
+  }
+}
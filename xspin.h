@@ -0,0 +1,116 @@
+#ifndef XSPIN_H
+#define XSPIN_H
+
+/**
+ * Spin-wait detection (xspin.c). A guest CPU waiting on a lock or a flag
+ * goes round a short loop that does nothing but read the same word, over and
+ * over, until another CPU changes it; meanwhile its host thread burns a
+ * whole core. Such loops are noticed at the atomic instructions (loada and
+ * tnset): when one is run at the same pc, reading the same value, with the
+ * CPU in exactly the same state as the last time, the CPU is probably going
+ * round in circles. The engine then stops, and xmpsim steps through one more
+ * time round the loop, noting every byte of memory it reads and writes. If
+ * the loop comes back to where it started without having changed anything,
+ * then every further time round will be the same, until somebody stores to
+ * one of the bytes it read; so the host thread can sleep (on a futex) until
+ * such a store, or until the CPU's next deadline, and the cycles it would
+ * have spent going round are credited to it, a whole loop at a time.
+ *
+ * The stores are caught by the predecoded instruction cache, which already
+ * hears of every store below its reach: only loops that read nothing but
+ * the loaded image (where locks and flags live) are put to sleep.
+ *
+ * When the CPUs are run by a worker pool (xpool.h) rather than a thread
+ * each, there is no thread to put to sleep: the CPU is parked in the pool
+ * instead, armed (xspin_arm) so that a store to its loop calls the waker
+ * given to xspin_waker, and disarmed once it runs again.
+ **/
+
+#define XSPIN_HITS 2        /* identical atomic reads before a loop is tried */
+#define XSPIN_MAX_LEN 64    /* longest loop (in instructions) that is tried */
+#define XSPIN_WATCH 16      /* most bytes a loop may read from outside */
+#define XSPIN_BACKOFF 16    /* failed loops are tried up to 2^16 times less */
+
+typedef struct xspin {
+  int ready;                          /* stop, and try the loop (must be
+                                         first: read by translated code) */
+  int hits;                           /* identical atomic reads in a row */
+  int need;                           /* hits needed before the next try */
+  unsigned short pc, addr, value, state;  /* the last atomic read */
+  unsigned short regs[X_MAX_REGS];
+  unsigned char *memory;              /* the memory the loop reads */
+  int nwatch;                         /* bytes the loop reads */
+  unsigned short watch[XSPIN_WATCH];
+  unsigned char seen[XSPIN_WATCH];    /* what it read in each */
+  int parked;                         /* asleep on bell */
+  unsigned int bell;                  /* futex: rung by a store to watch */
+  void (*wake)(void *, int);          /* or, if set, called with the CPU id */
+  void *waker;                        /* and this */
+} X_ALIGNED xspin;
+
+/* title: create/destroy the spin detectors of ncpu CPUs
+ * param: the predecoded instruction cache that the CPUs share, which will
+ *        wake them when their loops are stored to
+ * returns: an array of ncpu detectors, one per CPU (exits on failure)
+ */
+extern xspin * xspin_create( xdcache *dc, int ncpu );
+extern void xspin_destroy( xdcache *dc );
+
+/* title: note an atomic read (called by loada and tnset, after the fact)
+ * param: pointer to CPU context, with pc just past the instruction, and the
+ *        address and value read
+ * function: sets c->spin->ready once the same read has been seen often
+ *           enough in a row
+ */
+extern void xspin_note( xcpu *c, unsigned short addr, unsigned short value );
+
+/* title: step once round a suspected spin loop
+ * param: pointer to CPU context, jump table, the most instructions that may
+ *        be run, where to put the length of the loop, and the pc of the last
+ *        instruction run (left as it is if max is 0, and none is)
+ * function: runs the loop with xcpu_execute, from c->pc back round to c->pc,
+ *           and checks that it is a pure wait: it must end where it began,
+ *           with the same registers, having put back whatever it stored, and
+ *           having read only bytes that others' stores can be caught on
+ * returns: the number of instructions run; *length is 0 if it is no wait
+ */
+extern int xspin_probe( xcpu *c, IHandler *table, int max, int *length,
+                        unsigned short *lastpc );
+
+/* title: let a suspected spin loop be, for now
+ * function: as when xspin_probe finds it is no wait, the next loop is not
+ *           tried until it has been seen twice as often as this one was
+ */
+extern void xspin_skip( xcpu *c );
+
+/* title: sleep until the loop's bytes are stored to, or for timeout
+ * returns: the nanoseconds slept (0 if they changed before it could sleep)
+ */
+extern long xspin_park( xcpu *c, long timeout );
+
+/* title: have stores to the loops of these CPUs call wake, not the futex
+ * param: the cache, the function to call with arg and the id of the CPU
+ *        whose loop was stored to, and arg
+ */
+extern void xspin_waker( xdcache *dc, void (*wake)( void *, int ), void *arg );
+
+/* title: arm/disarm the CPU's loop, without sleeping on it
+ * function: once armed, a store that changes one of the bytes the loop
+ *           reads rings the bell (or calls the waker), until it is disarmed
+ * returns: (xspin_arm) 0 if the bytes have already changed, else 1
+ */
+extern int xspin_arm( xcpu *c );
+extern void xspin_disarm( xcpu *c );
+
+/* title: wake the CPU from its wait, whatever its loop reads (for the timer)
+ * function: if it is not yet asleep, its next xspin_park returns at once
+ */
+extern void xspin_wake( xcpu *c );
+
+/* title: wake any CPU sleeping on the n bytes at addr (called by the cache)
+ * function: only if they no longer hold what the CPU read; storing the same
+ *           value again (as a tnset on a held lock does) wakes nobody
+ */
+extern void xspin_ring( xdcache *dc, unsigned int addr, int n );
+
+#endif